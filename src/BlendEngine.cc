@@ -0,0 +1,222 @@
+/*
+    Fixed Point Multichannel Blend Engine.
+
+    Copyright (C) 2020 KML Vision GmbH.
+*/
+#include <cmath>
+#include "BlendEngine.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BLEND_SSE2
+#include <emmintrin.h>
+#endif
+
+
+using namespace std;
+
+
+namespace {
+
+/// Fixed point form of a channel's min/max window and contrast:
+/// value = min(255, (min(max(v - min, 0), dmax) * scale) >> shift)
+struct Window {
+    unsigned int min;
+    unsigned int dmax;   // clamp keeping the shifted product within 16 bits
+    unsigned int scale;  // 16 bit multiplier
+    unsigned int shift;  // 1..31
+};
+
+
+Window makeWindow(const BlendChannel &channel) {
+    Window w;
+    w.min = (channel.min > 65535) ? 65535 : channel.min;
+
+    const double range = (channel.max > channel.min) ? (double) (channel.max - channel.min) : 1.0;
+    const double factor = (channel.contrast > 0.0) ? 255.0 * channel.contrast / range : 0.0;
+
+    // Use the largest shift for which the multiplier still fits into 16 bits
+    w.shift = 31;
+    while (w.shift > 1 && factor * (double) (1u << w.shift) > 65535.0) --w.shift;
+    const double scale = floor(factor * (double) (1u << w.shift) + 0.5);
+    w.scale = (scale > 65535.0) ? 65535 : (unsigned int) scale;
+
+    // Clamp offsets just beyond the point at which the output saturates
+    uint64_t dmax = (w.scale > 0) ? ((uint64_t) 255 << w.shift) / w.scale + 1 : 65535;
+    w.dmax = (dmax > 65535) ? 65535 : (unsigned int) dmax;
+
+    return w;
+}
+
+
+/// Scalar windowing of a single sample - gives identical results to the SSE2 path
+inline unsigned int window(unsigned int v, const Window &w) {
+    unsigned int d = (v > w.min) ? v - w.min : 0;
+    if (d > w.dmax) d = w.dmax;
+    unsigned int g = (unsigned int) (((uint64_t) d * w.scale) >> w.shift);
+    return (g > 255) ? 255 : g;
+}
+
+
+/// Saturating add of a colour weighted grey value: exact floor(colour * gv / 255)
+inline void accumulate(uint8_t &plane, unsigned int colour, unsigned int gv) {
+    unsigned int v = plane + (colour * gv) / 255;
+    plane = (uint8_t) ((v > 255) ? 255 : v);
+}
+
+
+#ifdef BLEND_SSE2
+/// SSE2 windowing of 8 16 bit samples at a time
+struct SSEWindow {
+    __m128i min, dmax, scale, v255, hi_count, lo_count;
+    bool high;
+
+    SSEWindow(const Window &w) {
+        min = _mm_set1_epi16((short) w.min);
+        dmax = _mm_set1_epi16((short) w.dmax);
+        scale = _mm_set1_epi16((short) w.scale);
+        v255 = _mm_set1_epi16(255);
+        high = (w.shift >= 16);
+        hi_count = _mm_cvtsi32_si128(high ? w.shift - 16 : 16 - w.shift);
+        lo_count = _mm_cvtsi32_si128(high ? 0 : w.shift);
+    }
+
+    /// min(a,b) for unsigned 16 bit values is a - subs(a,b) in SSE2
+    __m128i operator()(__m128i v) const {
+        __m128i d = _mm_subs_epu16(v, min);
+        d = _mm_sub_epi16(d, _mm_subs_epu16(d, dmax));
+        __m128i hi = _mm_mulhi_epu16(d, scale);
+        __m128i s;
+        if (high) s = _mm_srl_epi16(hi, hi_count);
+        else s = _mm_or_si128(_mm_sll_epi16(hi, hi_count), _mm_srl_epi16(_mm_mullo_epi16(d, scale), lo_count));
+        return _mm_sub_epi16(s, _mm_subs_epu16(s, v255));
+    }
+
+    /// Window 16 samples into 16 grey values
+    __m128i window16(const uint16_t *src) const {
+        __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+        __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 8));
+        return _mm_packus_epi16((*this)(v0), (*this)(v1));
+    }
+
+    __m128i window16(const uint8_t *src) const {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+        return _mm_packus_epi16((*this)(_mm_unpacklo_epi8(v, zero)), (*this)(_mm_unpackhi_epi8(v, zero)));
+    }
+};
+#endif
+
+
+/// Window one row of a channel into 8 bit grey values
+void windowRow(const BlendChannel &channel, const Window &w, unsigned int y, unsigned int width, uint8_t *out) {
+    const uint8_t *src8 = static_cast<const uint8_t *>(channel.data) + (size_t) y * width;
+    const uint16_t *src16 = static_cast<const uint16_t *>(channel.data) + (size_t) y * width;
+    unsigned int x = 0;
+
+#ifdef BLEND_SSE2
+    const SSEWindow windowed(w);
+    for (; x + 16 <= width; x += 16) {
+        __m128i gv = (channel.bpc == 16) ? windowed.window16(src16 + x) : windowed.window16(src8 + x);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x), gv);
+    }
+#endif
+
+    for (; x < width; ++x) out[x] = (uint8_t) window((channel.bpc == 16) ? src16[x] : src8[x], w);
+}
+
+
+/// Window, colour and accumulate one row of a channel into the r, g and b planes
+void blendRow(const BlendChannel &channel, const Window &w, unsigned int y, unsigned int width,
+              uint8_t *r, uint8_t *g, uint8_t *b) {
+    const uint8_t *src8 = static_cast<const uint8_t *>(channel.data) + (size_t) y * width;
+    const uint16_t *src16 = static_cast<const uint16_t *>(channel.data) + (size_t) y * width;
+    unsigned int x = 0;
+
+#ifdef BLEND_SSE2
+    const SSEWindow windowed(w);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i div255 = _mm_set1_epi16((short) 0x8081);
+    const __m128i full = _mm_set1_epi8((char) 0xFF);
+    const __m128i vr = _mm_set1_epi16(channel.r);
+    const __m128i vg = _mm_set1_epi16(channel.g);
+    const __m128i vb = _mm_set1_epi16(channel.b);
+
+    // floor(colour * gv / 255) for 8 grey values, using x/255 == (x*0x8081)>>23 for 16 bit x
+    auto weighted = [&](__m128i gv, __m128i colour) -> __m128i {
+        return _mm_srli_epi16(_mm_mulhi_epu16(_mm_mullo_epi16(gv, colour), div255), 7);
+    };
+
+    auto add = [&](uint8_t *plane, __m128i g0, __m128i g1, __m128i colour) {
+        __m128i q = _mm_packus_epi16(weighted(g0, colour), weighted(g1, colour));
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(plane + x));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(plane + x), _mm_adds_epu8(p, q));
+    };
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i gv;
+        if (channel.single_valued) gv = full;
+        else if (channel.bpc == 16) gv = windowed.window16(src16 + x);
+        else gv = windowed.window16(src8 + x);
+        __m128i g0 = _mm_unpacklo_epi8(gv, zero);
+        __m128i g1 = _mm_unpackhi_epi8(gv, zero);
+        add(r, g0, g1, vr);
+        add(g, g0, g1, vg);
+        add(b, g0, g1, vb);
+    }
+#endif
+
+    for (; x < width; ++x) {
+        unsigned int gv;
+        if (channel.single_valued) gv = 255;
+        else gv = window((channel.bpc == 16) ? src16[x] : src8[x], w);
+        accumulate(r[x], channel.r, gv);
+        accumulate(g[x], channel.g, gv);
+        accumulate(b[x], channel.b, gv);
+    }
+}
+
+}
+
+
+void BlendEngine::blend(const std::vector<BlendChannel> &channels, unsigned int width, unsigned int height,
+                        uint8_t *dst) {
+    const size_t np = (size_t) width * height;
+
+    std::vector<Window> windows;
+    for (unsigned int c = 0; c < channels.size(); ++c) windows.push_back(makeWindow(channels[c]));
+
+    // Accumulate into planar r, g and b buffers and interleave each row once all channels are done
+    std::vector<uint8_t> planes(3 * np, 0);
+
+#if defined(_OPENMP)
+#pragma omp parallel for
+#endif
+    for (int y = 0; y < (int) height; ++y) {
+        uint8_t *r = &planes[(size_t) y * width];
+        uint8_t *g = r + np;
+        uint8_t *b = g + np;
+
+        for (unsigned int c = 0; c < channels.size(); ++c) {
+            blendRow(channels[c], windows[c], y, width, r, g, b);
+        }
+
+        uint8_t *out = dst + (size_t) y * width * 3;
+        for (unsigned int x = 0; x < width; ++x) {
+            out[3 * x] = r[x];
+            out[3 * x + 1] = g[x];
+            out[3 * x + 2] = b[x];
+        }
+    }
+}
+
+
+void BlendEngine::window(const BlendChannel &channel, unsigned int width, unsigned int height, uint8_t *dst) {
+    const Window w = makeWindow(channel);
+
+#if defined(_OPENMP)
+#pragma omp parallel for
+#endif
+    for (int y = 0; y < (int) height; ++y) {
+        windowRow(channel, w, y, width, dst + (size_t) y * width);
+    }
+}
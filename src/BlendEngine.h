@@ -0,0 +1,52 @@
+/*
+    Fixed Point Multichannel Blend Engine.
+
+    Copyright (C) 2020 KML Vision GmbH.
+*/
+
+
+#ifndef _BLENDENGINE_H
+#define _BLENDENGINE_H
+
+#include <vector>
+#include <cstdint>
+
+
+/// A single greyscale channel to be blended
+struct BlendChannel {
+    const void *data;       // raw greyscale samples
+    unsigned int bpc;       // 8 or 16 bits per sample
+    unsigned int min;       // sample value mapped to black
+    unsigned int max;       // sample value mapped to full intensity
+    float contrast;         // contrast factor applied after windowing
+    bool single_valued;     // whether to draw the whole channel at full intensity
+    uint8_t r, g, b;        // channel colour
+};
+
+
+/// Blend engine that windows, colours and accumulates raw 8/16 bit greyscale channels
+/// into an interleaved 8 bit RGB buffer in a single pass over each channel. Windowing
+/// and colour weighting are done in fixed point, using SSE2 where available, and the
+/// accumulation saturates at 255. No intermediate per-channel buffers are created.
+struct BlendEngine {
+
+    /// Blend channels into an RGB buffer
+    /** @param channels : channels to blend - all of size width x height
+        @param width : width in pixels
+        @param height : height in pixels
+        @param dst : output buffer of width x height x 3 bytes
+    */
+    static void blend(const std::vector<BlendChannel> &channels, unsigned int width, unsigned int height,
+                      uint8_t *dst);
+
+    /// Window a single channel into 8 bit grey values, as done by blend()
+    /** @param channel : channel to window - single_valued and colour are ignored
+        @param width : width in pixels
+        @param height : height in pixels
+        @param dst : output buffer of width x height bytes
+    */
+    static void window(const BlendChannel &channel, unsigned int width, unsigned int height, uint8_t *dst);
+
+};
+
+#endif
@@ -181,6 +181,9 @@ void CVT::send( Session* session ){
 
   // Set up our TileManager object
   TileManager tilemanager( session->tileCache, *session->image, session->watermark, compressor, session->logfile, session->loglevel );
+  tilemanager.setBulkRegionTiles( session->bulkRegionTiles );
+  tilemanager.setRegionThreads( session->regionThreads );
+  tilemanager.setImagePool( session->imagePool );
 
 
   // First calculate histogram if we have asked for either binarization,
@@ -204,8 +207,7 @@ void CVT::send( Session* session ){
 
     // Insert the histogram into our image cache
     const string key = (*session->image)->getImagePath();
-    imageCacheMapType::iterator i = session->imageCache->find(key);
-    if( i != session->imageCache->end() ) (i->second).histogram = (*session->image)->histogram;
+    session->imageCache->setHistogram( key, (*session->image)->histogram );
   }
 
 
@@ -27,13 +27,6 @@
 #define _CACHE_H
 
 
-// Fix missing snprintf in Windows
-#if defined _MSC_VER && _MSC_VER<1900
-#define snprintf _snprintf
-#endif
-
-
-
 // Test for available map types. Try to use an efficient hashed map type if possible
 // and define this as HASHMAP, which we can then use elsewhere.
 #if defined(HAVE_UNORDERED_MAP)
@@ -81,18 +74,154 @@ namespace __gnu_cxx {
 
 #include <iostream>
 #include <list>
+#include <set>
+#include <vector>
 #include <string>
-#include "RawTile.h"
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <type_traits>
+#include <stdint.h>
+#include "TileCache.h"
+#include "CacheStatistics.h"
+
+
+// Tile keys carry their own hash - also provide it to the older hash map types
+#if defined(HAVE_TR1_UNORDERED_MAP) && !defined(HAVE_UNORDERED_MAP)
+namespace std { namespace tr1 {
+  template <>
+    struct hash<TileKey> {
+      size_t operator() ( const TileKey& k ) const { return (size_t) k.hash; }
+    };
+} }
+#elif defined(HAVE_EXT_HASH_MAP) && !defined(HAVE_UNORDERED_MAP)
+namespace __gnu_cxx {
+  template <>
+    struct hash<TileKey> {
+      size_t operator() ( const TileKey& k ) const { return (size_t) k.hash; }
+    };
+}
+#endif
+
+
+
+/// Approximate access frequencies of recently used keys.
+/**
+ *  A count-min sketch with 4 rows of 8 bit saturating counters. All counters
+ *  are halved once the number of recorded accesses reaches 10 times the width
+ *  of the sketch, so that estimates reflect recent rather than all-time popularity.
+ */
+
+class FrequencySketch {
+
+ private:
+
+  /// Counters - 4 rows of width counters
+  std::vector<unsigned char> counters;
+
+  /// Width of each row - 1, width being a power of 2
+  uint64_t mask;
+
+  /// Accesses recorded since the last halving
+  unsigned long additions;
+
+  /// Counter index of a hashed key within a row
+  /** @param hash key hash
+      @param row row number
+   */
+  size_t index( uint64_t hash, unsigned int row ) const {
+    static const uint64_t seeds[4] = { 0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+				       0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL };
+    uint64_t h = ( hash + seeds[row] ) * seeds[(row+1) & 3];
+    return (size_t) ( row * (mask+1) + ( (h >> 32) & mask ) );
+  }
+
+
+ public:
+
+  /// Constructor
+  /** @param width number of counters per row - rounded up to a power of 2 */
+  FrequencySketch( unsigned long width ) {
+    uint64_t w = 256;
+    while( w < width ) w <<= 1;
+    mask = w - 1;
+    additions = 0;
+    counters.assign( 4*w, 0 );
+  };
+
+
+  /// Record an access
+  /** @param hash key hash */
+  void increment( uint64_t hash ) {
+    for( unsigned int row = 0; row < 4; row++ ){
+      unsigned char& c = counters[ index( hash, row ) ];
+      if( c < 255 ) c++;
+    }
+    if( ++additions >= 10*(mask+1) ){
+      for( size_t i = 0; i < counters.size(); i++ ) counters[i] >>= 1;
+      additions /= 2;
+    }
+  }
+
+
+  /// Estimate the number of recent accesses
+  /** @param hash key hash
+      @return estimated frequency
+   */
+  unsigned int estimate( uint64_t hash ) const {
+    unsigned int f = 255;
+    for( unsigned int row = 0; row < 4; row++ ){
+      unsigned int c = counters[ index( hash, row ) ];
+      if( c < f ) f = c;
+    }
+    return f;
+  }
+
+};
+
+
+
+/// Tile cache eviction policies
+enum EvictionPolicy {
+  LRU_EVICTION,     ///< evict the least recently used tile
+  GDSF_EVICTION     ///< GreedyDual-Size-Frequency: evict the tile that is cheapest to regenerate per byte
+};
 
 
 
-/// Cache to store raw tile data
+/// A single list of tiles with its own lock and byte budget.
+/**
+ *  Tiles are indexed by Key: a string for the ad hoc caches of derived tiles
+ *  (CacheShard) or a TileKey within Cache, which avoids building and hashing
+ *  strings on each lookup. By default the least recently used tiles are evicted first. With the
+ *  GreedyDual-Size-Frequency policy, each tile has a priority of
+ *  L + hits * cost / size, where cost is the time it took to generate the tile
+ *  and L is an inflation value, set to the priority of the last evicted tile,
+ *  which ages tiles that are no longer accessed. The tile with the lowest
+ *  priority is evicted first.
+ *
+ *  An optional TinyLFU admission filter records all lookups in a frequency
+ *  sketch. When a new tile would cause an eviction, it is only admitted if
+ *  it has been requested more often than the tile it would displace, so that
+ *  one-off scans do not flush frequently reused tiles. Tiles inserted as part
+ *  of a bulk read are only admitted if they fit without evicting anything.
+ */
 
-class Cache {
+template < class Key > class KeyedCacheShard {
 
 
  private:
 
+  /// A cached tile and its eviction metadata
+  struct Entry {
+    Key key;
+    RawTile tile;
+    unsigned long size;     ///< accounted size in bytes
+    unsigned long cost;     ///< time taken to generate the tile in microseconds
+    unsigned long hits;     ///< number of accesses
+    double priority;        ///< GDSF priority
+  };
+
   /// Basic object storage size
   int tileSize;
 
@@ -102,28 +231,45 @@ class Cache {
   /// Current memory running total
   unsigned long currentSize;
 
+  /// Eviction policy
+  EvictionPolicy policy;
+
+  /// GDSF inflation value
+  double inflation;
+
+  /// TinyLFU admission filter - NULL if disabled
+  FrequencySketch* sketch;
+
+  /// Number of tiles admitted and rejected
+  unsigned long admitted, rejected;
+
+  /// Statistics to update - NULL if none
+  CacheStatistics* statistics;
+
   /// Main cache storage typedef
 #ifdef HAVE_EXT_POOL_ALLOCATOR
-  typedef std::list < std::pair<const std::string,RawTile>,
-    __gnu_cxx::__pool_alloc< std::pair<const std::string,RawTile> > > TileList;
+  typedef std::list < Entry, __gnu_cxx::__pool_alloc< Entry > > TileList;
 #else
-  typedef std::list < std::pair<const std::string,RawTile> > TileList;
+  typedef std::list < Entry > TileList;
 #endif
 
   /// Main cache list iterator typedef
-  typedef std::list < std::pair<const std::string,RawTile> >::iterator List_Iter;
+  typedef typename TileList::iterator List_Iter;
 
   /// Index typedef
 #ifdef HAVE_EXT_POOL_ALLOCATOR
-  typedef HASHMAP < std::string, List_Iter,
-    __gnu_cxx::hash< const std::string >,
-    std::equal_to< const std::string >,
-    __gnu_cxx::__pool_alloc< std::pair<const std::string, List_Iter> >
+  typedef HASHMAP < Key, List_Iter,
+    __gnu_cxx::hash< const Key >,
+    std::equal_to< const Key >,
+    __gnu_cxx::__pool_alloc< std::pair<const Key, List_Iter> >
     > TileMap;
 #else
-  typedef HASHMAP < std::string,List_Iter > TileMap;
+  typedef HASHMAP < Key,List_Iter > TileMap;
 #endif
 
+  /// GDSF priority queue typedef: entries are ordered by priority
+  typedef std::set < std::pair<double,const Entry*> > PriorityQueue;
+
 
   /// Main cache storage object
   TileList tileList;
@@ -131,14 +277,31 @@ class Cache {
   /// Main Cache storage index object
   TileMap tileMap;
 
+  /// GDSF priority queue - only used with GDSF_EVICTION
+  PriorityQueue priorities;
+
+  /// Lock protecting our list and index
+  std::mutex lock;
+
+
+  /// Set the GDSF priority of an entry and (re)insert it into the priority queue
+  /** @param e entry */
+  void _prioritize( Entry& e ) {
+    if( policy != GDSF_EVICTION ) return;
+    priorities.erase( std::make_pair( e.priority, (const Entry*) &e ) );
+    // Add 1 so that tiles without a measured cost are still ordered by frequency and size
+    e.priority = inflation + (double) e.hits * (double) (e.cost + 1) / (double) e.size;
+    priorities.insert( std::make_pair( e.priority, (const Entry*) &e ) );
+  }
+
 
   /// Internal touch function
   /** Touches a key in the Cache and makes it the most recently used
    *  @param key to be touched
    *  @return a Map_Iter pointing to the key that was touched.
    */
-  TileMap::iterator _touch( const std::string &key ) {
-    TileMap::iterator miter = tileMap.find( key );
+  typename TileMap::iterator _touch( const Key &key ) {
+    typename TileMap::iterator miter = tileMap.find( key );
     if( miter == tileMap.end() ) return miter;
     // Move the found node to the head of the list.
     tileList.splice( tileList.begin(), tileList, miter->second );
@@ -151,11 +314,14 @@ class Cache {
    *  @param miter Map_Iter that points to the key to remove
    *  @warning miter is no longer usable after being passed to this function.
    */
-  void _remove( const TileMap::iterator &miter ) {
+  void _remove( const typename TileMap::iterator &miter ) {
     // Reduce our current size counter
-    currentSize -= ( (miter->second->second).dataLength +
-		     ( (miter->second->second).filename.capacity() + (miter->second->first).capacity() )*sizeof(char) +
-		     tileSize );
+    currentSize -= miter->second->size;
+    if( statistics ){
+      const RawTile& t = miter->second->tile;
+      statistics->add( CacheStatistics::BYTES, t.compressionType, t.resolution, -(int64_t) miter->second->size );
+    }
+    if( policy == GDSF_EVICTION ) priorities.erase( std::make_pair( miter->second->priority, (const Entry*) &(*miter->second) ) );
     tileList.erase( miter->second );
     tileMap.erase( miter );
   }
@@ -163,57 +329,122 @@ class Cache {
 
   /// Interal remove function
   /** @param key to remove */
-  void _remove( const std::string &key ) {
-    TileMap::iterator miter = tileMap.find( key );
+  void _remove( const Key &key ) {
+    typename TileMap::iterator miter = tileMap.find( key );
     this->_remove( miter );
   }
 
 
+  /// Return the entry our eviction policy would remove next - the shard must not be empty
+  const Entry* _victim() {
+    if( policy == GDSF_EVICTION ) return priorities.begin()->second;
+    return &tileList.back();
+  }
+
+
+  /// Remove the entry chosen by our eviction policy
+  /** @param evicted if not NULL, the evicted tile is added to this list */
+  void _evict( std::vector<RawTile>* evicted ) {
+    const Entry* victim = this->_victim();
+    if( policy == GDSF_EVICTION ) inflation = victim->priority;
+    if( evicted ) evicted->push_back( victim->tile );
+    if( statistics ) statistics->add( CacheStatistics::EVICTIONS, victim->tile.compressionType, victim->tile.resolution );
+    this->_remove( victim->key );
+  }
+
+
+  /// Hash a key for our frequency sketch
+  static uint64_t _hash( const Key& key ) {
+    return (uint64_t) std::hash<Key>()( key );
+  }
+
+
+  /// Return the heap memory held by a key
+  static unsigned long _keySize( const std::string& key ) { return key.capacity(); }
+  static unsigned long _keySize( const TileKey& key ) { return 0; }
+
+
 
  public:
 
   /// Constructor
-  /** @param max Maximum cache size in MB */
-  Cache( float max ) {
-    maxSize = (unsigned long)(max*1024000) ; currentSize = 0;
-    // 64 chars added at the end represents an average string length
-    tileSize = sizeof( RawTile ) + sizeof( std::pair<const std::string,RawTile> ) +
-      sizeof( std::pair<const std::string, List_Iter> ) + sizeof(char)*64 + sizeof(List_Iter);
+  /** @param max Maximum shard size in bytes
+      @param p eviction policy
+      @param admission whether to use a TinyLFU admission filter
+      @param s statistics to update or NULL for none
+   */
+  KeyedCacheShard( unsigned long max, EvictionPolicy p = LRU_EVICTION, bool admission = false,
+		   CacheStatistics* s = NULL ) {
+    maxSize = max; currentSize = 0;
+    policy = p; inflation = 0.0;
+    admitted = rejected = 0;
+    statistics = s;
+    // Size the sketch for tiles of around 8kB
+    sketch = admission ? new FrequencySketch( max / 8192 ) : NULL;
+    tileSize = sizeof( RawTile ) + sizeof( Entry ) +
+      sizeof( std::pair<const Key, List_Iter> ) + sizeof(List_Iter);
+    // 64 chars added for string keys represents an average string length
+    if( std::is_same<Key,std::string>::value ) tileSize += sizeof(char)*64;
+    if( policy == GDSF_EVICTION ) tileSize += sizeof( typename PriorityQueue::value_type ) + 4*sizeof(void*);
   };
 
 
   /// Destructor
-  ~Cache() {
+  ~KeyedCacheShard() {
+    if( sketch ) delete sketch;
+    priorities.clear();
     tileList.clear();
     tileMap.clear();
   }
 
 
   /// Insert a tile
-  /** @param r Tile to be inserted */
-  void insert( const RawTile& r ) {
-
-    if( maxSize == 0 ) return;
+  /** @param key index of the tile
+      @param r Tile to be inserted
+      @param cost time taken to generate the tile in microseconds
+      @param bulk whether the tile is part of a bulk read, which must not displace other tiles
+      @param evicted if not NULL, tiles evicted to make room are added to this list
+   */
+  void insert( const Key& key, const RawTile& r, unsigned long cost = 0, bool bulk = false,
+	       std::vector<RawTile>* evicted = NULL ) {
 
-    std::string key = this->getIndex( r.filename, r.resolution, r.tileNum,
-				      r.hSequence, r.vSequence, r.compressionType, r.quality );
+    std::lock_guard<std::mutex> guard( lock );
 
     // Touch the key, if it exists
-    TileMap::iterator miter = this->_touch( key );
+    typename TileMap::iterator miter = this->_touch( key );
 
     // Check whether this tile exists in our cache
     if( miter != tileMap.end() ){
       // Check the timestamp and delete if necessary
-      if( miter->second->second.timestamp < r.timestamp ){
+      if( miter->second->tile.timestamp < r.timestamp ){
 	this->_remove( miter );
       }
       // If this index already exists and it is up to date, do nothing
       else return;
     }
 
+    // Tiles larger than our whole budget are never cached, as they would evict everything else
+    unsigned long size = r.dataLength + (r.filename.capacity()+_keySize(key))*sizeof(char) + tileSize;
+    if( size > maxSize ){
+      rejected++;
+      return;
+    }
+
+    // Check whether we admit a tile that would cause an eviction
+    if( currentSize + size > maxSize && !tileList.empty() ){
+      if( bulk || ( sketch && sketch->estimate( _hash(key) ) <= sketch->estimate( _hash(this->_victim()->key) ) ) ){
+	rejected++;
+	return;
+      }
+    }
+    admitted++;
+
     // Store the key if it doesn't already exist in our cache
     // Ok, do the actual insert at the head of the list
-    tileList.push_front( std::make_pair(key,r) );
+    // Cached data is shared with the tiles we hand out, so hits do not copy it
+    Entry entry = { key, r, 0, cost, 1, 0.0 };
+    entry.tile.share();
+    tileList.push_front( std::move( entry ) );
 
     // And store this in our map
     List_Iter liter = tileList.begin();
@@ -222,54 +453,481 @@ class Cache {
     // Update our total current size variable. Use the string::capacity function
     // rather than length() as std::string can allocate slightly more than necessary
     // The +1 is for the terminating null byte
-    currentSize += (r.dataLength + (r.filename.capacity()+key.capacity())*sizeof(char) + tileSize);
+    liter->size = size;
+    currentSize += liter->size;
+    this->_prioritize( *liter );
 
-    // Check to see if we need to remove an element due to exceeding max_size
-    while( currentSize > maxSize ) {
-      // Remove the last element
-      liter = tileList.end();
-      --liter;
-      this->_remove( liter->first );
+    if( statistics ){
+      statistics->add( CacheStatistics::INSERTIONS, r.compressionType, r.resolution );
+      statistics->add( CacheStatistics::BYTES, r.compressionType, r.resolution, size );
     }
 
+    // Check to see if we need to remove an element due to exceeding max_size
+    while( currentSize > maxSize && !tileList.empty() ) this->_evict( evicted );
+
   }
 
 
-  /// Return the number of tiles in the cache
-  unsigned int getNumElements() { return tileList.size(); }
+  /// Get a tile from the shard
+  /** @param key index of the tile
+      @param tile RawTile to receive the cached tile, sharing its data
+      @return true if the tile was found
+   */
+  bool getTile( const Key& key, RawTile& tile ) {
 
+    std::lock_guard<std::mutex> guard( lock );
 
-  /// Return the number of MB stored
-  float getMemorySize() { return (float) ( currentSize / 1024000.0 ); }
+    // Record both hits and misses in our admission filter
+    if( sketch ) sketch->increment( _hash(key) );
+
+    typename TileMap::iterator miter = this->_touch( key );
+    if( miter == tileMap.end() ) return false;
+
+    miter->second->hits++;
+    this->_prioritize( *miter->second );
+
+    tile = miter->second->tile;
+    return true;
+  }
+
+
+  /// Return the number of tiles in the shard
+  unsigned int getNumElements() {
+    std::lock_guard<std::mutex> guard( lock );
+    return tileList.size();
+  }
+
+
+  /// Return the number of bytes stored
+  unsigned long getSize() {
+    std::lock_guard<std::mutex> guard( lock );
+    return currentSize;
+  }
+
+
+  /// Return the number of tiles admitted into the shard
+  unsigned long getAdmitted() {
+    std::lock_guard<std::mutex> guard( lock );
+    return admitted;
+  }
+
+
+  /// Return the number of tiles rejected by admission control
+  unsigned long getRejected() {
+    std::lock_guard<std::mutex> guard( lock );
+    return rejected;
+  }
+
+};
+
+
+
+/// Cache shard indexed by strings, used for ad hoc caches of derived tiles
+typedef KeyedCacheShard<std::string> CacheShard;
+
+
+
+/// Ad hoc cache of derived tiles indexed by strings. Tiles are spread over a number
+/// of independent CacheShards by a hash of their key, so that workers do not all
+/// contend for the same lock
+
+class ShardedCache {
+
+ private:
+
+  /// Our shards
+  std::vector<CacheShard*> shards;
+
+  /// Select the shard responsible for a key
+  CacheShard* shard( const std::string& key ) {
+    if( shards.size() == 1 ) return shards[0];
+    return shards[ std::hash<std::string>()( key ) % shards.size() ];
+  }
+
+
+ public:
+
+  /// Constructor
+  /** @param max Maximum cache size in bytes
+      @param n number of shards: the byte budget is divided evenly between them
+   */
+  ShardedCache( unsigned long max, unsigned int n = 1 ) {
+    if( n < 1 ) n = 1;
+    for( unsigned int i=0; i<n; i++ ) shards.push_back( new CacheShard( max / n ) );
+  };
+
+  /// Destructor
+  ~ShardedCache() {
+    for( unsigned int i=0; i<shards.size(); i++ ) delete shards[i];
+  }
 
+  /// Insert a tile
+  /** @param key index of the tile
+      @param r Tile to be inserted
+   */
+  void insert( const std::string& key, const RawTile& r ) { this->shard( key )->insert( key, r ); }
 
   /// Get a tile from the cache
-  /** 
-   *  @param f filename
-   *  @param r resolution number
-   *  @param t tile number
-   *  @param h horizontal sequence number
-   *  @param v vertical sequence number
-   *  @param c compression type
-   *  @param q compression quality
-   *  @return pointer to data or NULL on error
+  /** @param key index of the tile
+      @param tile RawTile to receive the tile
+      @return whether the tile was found
+   */
+  bool getTile( const std::string& key, RawTile& tile ) { return this->shard( key )->getTile( key, tile ); }
+
+  /// Return the number of tiles in the cache
+  unsigned int getNumElements() {
+    unsigned int n = 0;
+    for( unsigned int i=0; i<shards.size(); i++ ) n += shards[i]->getNumElements();
+    return n;
+  }
+
+  /// Return the number of shards
+  unsigned int getNumShards() { return shards.size(); }
+
+};
+
+
+
+/// In-process cache to store raw tile data. Tiles can be held in two tiers with
+/// independent byte budgets: one for encoded (JPEG) tiles and one for raw,
+/// uncompressed tiles, so that large raw tiles cannot crowd out encoded ones.
+/// Without a raw tier budget, all tiles share a single tier.
+/// Within each tier, tiles are spread over a number of independent shards by
+/// a hash of their index, so that threads accessing different tiles do not
+/// contend for the same lock. Raw 8 bit tiles evicted from the raw tier are
+/// queued for demotion and are re-inserted into the encoded tier by
+/// TileManager once compressed, one per request. An optional second level cache, such as
+/// the on-disk DiskCache, receives all inserted tiles and is consulted on
+/// misses. Tiles are indexed by TileKey, with the most recently used image
+/// paths interned as numbers, so lookups do not allocate. Usage is counted in a
+/// CacheStatistics object. All public functions are thread-safe.
+
+class Cache : public TileCache {
+
+
+ private:
+
+  /// Max memory size in bytes of both tiers
+  unsigned long maxSize;
+
+  /// Max memory size in bytes of the raw tier
+  unsigned long rawSize;
+
+  /// Eviction policy
+  EvictionPolicy policy;
+
+  /// Whether we use admission control
+  bool admission;
+
+  /// Our shards, indexed by tile key
+  typedef KeyedCacheShard<TileKey> Shard;
+
+  /// Shards of our encoded and raw tiers
+  std::vector<Shard*> encoded, raw;
+
+  /// An image path with its number and position in our image LRU list
+  struct ImageEntry {
+    uint32_t id;
+    std::list<const std::string*>::iterator position;
+  };
+
+  /// A stripe of our image numbers, holding the paths whose hash falls to it
+  struct ImageStripe {
+    /// Numbers identifying the image paths of this stripe we have seen most recently
+    HASHMAP < std::string, ImageEntry > images;
+    /// Image paths of this stripe, most recently inserted first
+    std::list<const std::string*> lru;
+    /// Lock protecting this stripe
+    std::mutex lock;
+  };
+
+  /// Number of stripes our image numbers are split into to spread lock contention
+  static const unsigned int numImageStripes = 16;
+
+  /// Our image number stripes
+  ImageStripe imageStripes[numImageStripes];
+
+  /// Maximum number of image paths to keep numbers for in each stripe
+  unsigned long maxImages;
+
+  /// Number to assign to the next new image path - numbers are never reused
+  std::atomic<uint32_t> nextImageId;
+
+  /// Second level cache - NULL if none
+  TileCache* secondLevel;
+
+  /// Raw tiles evicted from the raw tier awaiting demotion
+  std::list<RawTile> demoted;
+
+  /// Lock protecting our demotion queue
+  std::mutex demotionLock;
+
+  /// Maximum number of tiles awaiting demotion
+  static const unsigned int maxDemoted = 16;
+
+  /// Usage statistics of our tiers
+  CacheStatistics statistics;
+
+  /// Size in bytes of a large tile: 256x256 pixels of 4 channels at 16 bits per channel
+  static const unsigned long largeTileSize = 256*256*4*2;
+
+  /// Minimum number of large tiles each automatically sized shard must be able to hold
+  static const unsigned int minShardTiles = 8;
+
+
+  /// Return the byte budget of the raw tier
+  /** @param max maximum size in bytes of both tiers
+      @param rawmax maximum size in MB of the raw tier - 0 for none or half of max if negative
+   */
+  static unsigned long rawBudget( unsigned long max, float rawmax ) {
+    unsigned long raw = (rawmax < 0) ? max / 2 : (unsigned long)(rawmax*1024000);
+    return (raw > max) ? max : raw;
+  }
+
+
+  /// Select the shard responsible for a key
+  /** @param key tile index
+      @param c compression type of the tile
+      @return shard
+   */
+  Shard* shard( const TileKey& key, CompressionType c ) {
+    std::vector<Shard*>& shards = (c == UNCOMPRESSED && !raw.empty()) ? raw : encoded;
+    if( shards.size() == 1 ) return shards[0];
+    return shards[ key.hash % shards.size() ];
+  }
+
+
+  /// Find or assign the number identifying an image path
+  /** Paths are spread over several independently locked stripes. Lookups leave the
+      order of a stripe untouched, which is only refreshed as tiles are inserted, so only
+      the paths most recently inserted into keep their number. As numbers are never
+      reused, tiles of a path that has been dropped can no longer be found and
+      are simply evicted in time
+      @param f image path
+      @param create whether to assign a number to a new path
+      @param id set to the number of the path
+      @return false if the path has no number and none was created
+   */
+  bool imageId( const std::string& f, bool create, uint32_t& id ) {
+    ImageStripe& stripe = imageStripes[ std::hash<std::string>()( f ) % numImageStripes ];
+    std::lock_guard<std::mutex> guard( stripe.lock );
+    HASHMAP < std::string, ImageEntry >::iterator i = stripe.images.find( f );
+    if( i != stripe.images.end() ){
+      if( create ) stripe.lru.splice( stripe.lru.begin(), stripe.lru, i->second.position );
+      id = i->second.id;
+      return true;
+    }
+    if( !create ) return false;
+
+    id = nextImageId++;
+    stripe.lru.push_front( NULL );
+    ImageEntry entry = { id, stripe.lru.begin() };
+    i = stripe.images.insert( std::make_pair( f, entry ) ).first;
+    stripe.lru.front() = &i->first;
+
+    // Drop the path least recently inserted into
+    if( stripe.images.size() > maxImages ){
+      HASHMAP < std::string, ImageEntry >::iterator oldest = stripe.images.find( *stripe.lru.back() );
+      stripe.lru.pop_back();
+      stripe.images.erase( oldest );
+    }
+    return true;
+  }
+
+
+  /// Create the shards of a tier
+  /** @param shards tier
+      @param size byte budget of the tier
+      @param n number of shards
+   */
+  void createTier( std::vector<Shard*>& shards, unsigned long size, unsigned int n ) {
+    for( unsigned int i=0; i<n; i++ ) shards.push_back( new Shard( size / n, policy, admission, &statistics ) );
+  }
+
+
+  /// Insert a tile into our own tiers
+  /** @param key index of the tile
+      @param r Tile to be inserted
+      @param cost time taken to generate the tile in microseconds
+      @param bulk whether the tile is part of a bulk read
+   */
+  void insertTile( const TileKey& key, const RawTile& r, unsigned long cost, bool bulk ) {
+
+    if( r.compressionType != UNCOMPRESSED || raw.empty() ){
+      this->shard( key, r.compressionType )->insert( key, r, cost, bulk );
+      return;
+    }
+
+    // Keep the raw tiles we evict that can be encoded as JPEG
+    std::vector<RawTile> evicted;
+    this->shard( key, UNCOMPRESSED )->insert( key, r, cost, bulk, &evicted );
+    if( evicted.empty() || encoded.empty() || maxSize == rawSize ) return;
+
+    std::lock_guard<std::mutex> guard( demotionLock );
+    for( unsigned int i=0; i<evicted.size(); i++ ){
+      const RawTile& t = evicted[i];
+      if( t.bpc == 8 && (t.channels == 1 || t.channels == 3) && !t.padded && t.sampleType == FIXEDPOINT ){
+	demoted.push_back( t );
+	if( demoted.size() > maxDemoted ) demoted.pop_front();
+      }
+    }
+  }
+
+
+ public:
+
+  /// Constructor
+  /** @param max Maximum cache size in MB of both tiers together
+      @param rawmax Maximum size in MB of the raw tile tier - 0 for none, in which case all
+      tiles share a single tier, or half of max if negative
+      @param n number of shards per tier: each tier's byte budget is divided evenly between them
+      @param p eviction policy
+      @param a whether to use TinyLFU admission control
+   */
+  Cache( float max, float rawmax = 0.0, unsigned int n = 1, EvictionPolicy p = LRU_EVICTION, bool a = false ) {
+    maxSize = (unsigned long)(max*1024000);
+    rawSize = rawBudget( maxSize, rawmax );
+    policy = p;
+    admission = a;
+    secondLevel = NULL;
+    nextImageId = 0;
+    // No more paths can have tiles cached than there are tiles, here assumed to be around 8kB
+    maxImages = maxSize / 8192;
+    if( maxImages < 1024 ) maxImages = 1024;
+    maxImages = ( maxImages + numImageStripes - 1 ) / numImageStripes;
+    if( n < 1 ) n = 1;
+    createTier( encoded, maxSize - rawSize, n );
+    if( rawSize > 0 ) createTier( raw, rawSize, n );
+  };
+
+
+  /// Destructor
+  ~Cache() {
+    for( unsigned int i=0; i<encoded.size(); i++ ) delete encoded[i];
+    for( unsigned int i=0; i<raw.size(); i++ ) delete raw[i];
+    encoded.clear();
+    raw.clear();
+  }
+
+
+  /// Insert a tile
+  /** @param r Tile to be inserted
+      @param cost time taken to generate the tile in microseconds
+      @param bulk whether the tile is part of a bulk read
+   */
+  void insert( const RawTile& r, unsigned long cost = 0, bool bulk = false ) {
+
+    if( secondLevel ) secondLevel->insert( r, cost, bulk );
+
+    if( maxSize == 0 ) return;
+
+    uint32_t id;
+    this->imageId( r.filename, true, id );
+    TileKey key( id, r.resolution, r.tileNum, r.hSequence, r.vSequence, r.compressionType, r.quality );
+
+    this->insertTile( key, r, cost, bulk );
+  }
+
+
+  /// Return the number of shards per tier to use by default
+  /** Several shards per worker spread lock contention, but each shard of a non-empty
+      tier must still be able to hold several large tiles
+      @param max Maximum cache size in MB of both tiers together
+      @param rawmax Maximum size in MB of the raw tile tier - 0 for none or half of max if negative
+      @param workers number of worker threads
+      @return number of shards
    */
-  RawTile* getTile( std::string f, int r, int t, int h, int v, CompressionType c, int q ) {
+  static unsigned int automaticShards( float max, float rawmax, unsigned int workers ) {
+    unsigned int n = (workers > 1) ? 4*workers : 1;
+    unsigned long size = (unsigned long)(max*1024000);
+    unsigned long raw = rawBudget( size, rawmax );
+    unsigned long tier = size - raw;
+    if( raw > 0 && (tier == 0 || raw < tier) ) tier = raw;
+    unsigned long limit = tier / (minShardTiles*largeTileSize);
+    if( n > limit ) n = (limit > 0) ? limit : 1;
+    return n;
+  }
+
+
+  /// Set a second level cache
+  /** @param c cache, which remains owned by the caller, or NULL for none */
+  void setSecondLevel( TileCache* c ) { secondLevel = c; }
+
+
+  /// Take the next raw tile that has been evicted and should be demoted to the encoded tier
+  /** The most recently evicted tiles are taken first
+      @param tile set to the tile to demote
+      @return whether a tile was taken
+   */
+  bool getDemoted( RawTile& tile ) {
+    std::lock_guard<std::mutex> guard( demotionLock );
+    if( demoted.empty() ) return false;
+    tile = std::move( demoted.back() );
+    demoted.pop_back();
+    return true;
+  }
+
+
+  /// Insert a tile that has been demoted to the encoded tier
+  /** The tile is not passed on to our second level cache, which already received the raw tile
+      @param r encoded tile
+      @param cost time taken to encode the tile in microseconds
+   */
+  void insertDemoted( const RawTile& r, unsigned long cost = 0 ) {
+    if( maxSize == 0 ) return;
+    uint32_t id;
+    this->imageId( r.filename, true, id );
+    this->insertTile( TileKey( id, r.resolution, r.tileNum, r.hSequence, r.vSequence, r.compressionType, r.quality ), r, cost, false );
+  }
+
+
+  /// Return our usage statistics
+  CacheStatistics* getStatistics() { return &statistics; }
+
+
+  /// Return the number of shards per tier
+  unsigned int getNumShards() { return encoded.size(); }
 
-    if( maxSize == 0 ) return NULL;
 
-    std::string key = this->getIndex( f, r, t, h, v, c, q );
+  /// Return the number of tiles in the cache
+  unsigned int getNumElements() {
+    unsigned int n = 0;
+    for( unsigned int i=0; i<encoded.size(); i++ ) n += encoded[i]->getNumElements();
+    for( unsigned int i=0; i<raw.size(); i++ ) n += raw[i]->getNumElements();
+    return n;
+  }
+
+
+  /// Return the number of MB stored
+  float getMemorySize() {
+    unsigned long size = 0;
+    for( unsigned int i=0; i<encoded.size(); i++ ) size += encoded[i]->getSize();
+    for( unsigned int i=0; i<raw.size(); i++ ) size += raw[i]->getSize();
+    return (float) ( size / 1024000.0 );
+  }
+
+
+  /// Return the number of tiles admitted into the cache
+  unsigned long getAdmitted() {
+    unsigned long n = 0;
+    for( unsigned int i=0; i<encoded.size(); i++ ) n += encoded[i]->getAdmitted();
+    for( unsigned int i=0; i<raw.size(); i++ ) n += raw[i]->getAdmitted();
+    return n;
+  }
 
-    TileMap::iterator miter = tileMap.find( key );
-    if( miter == tileMap.end() ) return NULL;
-    this->_touch( key );
 
-    return &(miter->second->second);
+  /// Return the number of tiles rejected by admission control
+  unsigned long getRejected() {
+    unsigned long n = 0;
+    for( unsigned int i=0; i<encoded.size(); i++ ) n += encoded[i]->getRejected();
+    for( unsigned int i=0; i<raw.size(); i++ ) n += raw[i]->getRejected();
+    return n;
   }
 
 
-  /// Create a hash index
-  /** 
+  /// Get a tile from the cache
+  /** The tile shares the immutable, reference-counted data of the cached
+   *  tile, so the data stays valid even if the tile is evicted meanwhile
    *  @param f filename
    *  @param r resolution number
    *  @param t tile number
@@ -277,15 +935,43 @@ class Cache {
    *  @param v vertical sequence number
    *  @param c compression type
    *  @param q compression quality
-   *  @return string
+   *  @param tile RawTile to receive the cached tile
+   *  @return true if the tile was found
    */
-  std::string getIndex( std::string f, int r, int t, int h, int v, CompressionType c, int q ) {
-    char tmp[1024];
-    snprintf( tmp, 1024, "%s:%d:%d:%d:%d:%d:%d", f.c_str(), r, t, h, v, c, q );
-    return std::string( tmp );
+  bool getTile( const std::string& f, int r, int t, int h, int v, CompressionType c, int q, RawTile& tile ) {
+
+    if( maxSize > 0 ){
+      // Images we have never seen cannot have any tiles cached
+      uint32_t id;
+      bool hit = false;
+      if( this->imageId( f, false, id ) ){
+	TileKey key( id, r, t, h, v, c, q );
+	hit = this->shard( key, c )->getTile( key, tile );
+      }
+      statistics.lookup( c, r, hit );
+      if( hit ) return true;
+    }
+
+    // Promote tiles found in our second level
+    if( !secondLevel || !secondLevel->getTile( f, r, t, h, v, c, q, tile ) ) return false;
+    if( maxSize > 0 ){
+      uint32_t id;
+      this->imageId( f, true, id );
+      this->insertTile( TileKey( id, r, t, h, v, c, q ), tile, 0, false );
+    }
+    return true;
   }
 
 
+  /// Return a description of the cache backend
+  std::string getDescription() {
+    char tiers[64];
+    if( rawSize > 0 ) snprintf( tiers, 64, "%.1f MB encoded and %.1f MB raw tiers", (maxSize-rawSize)/1024000.0, rawSize/1024000.0 );
+    else snprintf( tiers, 64, "%.1f MB", maxSize/1024000.0 );
+    return std::string( "in-process with " ) + tiers + ", " + ( (policy == GDSF_EVICTION) ? "GDSF" : "LRU" ) + " eviction" +
+      ( admission ? " and TinyLFU admission" : "" );
+  }
+
 
 };
 
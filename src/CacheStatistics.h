@@ -0,0 +1,182 @@
+// Tile Cache Statistics
+
+/*  IIP Image Server
+
+    Copyright (C) 2020 KML Vision GmbH.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _CACHESTATISTICS_H
+#define _CACHESTATISTICS_H
+
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include "RawTile.h"
+
+
+
+/// Lock-free counters describing the use of a tile cache.
+/**
+ *  Hits, misses, insertions, evictions and the number of bytes stored are
+ *  counted separately for each compression type and resolution level. All
+ *  resolutions from numLevels-1 upwards share the last counter. Lookups are
+ *  also counted in a ring of 10 second buckets covering the last 15 minutes,
+ *  from which hit rates over recent windows are derived. Counters are updated
+ *  with relaxed atomics, so a read taken while other threads update the cache
+ *  is a close approximation rather than an exact snapshot.
+ */
+
+class CacheStatistics {
+
+ public:
+
+  /// Per level counters
+  enum Counter { HITS, MISSES, INSERTIONS, EVICTIONS, BYTES, NUM_COUNTERS };
+
+  /// Number of compression types counted
+  static const unsigned int numTypes = PNG + 1;
+
+  /// Number of resolution levels counted
+  static const unsigned int numLevels = 16;
+
+  /// Duration of each hit rate bucket in seconds
+  static const unsigned int bucketSeconds = 10;
+
+  /// Number of hit rate buckets
+  static const unsigned int numBuckets = 90;
+
+
+ private:
+
+  /// Lookups within a bucket
+  struct Bucket {
+    std::atomic<int64_t> epoch;     ///< bucket number since start
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+  };
+
+  /// Counters by compression type and resolution
+  std::atomic<int64_t> counters[numTypes][numLevels][NUM_COUNTERS];
+
+  /// Hit rate ring buffer
+  Bucket buckets[numBuckets];
+
+  /// Time at which counting started
+  std::chrono::steady_clock::time_point start;
+
+
+  /// Return the number of the current bucket
+  int64_t epoch() const {
+    return std::chrono::duration_cast<std::chrono::seconds>( std::chrono::steady_clock::now() - start ).count()
+      / bucketSeconds;
+  }
+
+
+  /// Return the counter for a compression type and resolution
+  std::atomic<int64_t>& counter( Counter c, CompressionType t, int r ) {
+    unsigned int type = ( (unsigned int) t < numTypes ) ? t : 0;
+    unsigned int level = ( r < 0 ) ? 0 : ( ( (unsigned int) r < numLevels ) ? r : numLevels-1 );
+    return counters[type][level][c];
+  }
+
+
+ public:
+
+  /// Constructor
+  CacheStatistics() : start( std::chrono::steady_clock::now() ) {
+    for( unsigned int t = 0; t < numTypes; t++ ){
+      for( unsigned int l = 0; l < numLevels; l++ ){
+	for( unsigned int c = 0; c < NUM_COUNTERS; c++ ) counters[t][l][c].store( 0 );
+      }
+    }
+    for( unsigned int b = 0; b < numBuckets; b++ ){
+      buckets[b].epoch.store( -1 );
+      buckets[b].hits.store( 0 );
+      buckets[b].misses.store( 0 );
+    }
+  };
+
+
+  /// Add to a counter
+  /** @param c counter
+      @param t compression type
+      @param r resolution
+      @param n amount to add - may be negative for BYTES
+   */
+  void add( Counter c, CompressionType t, int r, int64_t n = 1 ) {
+    counter( c, t, r ).fetch_add( n, std::memory_order_relaxed );
+  }
+
+
+  /// Record a lookup
+  /** @param t compression type
+      @param r resolution
+      @param hit whether the tile was found
+   */
+  void lookup( CompressionType t, int r, bool hit ) {
+
+    add( hit ? HITS : MISSES, t, r );
+
+    // Claim the current bucket if it still holds an old window. Lookups counted
+    // by other threads just before the reset are lost, which we can afford
+    int64_t now = epoch();
+    Bucket& b = buckets[ now % numBuckets ];
+    int64_t e = b.epoch.load( std::memory_order_relaxed );
+    if( e != now && b.epoch.compare_exchange_strong( e, now ) ){
+      b.hits.store( 0, std::memory_order_relaxed );
+      b.misses.store( 0, std::memory_order_relaxed );
+    }
+    ( hit ? b.hits : b.misses ).fetch_add( 1, std::memory_order_relaxed );
+  }
+
+
+  /// Return a counter
+  /** @param c counter
+      @param t compression type
+      @param r resolution
+   */
+  int64_t get( Counter c, CompressionType t, int r ) {
+    return counter( c, t, r ).load( std::memory_order_relaxed );
+  }
+
+
+  /// Return the hit rate over a recent window
+  /** @param seconds length of the window - rounded up to whole buckets, at most 15 minutes
+      @return ratio of hits to lookups or -1 if there have been no lookups
+   */
+  double getHitRate( unsigned int seconds ) {
+    int64_t now = epoch();
+    int64_t n = ( seconds + bucketSeconds - 1 ) / bucketSeconds;
+    if( n > numBuckets ) n = numBuckets;
+    uint64_t hits = 0, lookups = 0;
+    for( int64_t e = now - n + 1; e <= now; e++ ){
+      if( e < 0 ) continue;
+      Bucket& b = buckets[ e % numBuckets ];
+      if( b.epoch.load( std::memory_order_relaxed ) != e ) continue;
+      uint64_t h = b.hits.load( std::memory_order_relaxed );
+      hits += h;
+      lookups += h + b.misses.load( std::memory_order_relaxed );
+    }
+    return lookups ? (double) hits / (double) lookups : -1.0;
+  }
+
+};
+
+
+#endif
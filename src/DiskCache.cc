@@ -0,0 +1,447 @@
+// Member functions for DiskCache.h
+
+/*  IIP Image Server
+
+    Copyright (C) 2020 KML Vision GmbH.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "DiskCache.h"
+
+
+// Magic numbers and layout version identifying our index and records
+#define DISK_MAGIC 0x49495044
+#define DISK_RECORD_MAGIC 0x49495054
+#define DISK_VERSION 2
+
+// Number of segments the cache is divided into
+#define DISK_SEGMENTS 8
+
+// Maximum segment size - offsets within segments are 32 bit
+#define DISK_MAX_SEGMENT_SIZE 1073741824ULL
+
+// Average number of bytes per index entry
+#define DISK_BYTES_PER_SLOT 8192
+
+// Number of consecutive index entries searched for a tile
+#define DISK_PROBES 16
+
+
+using namespace std;
+
+
+
+/// Index file header, followed by the index entries
+struct DiskCache::Header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t num_slots;
+};
+
+
+/// Index entry - free if its segment no longer exists
+struct DiskCache::Slot {
+  uint64_t hash;
+  uint32_t segment;
+  uint32_t offset;
+  uint32_t length;
+  uint32_t reserved;
+  int64_t timestamp;
+};
+
+
+/// Record header, followed by the cache index and then the tile data
+struct DiskCache::Record {
+  uint32_t magic;
+  uint32_t key_length;
+  uint32_t data_length;
+  int32_t tileNum;
+  int32_t resolution;
+  int32_t hSequence;
+  int32_t vSequence;
+  int32_t compressionType;
+  int32_t quality;
+  int32_t encodedQuality;
+  uint32_t width;
+  uint32_t height;
+  int32_t channels;
+  int32_t bpc;
+  int32_t sampleType;
+  int32_t padded;
+  int64_t timestamp;
+};
+
+
+
+DiskCache::Segment::~Segment(){
+  if( fd >= 0 ) close( fd );
+}
+
+
+
+DiskCache::DiskCache( const string& d, float max ){
+
+  directory = d;
+  while( directory.length() > 1 && directory[directory.length()-1] == '/' ) directory.erase( directory.length()-1 );
+
+  header = NULL;
+  slots = NULL;
+  totalSize = 0;
+  numItems = 0;
+
+  uint64_t maxSize = (uint64_t)( max * 1024000 );
+  maxSegments = DISK_SEGMENTS;
+  segmentSize = maxSize / maxSegments;
+  if( segmentSize > DISK_MAX_SEGMENT_SIZE ) segmentSize = DISK_MAX_SEGMENT_SIZE;
+  if( segmentSize < 1024000 ){
+    throw string( "DiskCache :: Disk tile cache size must be at least 8MB" );
+  }
+
+  numSlots = 4096;
+  while( numSlots < maxSize / DISK_BYTES_PER_SLOT ) numSlots <<= 1;
+  indexSize = sizeof(Header) + numSlots * sizeof(Slot);
+
+  if( mkdir( directory.c_str(), 0755 ) != 0 && errno != EEXIST ){
+    throw string( "DiskCache :: Unable to create directory '" + directory + "': " + strerror(errno) );
+  }
+
+  // Open and lock our index so that no other process uses this directory
+  string path = directory + "/index";
+  indexFd = open( path.c_str(), O_RDWR | O_CREAT, 0600 );
+  if( indexFd < 0 ){
+    throw string( "DiskCache :: Unable to open index '" + path + "': " + strerror(errno) );
+  }
+  if( lockf( indexFd, F_TLOCK, 0 ) != 0 ){
+    close( indexFd );
+    throw string( "DiskCache :: Directory '" + directory + "' is in use by another process" );
+  }
+
+  // An index of a different size cannot be re-used
+  struct stat sb;
+  bool keep = ( fstat( indexFd, &sb ) == 0 && sb.st_size == (off_t) indexSize );
+  if( !keep && ( ftruncate( indexFd, 0 ) != 0 || ftruncate( indexFd, indexSize ) != 0 ) ){
+    close( indexFd );
+    throw string( "DiskCache :: Unable to size index '" + path + "': " + strerror(errno) );
+  }
+
+  void* p = mmap( NULL, indexSize, PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0 );
+  if( p == MAP_FAILED ){
+    close( indexFd );
+    throw string( "DiskCache :: Unable to map index '" + path + "': " + strerror(errno) );
+  }
+  header = (Header*) p;
+  slots = (Slot*)( (unsigned char*) p + sizeof(Header) );
+
+  if( header->magic != DISK_MAGIC || header->version != DISK_VERSION || header->num_slots != numSlots ) keep = false;
+  if( !keep ){
+    memset( p, 0, indexSize );
+    header->version = DISK_VERSION;
+    header->num_slots = numSlots;
+    header->magic = DISK_MAGIC;
+  }
+
+  this->openSegments( keep );
+}
+
+
+
+DiskCache::~DiskCache(){
+  segments.clear();
+  if( header ) munmap( header, indexSize );
+  if( indexFd >= 0 ) close( indexFd );
+}
+
+
+
+uint64_t DiskCache::hash( const string& key ){
+  // 64 bit FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for( size_t i=0; i<key.length(); i++ ){
+    h ^= (unsigned char) key[i];
+    h *= 1099511628211ULL;
+  }
+  // 0 marks an unused index entry
+  return h ? h : 1;
+}
+
+
+
+string DiskCache::segmentPath( uint32_t id ){
+  char name[32];
+  snprintf( name, 32, "/segment.%08x", id );
+  return directory + name;
+}
+
+
+
+void DiskCache::openSegments( bool keep ){
+
+  DIR* dir = opendir( directory.c_str() );
+  if( dir ){
+    struct dirent* entry;
+    while( (entry = readdir( dir )) ){
+      if( strncmp( entry->d_name, "segment.", 8 ) != 0 ) continue;
+      char* end = NULL;
+      uint32_t id = (uint32_t) strtoul( entry->d_name + 8, &end, 16 );
+      if( !end || *end != '\0' || id == 0 ) continue;
+
+      // Our index no longer refers to these segments
+      if( !keep ){
+	unlink( segmentPath( id ).c_str() );
+	continue;
+      }
+
+      int fd = open( segmentPath( id ).c_str(), O_RDWR );
+      struct stat sb;
+      if( fd < 0 ) continue;
+      if( fstat( fd, &sb ) != 0 ){
+	close( fd );
+	continue;
+      }
+      shared_ptr<Segment> segment( new Segment );
+      segment->id = id;
+      segment->fd = fd;
+      segment->size = sb.st_size;
+      segment->items = 0;
+      segments[id] = segment;
+      totalSize += segment->size;
+    }
+    closedir( dir );
+  }
+
+  // Count the tiles we still have
+  for( uint64_t i=0; i<numSlots; i++ ){
+    if( slots[i].hash && segments.count( slots[i].segment ) ){
+      segments[ slots[i].segment ]->items++;
+      numItems++;
+    }
+  }
+
+  // Continue appending to our newest segment if it has room
+  if( !segments.empty() && segments.rbegin()->second->size < segmentSize ) return;
+
+  if( !this->newSegment() ){
+    throw string( "DiskCache :: Unable to create segment in '" + directory + "': " + strerror(errno) );
+  }
+}
+
+
+
+bool DiskCache::newSegment(){
+
+  uint32_t id = segments.empty() ? 1 : segments.rbegin()->first + 1;
+
+  int fd = open( segmentPath( id ).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600 );
+  if( fd < 0 ) return false;
+
+  shared_ptr<Segment> segment( new Segment );
+  segment->id = id;
+  segment->fd = fd;
+  segment->size = 0;
+  segment->items = 0;
+  segments[id] = segment;
+
+  // Delete the oldest segments. Readers still holding one keep its file open
+  while( segments.size() > maxSegments ){
+    SegmentMap::iterator oldest = segments.begin();
+    unlink( segmentPath( oldest->first ).c_str() );
+    totalSize -= oldest->second->size;
+    numItems -= oldest->second->items;
+    segments.erase( oldest );
+  }
+
+  return true;
+}
+
+
+
+DiskCache::Slot* DiskCache::find( uint64_t h ){
+  for( unsigned int i=0; i<DISK_PROBES; i++ ){
+    Slot* slot = &slots[ (h + i) & (numSlots - 1) ];
+    if( slot->hash == h && segments.count( slot->segment ) ) return slot;
+  }
+  return NULL;
+}
+
+
+
+void DiskCache::insert( const RawTile& r, unsigned long, bool bulk ){
+
+  if( bulk || !r.data || r.dataLength == 0 ) return;
+
+  string key = getIndex( r.filename, r.resolution, r.tileNum, r.hSequence, r.vSequence,
+			 r.compressionType, r.quality );
+  uint64_t h = hash( key );
+
+  // Build our record
+  size_t length = sizeof(Record) + key.length() + r.dataLength;
+  if( length > segmentSize ) return;
+
+  vector<unsigned char> buffer( length );
+  Record* record = (Record*) &buffer[0];
+  record->magic = DISK_RECORD_MAGIC;
+  record->key_length = key.length();
+  record->data_length = r.dataLength;
+  record->tileNum = r.tileNum;
+  record->resolution = r.resolution;
+  record->hSequence = r.hSequence;
+  record->vSequence = r.vSequence;
+  record->compressionType = r.compressionType;
+  record->quality = r.quality;
+  record->encodedQuality = r.encodedQuality;
+  record->width = r.width;
+  record->height = r.height;
+  record->channels = r.channels;
+  record->bpc = r.bpc;
+  record->sampleType = r.sampleType;
+  record->padded = r.padded;
+  record->timestamp = r.timestamp;
+  memcpy( &buffer[sizeof(Record)], key.data(), key.length() );
+  memcpy( &buffer[sizeof(Record) + key.length()], r.data, r.dataLength );
+
+  // Reserve space at the end of the current segment
+  shared_ptr<Segment> segment;
+  uint64_t offset;
+  {
+    lock_guard<mutex> guard( lock );
+
+    // Nothing to do if we already hold an up to date copy
+    Slot* slot = this->find( h );
+    if( slot && slot->timestamp >= (int64_t) r.timestamp ) return;
+
+    if( segments.rbegin()->second->size + length > segmentSize && !this->newSegment() ) return;
+    segment = segments.rbegin()->second;
+    offset = segment->size;
+    segment->size += length;
+    totalSize += length;
+  }
+
+  // Write outside of our lock
+  if( pwrite( segment->fd, &buffer[0], length, offset ) != (ssize_t) length ) return;
+
+  lock_guard<mutex> guard( lock );
+
+  // The segment may have been deleted in the meantime
+  if( !segments.count( segment->id ) ) return;
+
+  // Use the tile's existing entry, a free one or the one in the oldest segment
+  Slot* slot = this->find( h );
+  for( unsigned int i=0; !slot && i<DISK_PROBES; i++ ){
+    Slot* s = &slots[ (h + i) & (numSlots - 1) ];
+    if( !s->hash || !segments.count( s->segment ) ) slot = s;
+  }
+  for( unsigned int i=0; !slot && i<DISK_PROBES; i++ ){
+    Slot* s = &slots[ (h + i) & (numSlots - 1) ];
+    if( !slot || s->segment < slot->segment ) slot = s;
+  }
+  if( slot->hash && segments.count( slot->segment ) ){
+    segments[ slot->segment ]->items--;
+    numItems--;
+  }
+
+  slot->segment = segment->id;
+  slot->offset = offset;
+  slot->length = length;
+  slot->timestamp = r.timestamp;
+  slot->hash = h;
+
+  segment->items++;
+  numItems++;
+}
+
+
+
+bool DiskCache::getTile( const string& f, int r, int t, int h, int v, CompressionType c, int q, RawTile& tile ){
+
+  string key = getIndex( f, r, t, h, v, c, q );
+  uint64_t hv = hash( key );
+
+  shared_ptr<Segment> segment;
+  uint64_t offset, length;
+  {
+    lock_guard<mutex> guard( lock );
+    Slot* slot = this->find( hv );
+    if( !slot ) return false;
+    segment = segments[ slot->segment ];
+    offset = slot->offset;
+    length = slot->length;
+  }
+
+  // Read and verify the record header and index
+  size_t head = sizeof(Record) + key.length();
+  if( length <= head ) return false;
+  vector<unsigned char> buffer( head );
+  if( pread( segment->fd, &buffer[0], head, offset ) != (ssize_t) head ) return false;
+
+  const Record* record = (const Record*) &buffer[0];
+  if( record->magic != DISK_RECORD_MAGIC || record->key_length != key.length() ||
+      record->data_length != length - head ||
+      memcmp( &buffer[sizeof(Record)], key.data(), key.length() ) != 0 ) return false;
+
+  RawTile cached( record->tileNum, record->resolution, record->hSequence, record->vSequence,
+		  record->width, record->height, record->channels, record->bpc );
+  cached.compressionType = (CompressionType) record->compressionType;
+  cached.quality = record->quality;
+  cached.encodedQuality = record->encodedQuality;
+  cached.filename = f;
+  cached.timestamp = record->timestamp;
+  cached.sampleType = (SampleType) record->sampleType;
+  cached.padded = record->padded;
+  cached.dataLength = record->data_length;
+
+  // Allocate our data as the RawTile destructor expects it
+  cached.data = RawTile::allocate( cached.dataLength, cached.bpc, cached.sampleType );
+
+  if( pread( segment->fd, cached.data, cached.dataLength, offset + head ) != (ssize_t) cached.dataLength ) return false;
+
+  tile = std::move( cached );
+  return true;
+}
+
+
+
+unsigned int DiskCache::getNumElements(){
+  lock_guard<mutex> guard( lock );
+  return numItems;
+}
+
+
+
+float DiskCache::getMemorySize(){
+  lock_guard<mutex> guard( lock );
+  return (float)( totalSize / 1024000.0 );
+}
+
+
+
+string DiskCache::getDescription(){
+  char size[32];
+  snprintf( size, 32, "%.0f MB", (double)( segmentSize * maxSegments ) / 1024000.0 );
+  return string( "on-disk in " ) + directory + " with " + size;
+}
@@ -0,0 +1,177 @@
+// On-disk Tile Cache Class
+
+/*  IIP Image Server
+
+    Copyright (C) 2020 KML Vision GmbH.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _DISKCACHE_H
+#define _DISKCACHE_H
+
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include "TileCache.h"
+
+
+
+/// Persistent tile cache on local disk, used as a second level below the
+/// in-process cache so that decoded tiles survive restarts.
+/**
+ *  Tiles are appended to a series of fixed size segment files. An index
+ *  file, mapped into memory, holds a fixed size open addressing hash table
+ *  which maps the hash of each tile's cache index to its segment and offset.
+ *  Once the maximum number of segments has been reached, the oldest segment
+ *  is deleted as a whole. Index entries pointing to deleted segments are
+ *  simply treated as free. Each record holds the full cache index, which is
+ *  verified on retrieval, and the tile's timestamp, so that TileManager
+ *  regenerates tiles whose source image has since been modified.
+ *  The directory may only be used by a single process at a time.
+ */
+
+class DiskCache : public TileCache {
+
+ private:
+
+  /// Index file header - defined in DiskCache.cc
+  struct Header;
+
+  /// Index entry - defined in DiskCache.cc
+  struct Slot;
+
+  /// Record header preceding each tile in a segment - defined in DiskCache.cc
+  struct Record;
+
+  /// An open segment file
+  struct Segment {
+    uint32_t id;
+    int fd;
+    uint64_t size;     ///< bytes written or reserved
+    unsigned int items;
+    ~Segment();
+  };
+
+  /// Segments by id - the highest id is the one being appended to
+  typedef std::map< uint32_t, std::shared_ptr<Segment> > SegmentMap;
+
+  /// Cache directory
+  std::string directory;
+
+  /// Maximum size of a segment in bytes
+  uint64_t segmentSize;
+
+  /// Maximum number of segments
+  unsigned int maxSegments;
+
+  /// Index file descriptor - also holds our lock on the directory
+  int indexFd;
+
+  /// Size of our mapped index in bytes
+  size_t indexSize;
+
+  /// Mapped index header
+  Header* header;
+
+  /// Mapped index entries
+  Slot* slots;
+
+  /// Number of index entries - a power of 2
+  uint64_t numSlots;
+
+  /// Open segments
+  SegmentMap segments;
+
+  /// Total size of all segments in bytes
+  uint64_t totalSize;
+
+  /// Number of tiles written
+  unsigned int numItems;
+
+  /// Lock protecting our index and segments
+  std::mutex lock;
+
+
+  /// Hash function for our cache index - stable across restarts
+  static uint64_t hash( const std::string& key );
+
+  /// Return the path of a segment file
+  std::string segmentPath( uint32_t id );
+
+  /// Open the existing segment files or delete them if our index is new
+  void openSegments( bool keep );
+
+  /// Start a new segment, deleting the oldest segments if necessary - called with the lock held
+  /** @return whether the new segment could be created */
+  bool newSegment();
+
+  /// Find the index entry of a live tile - called with the lock held
+  /** @return entry or NULL if not found */
+  Slot* find( uint64_t h );
+
+
+ public:
+
+  /// Constructor
+  /** Open or create a cache in a directory
+      @param directory cache directory - created if it does not exist
+      @param max maximum size of all segments in MB
+   */
+  DiskCache( const std::string& directory, float max );
+
+  /// Destructor - unmaps the index and closes all files. The cache persists on disk
+  ~DiskCache();
+
+  /// Insert a tile
+  /** The tile is appended to the current segment unless an up to date copy
+      already exists. Tiles from bulk reads are not stored.
+      @param r Tile to be inserted
+      @param cost time taken to generate the tile in microseconds - ignored
+      @param bulk whether the tile is part of a bulk read
+   */
+  void insert( const RawTile& r, unsigned long cost = 0, bool bulk = false );
+
+  /// Get a tile from the cache
+  /** The tile is read from disk
+   *  @param f filename
+   *  @param r resolution number
+   *  @param t tile number
+   *  @param h horizontal sequence number
+   *  @param v vertical sequence number
+   *  @param c compression type
+   *  @param q compression quality
+   *  @param tile RawTile to copy the cached tile into
+   *  @return true if the tile was found
+   */
+  bool getTile( const std::string& f, int r, int t, int h, int v, CompressionType c, int q, RawTile& tile );
+
+  /// Return the number of tiles written to the live segments
+  unsigned int getNumElements();
+
+  /// Return the number of MB stored
+  float getMemorySize();
+
+  /// Return a description of the cache backend
+  std::string getDescription();
+
+};
+
+
+#endif
@@ -27,6 +27,7 @@
 #define VERBOSITY 1
 #define LOGFILE "/tmp/iipsrv.log"
 #define MAX_IMAGE_CACHE_SIZE 10.0
+#define MAX_RAW_TILE_CACHE_SIZE 0.0  // 0: no separate raw tier, negative: half of MAX_IMAGE_CACHE_SIZE
 #define FILENAME_PATTERN "_pyr_"
 #define JPEG_QUALITY 75
 #define MAX_CVT 5000
@@ -44,10 +45,31 @@
 #define ALLOW_UPSCALING true
 #define URI_MAP ""
 #define EMBED_ICC true
+#define JPEG_PASSTHROUGH false
 #define KAKADU_READMODE 0
+#define TIFF_MMAP false
+#define WORKER_THREADS 1
+#define REGION_THREADS 0  // 0: choose automatically
+#define CACHE_SHARDS 0  // 0: choose automatically
+#define CACHE_POLICY "lru"
+#define CACHE_ADMISSION "none"
+#define BULK_REGION_TILES 0
+#define WARM_RESOLUTIONS 0
+#define SHARED_TILE_CACHE ""
+#define DISK_TILE_CACHE ""
+#define MAX_DISK_TILE_CACHE_SIZE 1024.0
+#define MAX_OPEN_IMAGES 64
+#define MAX_IMAGE_METADATA 1000
+#define METADATA_REVALIDATION_INTERVAL 0
+#define NEGATIVE_CACHE_TTL 0
+#define METADATA_INDEX ""
+#define MAX_METADATA_INDEX_SIZE 64.0
+#define MAX_BLEND_CACHE_SIZE 0.0
+#define MAX_CHANNEL_CACHE_SIZE 0.0
 
 
 #include <string>
+#include <cctype>
 
 
 /// Class to obtain environment variables
@@ -85,6 +107,16 @@ class Environment {
   }
 
 
+  static float getMaxRawTileCacheSize(){
+    float max_raw_tile_cache_size = MAX_RAW_TILE_CACHE_SIZE;
+    char* envpara = getenv( "MAX_RAW_TILE_CACHE_SIZE" );
+    if( envpara ){
+      max_raw_tile_cache_size = atof( envpara );
+    }
+    return max_raw_tile_cache_size;
+  }
+
+
   static std::string getFileNamePattern(){
     char* envpara = getenv( "FILENAME_PATTERN" );
     std::string filename_pattern;
@@ -272,6 +304,24 @@ class Environment {
   }
 
 
+  static bool getTIFFMmap(){
+    char* envpara = getenv( "TIFF_MMAP" );
+    bool mmap;
+    if( envpara ) mmap = atoi( envpara );
+    else mmap = TIFF_MMAP;
+    return mmap;
+  }
+
+
+  static bool getJPEGPassthrough(){
+    char* envpara = getenv( "JPEG_PASSTHROUGH" );
+    bool passthrough;
+    if( envpara ) passthrough = atoi( envpara );
+    else passthrough = JPEG_PASSTHROUGH;
+    return passthrough;
+  }
+
+
   static unsigned int getKduReadMode(){
     unsigned int readmode;
     char* envpara = getenv( "KAKADU_READMODE" );
@@ -283,6 +333,195 @@ class Environment {
     return readmode;
   }
 
+
+  static unsigned int getWorkerThreads(){
+    int threads = WORKER_THREADS;
+    char* envpara = getenv( "WORKER_THREADS" );
+    if( envpara ){
+      threads = atoi( envpara );
+      // Always run at least one worker
+      if( threads < 1 ) threads = 1;
+    }
+    return threads;
+  }
+
+
+  static unsigned int getRegionThreads(){
+    int threads = REGION_THREADS;
+    char* envpara = getenv( "REGION_THREADS" );
+    if( envpara ){
+      threads = atoi( envpara );
+      if( threads < 0 ) threads = REGION_THREADS;
+    }
+    return threads;
+  }
+
+
+  static unsigned int getCacheShards(){
+    int shards = CACHE_SHARDS;
+    char* envpara = getenv( "CACHE_SHARDS" );
+    if( envpara ){
+      shards = atoi( envpara );
+      if( shards < 0 ) shards = CACHE_SHARDS;
+    }
+    return shards;
+  }
+
+
+  static std::string getCachePolicy(){
+    char* envpara = getenv( "CACHE_POLICY" );
+    std::string policy;
+    if( envpara ) policy = std::string( envpara );
+    else policy = CACHE_POLICY;
+    // Policy names are case insensitive
+    for( unsigned int i = 0; i < policy.length(); i++ ) policy[i] = tolower( policy[i] );
+    return policy;
+  }
+
+
+  static std::string getCacheAdmission(){
+    char* envpara = getenv( "CACHE_ADMISSION" );
+    std::string admission;
+    if( envpara ) admission = std::string( envpara );
+    else admission = CACHE_ADMISSION;
+    for( unsigned int i = 0; i < admission.length(); i++ ) admission[i] = tolower( admission[i] );
+    return admission;
+  }
+
+
+  static unsigned int getBulkRegionTiles(){
+    int tiles = BULK_REGION_TILES;
+    char* envpara = getenv( "BULK_REGION_TILES" );
+    if( envpara ){
+      tiles = atoi( envpara );
+      if( tiles < 0 ) tiles = BULK_REGION_TILES;
+    }
+    return tiles;
+  }
+
+
+  static unsigned int getWarmResolutions(){
+    int resolutions = WARM_RESOLUTIONS;
+    char* envpara = getenv( "WARM_RESOLUTIONS" );
+    if( envpara ){
+      resolutions = atoi( envpara );
+      if( resolutions < 0 ) resolutions = WARM_RESOLUTIONS;
+    }
+    return resolutions;
+  }
+
+
+  static unsigned int getMaxOpenImages(){
+    int max_open_images = MAX_OPEN_IMAGES;
+    char* envpara = getenv( "MAX_OPEN_IMAGES" );
+    if( envpara ){
+      max_open_images = atoi( envpara );
+      if( max_open_images < 0 ) max_open_images = MAX_OPEN_IMAGES;
+    }
+    return max_open_images;
+  }
+
+
+  static unsigned int getMaxImageMetadata(){
+    int max_image_metadata = MAX_IMAGE_METADATA;
+    char* envpara = getenv( "MAX_IMAGE_METADATA" );
+    if( envpara ){
+      max_image_metadata = atoi( envpara );
+      if( max_image_metadata < 0 ) max_image_metadata = MAX_IMAGE_METADATA;
+    }
+    return max_image_metadata;
+  }
+
+
+  static unsigned int getMetadataRevalidationInterval(){
+    int interval = METADATA_REVALIDATION_INTERVAL;
+    char* envpara = getenv( "METADATA_REVALIDATION_INTERVAL" );
+    if( envpara ){
+      interval = atoi( envpara );
+      if( interval < 0 ) interval = METADATA_REVALIDATION_INTERVAL;
+    }
+    return interval;
+  }
+
+
+  static unsigned int getNegativeCacheTTL(){
+    int ttl = NEGATIVE_CACHE_TTL;
+    char* envpara = getenv( "NEGATIVE_CACHE_TTL" );
+    if( envpara ){
+      ttl = atoi( envpara );
+      if( ttl < 0 ) ttl = NEGATIVE_CACHE_TTL;
+    }
+    return ttl;
+  }
+
+
+  static float getMaxBlendCacheSize(){
+    float max_blend_cache_size = MAX_BLEND_CACHE_SIZE;
+    char* envpara = getenv( "MAX_BLEND_CACHE_SIZE" );
+    if( envpara ){
+      max_blend_cache_size = atof( envpara );
+    }
+    return max_blend_cache_size;
+  }
+
+
+  static float getMaxChannelCacheSize(){
+    float max_channel_cache_size = MAX_CHANNEL_CACHE_SIZE;
+    char* envpara = getenv( "MAX_CHANNEL_CACHE_SIZE" );
+    if( envpara ){
+      max_channel_cache_size = atof( envpara );
+    }
+    return max_channel_cache_size;
+  }
+
+
+  static std::string getMetadataIndex(){
+    char* envpara = getenv( "METADATA_INDEX" );
+    std::string directory;
+    if( envpara ) directory = std::string( envpara );
+    else directory = METADATA_INDEX;
+    return directory;
+  }
+
+
+  static float getMaxMetadataIndexSize(){
+    float max_metadata_index_size = MAX_METADATA_INDEX_SIZE;
+    char* envpara = getenv( "MAX_METADATA_INDEX_SIZE" );
+    if( envpara ){
+      max_metadata_index_size = atof( envpara );
+      if( max_metadata_index_size < 0 ) max_metadata_index_size = 0;
+    }
+    return max_metadata_index_size;
+  }
+
+
+  static std::string getDiskTileCache(){
+    char* envpara = getenv( "DISK_TILE_CACHE" );
+    std::string directory;
+    if( envpara ) directory = std::string( envpara );
+    else directory = DISK_TILE_CACHE;
+    return directory;
+  }
+
+
+  static float getMaxDiskTileCacheSize(){
+    float max_disk_tile_cache_size = MAX_DISK_TILE_CACHE_SIZE;
+    char* envpara = getenv( "MAX_DISK_TILE_CACHE_SIZE" );
+    if( envpara ){
+      max_disk_tile_cache_size = atof( envpara );
+    }
+    return max_disk_tile_cache_size;
+  }
+
+
+  static std::string getSharedTileCache(){
+    char* envpara = getenv( "SHARED_TILE_CACHE" );
+    std::string name;
+    if( envpara ) name = std::string( envpara );
+    else name = SHARED_TILE_CACHE;
+    return name;
+  }
+
 };
 
 
@@ -20,6 +20,8 @@
 
 
 #include <algorithm>
+#include <memory>
+#include <sys/stat.h>
 #include "Task.h"
 #include "URL.h"
 #include "Environment.h"
@@ -33,14 +35,45 @@
 #include "OpenJPEGImage.h"
 #endif
 
-#define MAXIMAGECACHE 1000  // Max number of items in image cache
-
 
 
 using namespace std;
 
 
 
+/// Create an unopened decoder of the appropriate type for an image
+/** @param image initialised image
+    @param session our session
+    @return decoder or NULL if the format is unsupported
+ */
+static IIPImage* createDecoder( IIPImage& image, Session* session ){
+
+  ImageFormat format = image.getImageFormat();
+
+  if( format == TIF ){
+    TPTImage* tiff = new TPTImage( image );
+    tiff->tiff_mmap = session->codecOptions["TIFF_MMAP"];
+    return tiff;
+  }
+#if defined(HAVE_KAKADU) || defined(HAVE_OPENJPEG)
+  else if( format == JPEG2000 ){
+#if defined(HAVE_KAKADU)
+    KakaduImage* kakadu = new KakaduImage( image );
+    if( session->codecOptions["KAKADU_READMODE"] ){
+      kakadu->kdu_readmode = (KakaduImage::KDU_READMODE) session->codecOptions["KAKADU_READMODE"];
+    }
+    return kakadu;
+#elif defined(HAVE_OPENJPEG)
+    return new OpenJPEGImage( image );
+#endif
+  }
+#endif
+
+  return NULL;
+}
+
+
+
 void FIF::run( Session* session, const string& src ){
 
   if( session->loglevel >= 3 ) *(session->logfile) << "FIF handler reached" << endl;
@@ -78,67 +111,89 @@ void FIF::run( Session* session, const string& src ){
   // Timestamp of cached image
   time_t timestamp = 0;
 
+  // Whether the metadata of the image was loaded from our on-disk index
+  bool indexed = false;
+
+
+  // Refuse images that recently failed to open without touching the file system
+  string failure;
+  bool missing;
+  if( session->imageCache->getFailed( argument, failure, missing ) ){
+    if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Negative cache hit: " << failure << endl;
+    if( !missing ) throw failure;
+    session->response->setError( "1 3", "FIF" );
+    throw file_error( failure );
+  }
+
 
   // Put the image setup into a try block as object creation can throw an exception
   try{
 
-    // Check whether cache is empty
-    if( session->imageCache->empty() ){
-      if( session->loglevel >= 1 ) *(session->logfile) << "FIF :: Image cache initialization" << endl;
+    // Look up the metadata of this image, which is shared with other requests
+    std::shared_ptr<const IIPImage> cached = session->imageCache->get( argument );
+
+    // Cache Hit
+    if( cached ){
+      timestamp = cached->timestamp;       // Record timestamp if we have a cached image
+      if( session->loglevel >= 2 ){
+	*(session->logfile) << "FIF :: Image cache hit. Number of elements: " << session->imageCache->size() << endl;
+      }
+    }
+    // Cache Miss
+    else{
+      if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image cache miss" << endl;
       test = IIPImage( argument );
       test.setFileNamePattern( filename_pattern );
       test.setFileSystemPrefix( filesystem_prefix );
-      test.Initialise();
-    }
-    // If not, look up our object
-    else{
-      // Cache Hit
-      if( session->imageCache->find(argument) != session->imageCache->end() ){
-	test = (*session->imageCache)[ argument ];
-	timestamp = test.timestamp;       // Record timestamp if we have a cached image
-	if( session->loglevel >= 2 ){
-	  *(session->logfile) << "FIF :: Image cache hit. Number of elements: " << session->imageCache->size() << endl;
-	}
-      }
-      // Cache Miss
-      else{
-	if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image cache miss" << endl;
-	test = IIPImage( argument );
-	test.setFileNamePattern( filename_pattern );
-	test.setFileSystemPrefix( filesystem_prefix );
-	test.Initialise();
-	// Delete items if our list of images is too long.
-	if( session->imageCache->size() >= MAXIMAGECACHE ) session->imageCache->erase( session->imageCache->begin() );
+
+      // Load the metadata of unchanged images we have seen before from our index
+      MetadataIndex* index = session->imageCache->getIndex();
+      if( index && (indexed = index->load( test )) ){
+	if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image metadata loaded from index" << endl;
       }
+      else test.Initialise();
+    }
+
+
+
+    // Refresh the modification time of a cached image, at most once per revalidation
+    // interval: open decoders are only reused for unchanged files
+    time_t modified = cached ? timestamp : test.timestamp;
+    if( cached && session->imageCache->revalidate( argument ) ){
+      struct stat sb;
+      string path = cached->getFileName( cached->currentX, cached->currentY );
+      if( stat( path.c_str(), &sb ) == -1 ) throw file_error( string( "Unable to open file " ) + path );
+      modified = sb.st_mtime;
     }
 
+    // Check out an idle decoder for this image if one is already open
+    IIPImage* pooled = session->imagePool->checkout( argument, modified );
+
 
 
     /***************************************************************
       Test for different image types - only TIFF is native for now
     ***************************************************************/
 
+    // Only copy cached metadata when we need a new decoder
+    if( !pooled && cached ) test = *cached;
+
     ImageFormat format = test.getImageFormat();
 
-    if( format == TIF ){
-      if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: TIFF image detected" << endl;
-      *session->image = new TPTImage( test );
+    if( pooled ){
+      if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Reusing open image" << endl;
+      *session->image = pooled;
     }
-#if defined(HAVE_KAKADU) || defined(HAVE_OPENJPEG)
-    else if( format == JPEG2000 ){
-      if( session->loglevel >= 2 )
-        *(session->logfile) << "FIF :: JPEG2000 image detected" << endl;
-#if defined(HAVE_KAKADU)
-      *session->image = new KakaduImage( test );
-      if( session->codecOptions["KAKADU_READMODE"] ){
-	((KakaduImage*)*session->image)->kdu_readmode = (KakaduImage::KDU_READMODE) session->codecOptions["KAKADU_READMODE"];
+    else if( (*session->image = createDecoder( test, session )) ){
+      if( session->loglevel >= 2 ){
+	*(session->logfile) << "FIF :: " << ( (format == TIF) ? "TIFF" : "JPEG2000" ) << " image detected" << endl;
       }
-#elif defined(HAVE_OPENJPEG)
-      *session->image = new OpenJPEGImage( test );
-#endif
     }
-#endif
-    else throw string( "Unsupported image type: " + argument );
+    else{
+      string error = "Unsupported image type: " + argument;
+      session->imageCache->setFailed( argument, error, false );
+      throw error;
+    }
 
     /* Disable module loading for now!
     else{
@@ -176,18 +231,30 @@ void FIF::run( Session* session, const string& src ){
 
 
     // Open image and update timestamp
-    (*session->image)->openImage();
+    if( !pooled ) (*session->image)->openImage();
 
     // Check timestamp consistency. If cached timestamp is older, update metadata
-    if( timestamp>0 && (timestamp < (*session->image)->timestamp) ){
+    if( !pooled && timestamp>0 && (timestamp < (*session->image)->timestamp) ){
       if( session->loglevel >= 2 ){
 	*(session->logfile) << "FIF :: Image timestamp changed: reloading metadata" << endl;
       }
       (*session->image)->loadImageInfo( (*session->image)->currentX, (*session->image)->currentY );
     }
 
-    // Add this image to our cache, overwriting previous version if it exists
-    (*session->imageCache)[argument] = *(*session->image);
+    // Add new or modified images to our cache, overwriting any previous version
+    if( !pooled && timestamp != (*session->image)->timestamp ){
+      session->imageCache->insert( argument, *(*session->image) );
+      if( session->imageCache->getIndex() && !indexed ) session->imageCache->getIndex()->store( *(*session->image) );
+    }
+
+    // Warm the tile cache for newly seen images with a decoder of its own
+    if( session->tileWarmer && timestamp == 0 ){
+      IIPImage* decoder = createDecoder( *(*session->image), session );
+      if( decoder && session->tileWarmer->schedule( decoder ) && session->loglevel >= 2 ){
+	*(session->logfile) << "FIF :: Scheduled warming of lowest " << session->tileWarmer->getResolutions()
+			    << " resolutions" << endl;
+      }
+    }
 
     if( session->loglevel >= 3 ){
       *(session->logfile) << "FIF :: Created image" << endl;
@@ -209,13 +276,25 @@ void FIF::run( Session* session, const string& src ){
 			  << "FIF :: Image contains " << (*session->image)->channels
 			  << " channel" << (((*session->image)->channels>1)?"s":"") << " with "
 			  << (*session->image)->bpc << " bit" << (((*session->image)->bpc>1)?"s":"") << " per channel" << endl;
-      tm *t = gmtime( &(*session->image)->timestamp );
+      tm t;
+#ifdef WIN32
+      gmtime_s( &t, &(*session->image)->timestamp );
+#else
+      gmtime_r( &(*session->image)->timestamp, &t );
+#endif
       char strt[64];
-      strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", t );
+      strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", &t );
       *(session->logfile) << "FIF :: Image timestamp: " << strt << endl;
     }
 
   }
+  // Only remember images that do not exist or are of an unsupported type: other errors,
+  // such as running out of file descriptors, may well not recur
+  catch( const file_not_found& error ){
+    session->imageCache->setFailed( argument, error.what(), true );
+    session->response->setError( "1 3", "FIF" );
+    throw error;
+  }
   catch( const file_error& error ){
     // Unavailable file error code is 1 3
     session->response->setError( "1 3", "FIF" );
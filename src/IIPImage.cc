@@ -33,6 +33,7 @@
 
 #include <cstdio>
 #include <cstring>
+#include <cerrno>
 #include <sstream>
 #include <algorithm>
 #include <sys/stat.h>
@@ -58,6 +59,7 @@ void IIPImage::swap( IIPImage& first, IIPImage& second ) // nothrow
   std::swap( first.lut, second.lut );
   std::swap( first.image_widths, second.image_widths );
   std::swap( first.image_heights, second.image_heights );
+  std::swap( first.directory_offsets, second.directory_offsets );
   std::swap( first.tile_width, second.tile_width );
   std::swap( first.tile_height, second.tile_height );
   std::swap( first.numResolutions, second.numResolutions );
@@ -87,7 +89,11 @@ void IIPImage::testImageType()
   const char *pstr = path.c_str();
 
 
-  if( (stat(pstr,&sb)==0) && S_ISREG(sb.st_mode) ){
+  // Keep the reason our path could not be found
+  int status = stat( pstr, &sb );
+  bool missing = ( status == -1 && (errno == ENOENT || errno == ENOTDIR) );
+
+  if( (status==0) && S_ISREG(sb.st_mode) ){
 
     unsigned char header[10];
 
@@ -145,6 +151,7 @@ void IIPImage::testImageType()
     if( glob( filename.c_str(), 0, NULL, &gdat ) != 0 ){
       globfree( &gdat );
       string message = path + string( " is neither a file nor part of an image sequence" );
+      if( missing ) throw file_not_found( message );
       throw file_error( message );
     }
     if( gdat.gl_pathc != 1 ){
@@ -170,6 +177,7 @@ void IIPImage::testImageType()
 
 #else
     string message = path + string( " is not a regular file and no glob support enabled" );
+    if( missing ) throw file_not_found( message );
     throw file_error( message );
 #endif
 
@@ -195,11 +203,16 @@ void IIPImage::updateTimestamp( const string& path )
 
 const std::string IIPImage::getTimestamp()
 {
-  tm *t;
+  tm t;
   const time_t tm1 = timestamp;
-  t = gmtime( &tm1 );
+  // Use the re-entrant versions as we may be called from several worker threads
+#ifdef WIN32
+  gmtime_s( &t, &tm1 );
+#else
+  gmtime_r( &tm1, &t );
+#endif
   char strt[64];
-  strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", t );
+  strftime( strt, 64, "%a, %d %b %Y %H:%M:%S GMT", &t );
 
   return string(strt);
 }
@@ -300,7 +313,7 @@ void IIPImage::Initialise()
 
 
 
-const string IIPImage::getFileName( int seq, int ang )
+const string IIPImage::getFileName( int seq, int ang ) const
 {
   char name[1024];
 
@@ -35,6 +35,7 @@
 #include <vector>
 #include <map>
 #include <stdexcept>
+#include <stdint.h>
 
 #include "RawTile.h"
 
@@ -46,6 +47,13 @@ class file_error : public std::runtime_error {
 };
 
 
+/// File error raised when an image does not exist, as opposed to being unreadable
+class file_not_found : public file_error {
+ public:
+  file_not_found(std::string s) : file_error(s) { }
+};
+
+
 // Supported image formats
 enum ImageFormat { TIF, JPEG2000, UNSUPPORTED };
 
@@ -110,6 +118,10 @@ class IIPImage {
   /// The image pixel dimensions
   std::vector <unsigned int> image_widths, image_heights;
 
+  /// File offsets of the directory of each resolution in the same order as the
+  /// image dimensions, for formats that store these. Empty if not known
+  std::vector <uint64_t> directory_offsets;
+
   /// The base tile pixel dimensions
   unsigned int tile_width, tile_height;
 
@@ -207,6 +219,7 @@ class IIPImage {
     format( image.format ),
     image_widths( image.image_widths ),
     image_heights( image.image_heights ),
+    directory_offsets( image.directory_offsets ),
     tile_width( image.tile_width ),
     tile_height( image.tile_height ),
     colourspace( image.colourspace ),
@@ -249,7 +262,7 @@ class IIPImage {
   /** @param x horizontal sequence angle
       @param y vertical sequence angle
    */
-  const std::string getFileName( int x, int y );
+  const std::string getFileName( int x, int y ) const;
 
   /// Get the image format
   //  const std::string& getImageFormat() { return format; };
@@ -322,6 +335,14 @@ class IIPImage {
   /// Return whether this image type directly handles region decoding
   virtual bool regionDecoding(){ return false; };
 
+  /// Return a new, unopened decoder for this image
+  /** Used to decode tiles of the same image concurrently, as each decoder holds
+      the state of its own open file. The image information is shared, so only
+      openImage() needs to be called on the new decoder
+      @return decoder owned by the caller, or NULL if this image type cannot be cloned
+   */
+  virtual IIPImage* clone(){ return NULL; };
+
   /// Load the appropriate codec module for this image type
   /** Used only for dynamically loading codec modules. Overloaded by DSOImage class.
       @param module the codec module path
@@ -355,6 +376,29 @@ class IIPImage {
   virtual RawTile getTile( int h, int v, unsigned int r, int l, unsigned int t ) { return RawTile(); };
 
 
+  /// Return an individual tile in its stored JPEG encoding without decoding it
+  /** Overloaded by child classes whose images can contain JPEG compressed tiles.
+      The quality of the tile is that estimated from the stream, or 0 if unknown.
+      @param h horizontal angle
+      @param v vertical angle
+      @param r resolution
+      @param t tile number
+      @param tile RawTile to hold the complete JPEG stream
+      @return whether the tile was read - otherwise it must be decoded with getTile()
+   */
+  virtual bool getJPEGTile( int h, int v, unsigned int r, unsigned int t, RawTile& tile ) { return false; };
+
+
+  /// Advise that a set of tiles is about to be read, so that the operating system can read them ahead
+  /** Overloaded by child classes that can make use of the advice.
+      @param h horizontal angle
+      @param v vertical angle
+      @param r resolution
+      @param tiles tile numbers, such as those of a region
+   */
+  virtual void prefetchTiles( int h, int v, unsigned int r, const std::vector<unsigned int>& tiles ) {;};
+
+
   /// Return a region for a given angle and resolution
   /** Return a RawTile object: Overloaded by child class.
       @param ha horizontal angle
@@ -382,6 +426,9 @@ class IIPImage {
   /// Comparison non-equality operator
   friend int operator != ( const IIPImage&, const IIPImage& );
 
+  /// Our on-disk metadata index stores and restores all of our metadata
+  friend class MetadataIndex;
+
 };
 
 
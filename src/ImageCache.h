@@ -0,0 +1,296 @@
+// Image Metadata Cache Class
+
+/*  IIP Image Server
+
+    Copyright (C) 2020 KML Vision GmbH.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _IMAGECACHE_H
+#define _IMAGECACHE_H
+
+
+#include <string>
+#include <vector>
+#include <list>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include "Cache.h"
+#include "IIPImage.h"
+#include "MetadataIndex.h"
+
+
+
+/// Least recently used cache of image metadata shared between all worker threads.
+/**
+ *  Images are held as shared, immutable objects: lookups hand out a reference
+ *  to the cached object rather than a copy, and updates, such as a newly
+ *  computed histogram, replace the object as a whole so that existing holders
+ *  are unaffected. The cache also tracks when each image file was last checked
+ *  for modification, so that callers only need to stat() it once per
+ *  revalidation interval. Paths that failed to open are remembered for a
+ *  short time, so that repeated requests for missing or unsupported images
+ *  can be refused without touching the file system. An optional on-disk
+ *  index persists the metadata of images, which is kept up to date with
+ *  their histograms.
+ */
+
+class ImageCache {
+
+ private:
+
+  /// A cached image
+  struct Entry {
+    std::string key;
+    std::shared_ptr<const IIPImage> image;
+    std::chrono::steady_clock::time_point validated;   ///< last check for modification
+  };
+
+  /// A path that failed to open
+  struct Failure {
+    std::chrono::steady_clock::time_point expiry;
+    std::string message;
+    bool missing;          ///< whether the file could not be found or read
+  };
+
+  /// Storage typedefs - most recently used first
+  typedef std::list < Entry > EntryList;
+  typedef HASHMAP < std::string, EntryList::iterator > EntryMap;
+
+  /// Failure typedefs - the queue holds paths in order of expiry
+  typedef HASHMAP < std::string, Failure > FailureMap;
+  typedef std::deque < std::pair<std::string,std::chrono::steady_clock::time_point> > FailureQueue;
+
+  /// Maximum number of failed paths to remember
+  static const unsigned int maxFailures = 10000;
+
+  /// Maximum number of images to hold
+  unsigned int maxElements;
+
+  /// Minimum time between checks for modification
+  std::chrono::steady_clock::duration interval;
+
+  /// Main storage object
+  EntryList entryList;
+
+  /// Index into our list
+  EntryMap entryMap;
+
+  /// Time for which failed paths are remembered
+  std::chrono::steady_clock::duration failureTTL;
+
+  /// Failed paths
+  FailureMap failureMap;
+
+  /// Failed paths in order of expiry
+  FailureQueue failureQueue;
+
+  /// Our on-disk index or NULL if none
+  MetadataIndex* index;
+
+  /// Lock protecting our list and index
+  std::mutex lock;
+
+
+ public:
+
+  /// Constructor
+  /** @param max Maximum number of images to hold
+      @param revalidate minimum time in seconds between checks for modification of an image
+      @param negative time in seconds for which failed paths are remembered - 0 to disable
+   */
+  ImageCache( unsigned int max, unsigned int revalidate = 0, unsigned int negative = 0 ) :
+    maxElements( max ), interval( std::chrono::seconds( revalidate ) ),
+    failureTTL( std::chrono::seconds( negative ) ), index( NULL ) {};
+
+
+  /// Set an on-disk index below this cache
+  /** @param i index or NULL for none - not owned by the cache
+   */
+  void setIndex( MetadataIndex* i ){ index = i; };
+
+
+  /// Return our on-disk index or NULL if we have none
+  MetadataIndex* getIndex(){ return index; };
+
+
+  /// Look up an image and mark it as most recently used
+  /** @param key image path
+      @return shared image metadata or an empty pointer on a cache miss
+   */
+  std::shared_ptr<const IIPImage> get( const std::string& key ) {
+    std::lock_guard<std::mutex> guard( lock );
+    EntryMap::iterator i = entryMap.find( key );
+    if( i == entryMap.end() ) return std::shared_ptr<const IIPImage>();
+    entryList.splice( entryList.begin(), entryList, i->second );
+    return i->second->image;
+  }
+
+
+  /// Tell whether a cached image file is due to be checked for modification
+  /** The image is marked as checked, so that concurrent callers do not all check it
+      @param key image path
+      @return true if the caller should check the image
+   */
+  bool revalidate( const std::string& key ) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> guard( lock );
+    EntryMap::iterator i = entryMap.find( key );
+    if( i == entryMap.end() ) return true;
+    if( interval.count() > 0 && now - i->second->validated < interval ) return false;
+    i->second->validated = now;
+    return true;
+  }
+
+
+  /// Insert or replace an image
+  /** A copy of the image metadata is stored, which counts as freshly validated
+      @param key image path
+      @param image image to store
+   */
+  void insert( const std::string& key, const IIPImage& image ) {
+
+    // Copy outside of our lock
+    std::shared_ptr<const IIPImage> copy( new IIPImage( image ) );
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::mutex> guard( lock );
+
+    EntryMap::iterator i = entryMap.find( key );
+    if( i != entryMap.end() ){
+      i->second->image = copy;
+      i->second->validated = now;
+      entryList.splice( entryList.begin(), entryList, i->second );
+      return;
+    }
+
+    if( maxElements == 0 ) return;
+
+    // Evict our least recently used images
+    while( entryList.size() >= maxElements ){
+      entryMap.erase( entryList.back().key );
+      entryList.pop_back();
+    }
+
+    Entry entry = { key, copy, now };
+    entryList.push_front( entry );
+    entryMap[ key ] = entryList.begin();
+  }
+
+
+  /// Remember that an image failed to open
+  /** @param key image path
+      @param message error message
+      @param missing whether the file could not be found or read, rather than being unsupported
+   */
+  void setFailed( const std::string& key, const std::string& message, bool missing ) {
+
+    if( failureTTL.count() == 0 ) return;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> guard( lock );
+
+    // Forget expired failures and the oldest ones if we remember too many. Paths failing
+    // again are queued more than once, so only erase those that have not been renewed
+    while( !failureQueue.empty() && ( failureQueue.front().second <= now || failureQueue.size() >= maxFailures ) ){
+      FailureMap::iterator i = failureMap.find( failureQueue.front().first );
+      if( i != failureMap.end() && i->second.expiry == failureQueue.front().second ) failureMap.erase( i );
+      failureQueue.pop_front();
+    }
+
+    Failure failure = { now + failureTTL, message, missing };
+    failureMap[ key ] = failure;
+    failureQueue.push_back( std::make_pair( key, failure.expiry ) );
+  }
+
+
+  /// Check whether an image recently failed to open
+  /** @param key image path
+      @param message set to the error message of the failure
+      @param missing set to whether the file could not be found or read
+      @return true if the image failed to open within the failure time
+   */
+  bool getFailed( const std::string& key, std::string& message, bool& missing ) {
+
+    if( failureTTL.count() == 0 ) return false;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> guard( lock );
+
+    FailureMap::iterator i = failureMap.find( key );
+    if( i == failureMap.end() ) return false;
+    if( i->second.expiry <= now ){
+      failureMap.erase( i );
+      return false;
+    }
+    message = i->second.message;
+    missing = i->second.missing;
+    return true;
+  }
+
+
+  /// Update the histogram of a cached image
+  /** The cached image is replaced by a copy holding the histogram, which is also
+      written to our index if we have one
+      @param key image path
+      @param histogram histogram to store
+   */
+  void setHistogram( const std::string& key, const std::vector<unsigned int>& histogram ) {
+
+    std::shared_ptr<const IIPImage> image;
+    {
+      std::lock_guard<std::mutex> guard( lock );
+      EntryMap::iterator i = entryMap.find( key );
+      if( i == entryMap.end() ) return;
+      image = i->second->image;
+    }
+
+    IIPImage* copy = new IIPImage( *image );
+    copy->histogram = histogram;
+    std::shared_ptr<const IIPImage> updated( copy );
+
+    // Only replace the image if it has not been replaced in the meantime
+    {
+      std::lock_guard<std::mutex> guard( lock );
+      EntryMap::iterator i = entryMap.find( key );
+      if( i == entryMap.end() || i->second->image != image ) return;
+      i->second->image = updated;
+    }
+
+    if( index ) index->store( *updated );
+  }
+
+
+  /// Return the number of images in the cache
+  unsigned int size() {
+    std::lock_guard<std::mutex> guard( lock );
+    return entryList.size();
+  }
+
+
+  /// Return whether the cache is empty
+  bool empty() {
+    std::lock_guard<std::mutex> guard( lock );
+    return entryList.empty();
+  }
+
+};
+
+
+#endif
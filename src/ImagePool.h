@@ -0,0 +1,176 @@
+// Pool of Open Image Handles
+
+/*  IIP Image Server
+
+    Copyright (C) 2020 KML Vision GmbH.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _IMAGEPOOL_H
+#define _IMAGEPOOL_H
+
+
+#include <ctime>
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <mutex>
+#include "IIPImage.h"
+
+
+
+/// Pool of idle, already opened image decoders shared between worker threads.
+/**
+ *  Decoders are keyed by image path and modification time. A request checks
+ *  out a decoder, which then belongs exclusively to that request, and returns
+ *  it once the request has completed. Idle decoders are kept in LRU order and
+ *  the least recently returned ones are closed once the pool is full. Several
+ *  idle decoders may exist for the same image if it was used concurrently.
+ */
+
+class ImagePool {
+
+ private:
+
+  /// An idle decoder
+  struct Handle {
+    std::string path;
+    time_t timestamp;
+    IIPImage* image;
+  };
+
+  /// LRU list typedef
+  typedef std::list<Handle> HandleList;
+
+  /// Index typedef
+  typedef std::multimap<std::string, HandleList::iterator> HandleIndex;
+
+  /// Maximum number of idle decoders to hold
+  unsigned int maxElements;
+
+  /// Idle decoders - most recently returned at the front
+  HandleList handleList;
+
+  /// Index into our LRU list
+  HandleIndex handleIndex;
+
+  /// Lock protecting our list and index
+  std::mutex lock;
+
+
+  /// Remove an idle decoder from the pool - called with the lock held
+  /** @param i index entry of decoder to remove
+      @return the removed decoder
+   */
+  IIPImage* remove( HandleIndex::iterator i ) {
+    IIPImage* image = i->second->image;
+    handleList.erase( i->second );
+    handleIndex.erase( i );
+    return image;
+  }
+
+
+ public:
+
+  /// Constructor
+  /** @param max Maximum number of idle decoders to hold open */
+  ImagePool( unsigned int max ) : maxElements( max ) {};
+
+
+  /// Destructor - close all idle decoders
+  ~ImagePool() {
+    for( HandleList::iterator i = handleList.begin(); i != handleList.end(); ++i ) delete i->image;
+  }
+
+
+  /// Check out an open decoder
+  /** Idle decoders for this path with a different timestamp are stale and are closed
+      @param path image path
+      @param timestamp current modification time of the image
+      @return decoder, which the caller owns until it is checked in, or NULL if none available
+   */
+  IIPImage* checkout( const std::string& path, time_t timestamp ) {
+
+    IIPImage* image = NULL;
+    std::vector<IIPImage*> stale;
+
+    {
+      std::lock_guard<std::mutex> guard( lock );
+      std::pair<HandleIndex::iterator,HandleIndex::iterator> range = handleIndex.equal_range( path );
+      HandleIndex::iterator i = range.first;
+      while( i != range.second ){
+	HandleIndex::iterator current = i++;
+	if( current->second->timestamp != timestamp ) stale.push_back( remove( current ) );
+	else if( !image ) image = remove( current );
+      }
+    }
+
+    // Close stale decoders outside of our lock
+    for( unsigned int n = 0; n < stale.size(); n++ ) delete stale[n];
+
+    return image;
+  }
+
+
+  /// Return a decoder to the pool
+  /** The least recently returned decoders are closed if the pool is full
+      @param image decoder - ownership passes to the pool
+      @param reusable whether the decoder's request succeeded - decoders of failed requests
+      may have been left in an inconsistent state by their codec and are closed
+   */
+  void checkin( IIPImage* image, bool reusable = true ) {
+
+    // Only keep successfully opened decoders
+    if( !reusable || !image->set() || maxElements == 0 ){
+      delete image;
+      return;
+    }
+
+    std::vector<IIPImage*> evicted;
+
+    {
+      std::lock_guard<std::mutex> guard( lock );
+      Handle handle = { image->getImagePath(), image->timestamp, image };
+      handleList.push_front( handle );
+      handleIndex.insert( std::make_pair( handle.path, handleList.begin() ) );
+
+      while( handleList.size() > maxElements ){
+	std::pair<HandleIndex::iterator,HandleIndex::iterator> range = handleIndex.equal_range( handleList.back().path );
+	for( HandleIndex::iterator i = range.first; i != range.second; ++i ){
+	  if( i->second == --handleList.end() ){
+	    evicted.push_back( remove( i ) );
+	    break;
+	  }
+	}
+      }
+    }
+
+    for( unsigned int n = 0; n < evicted.size(); n++ ) delete evicted[n];
+  }
+
+
+  /// Return the number of idle decoders
+  unsigned int size() {
+    std::lock_guard<std::mutex> guard( lock );
+    return handleList.size();
+  }
+
+};
+
+
+#endif
@@ -448,10 +448,10 @@ unsigned int JPEGCompressor::Compress( RawTile& rawtile )
 
   // Check that we have enough memory in our tile for the JPEG data.
   // This can happen on small tiles with high quality factors. If so
-  // delete and reallocate memory.
+  // delete and reallocate memory. Shared data is never overwritten.
   y = dest->size;
-  if( y > rawtile.width*rawtile.height*rawtile.channels ){
-    delete[] (unsigned char*) rawtile.data;
+  if( y > rawtile.width*rawtile.height*rawtile.channels || rawtile.buffer ){
+    rawtile.deallocate();
     rawtile.data = new unsigned char[y];
   }
 
@@ -465,6 +465,7 @@ unsigned int JPEGCompressor::Compress( RawTile& rawtile )
   rawtile.dataLength = y;
   rawtile.compressionType = JPEG;
   rawtile.quality = Q;
+  rawtile.encodedQuality = 0;
 
 
   // Return the size of the data we have compressed
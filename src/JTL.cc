@@ -93,8 +93,7 @@ void JTL::send( Session* session, int resolution, int tile ){
 
     // Insert the histogram into our image cache
     const string key = (*session->image)->getImagePath();
-    imageCacheMapType::iterator i = session->imageCache->find(key);
-    if( i != session->imageCache->end() ) (i->second).histogram = (*session->image)->histogram;
+    session->imageCache->setHistogram( key, (*session->image)->histogram );
   }
 
 
@@ -122,6 +121,14 @@ void JTL::send( Session* session, int resolution, int tile ){
   }
 
 
+  // JPEG tiles stored in the image can be sent as they are if we would only re-encode them
+  // without an ICC profile at the default quality
+  if( session->jpegPassthrough && ct == JPEG && session->view->colourspace != BINARY &&
+      !( session->view->embedICC() && (*session->image)->getMetadata("icc").size()>0 ) ){
+    tilemanager.setJPEGPassthrough( true );
+  }
+
+
   RawTile rawtile = tilemanager.getTile( resolution, tile, session->view->xangle,
 					 session->view->yangle, session->view->getLayers(), ct );
 
@@ -376,6 +383,9 @@ void JTL::send( Session* session, int resolution, int tile ){
 
     }
   }
+  else if( rawtile.encodedQuality > 0 && session->loglevel >= 2 ){
+    *(session->logfile) << "JTL :: Sending stored JPEG tile of quality " << rawtile.encodedQuality << endl;
+  }
 
 
 #ifndef DEBUG
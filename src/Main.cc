@@ -25,13 +25,18 @@
 #include <fcgiapp.h>
 
 #include <ctime>
+#include <cstring>
 #include <csignal>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <utility>
 #include <map>
+#include <vector>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 #include "TPTImage.h"
 #include "JPEGCompressor.h"
@@ -51,12 +56,21 @@
 #else
 #include "Memcached.h"
 #endif
+#include "MemcacheStore.h"
 #endif
 
 #ifdef ENABLE_DL
 #include "DSOImage.h"
 #endif
 
+#ifdef HAVE_SHM
+#include "SharedMemoryCache.h"
+#endif
+
+#ifdef HAVE_DISKCACHE
+#include "DiskCache.h"
+#endif
+
 #ifdef _OPENMP
 #include <omp.h>
 #endif
@@ -96,41 +110,105 @@ using namespace std;
 */
 int loglevel;
 ofstream logfile;
-unsigned long IIPcount;
+std::atomic<unsigned long> IIPcount;
 char *tz = NULL;
 
 
+/* Lock serializing FCGX_Accept_r() across our worker threads
+*/
+static std::mutex accept_mutex;
+
+
+/* Signal asking us to terminate - 0 until one is caught
+*/
+static std::atomic<int> stop_signal( 0 );
+
+
+/* Lock serializing writes to our log file across our worker threads
+*/
+static std::mutex log_mutex;
+
 
-/* Handle a signal - print out some stats and exit
+
+/// Stream buffer through which a worker writes to our shared log file
+/** Output is collected until the stream is flushed, as it is by endl, and is
+    then written to the log file under our log lock, so that the lines of
+    concurrent workers are never interleaved
  */
-void IIPSignalHandler( int signal )
-{
-  if( loglevel >= 1 ){
+class WorkerLogBuffer : public std::streambuf {
 
-    // Reset our time zone environment
-    if(tz) setenv("TZ", tz, 1);
-    else unsetenv("TZ");
-    tzset();
+ private:
 
-    time_t current_time = time( NULL );
-    char *date = ctime( &current_time );
+  std::string buffer;
+
+ protected:
+
+  int overflow( int c ){
+    if( c != EOF ) buffer += (char) c;
+    return ( c == EOF ) ? 0 : c;
+  };
+
+  std::streamsize xsputn( const char* s, std::streamsize n ){
+    buffer.append( s, n );
+    return n;
+  };
+
+  int sync(){
+    if( buffer.empty() ) return 0;
+    std::lock_guard<std::mutex> guard( log_mutex );
+    logfile.write( buffer.data(), buffer.size() );
+    logfile.flush();
+    buffer.clear();
+    return 0;
+  };
+
+ public:
+
+  ~WorkerLogBuffer(){ sync(); };
+
+};
+
+
+
+/* Handle a signal: ask our workers to stop accepting requests. Workers finish the
+   request they are serving and main() then writes our final statistics and exits,
+   as only async-signal-safe calls may be made here. Our signals are only delivered
+   to the worker waiting in accept(), which the signal interrupts
+ */
+void IIPSignalHandler( int signal )
+{
+  int none = 0;
+  stop_signal.compare_exchange_strong( none, signal );
+  FCGX_ShutdownPending();
 
-    // No strsignal on Windows
 #ifdef WIN32
-    int sigstr = signal;
-#else
-    char *sigstr = strsignal( signal );
+  // accept() cannot be interrupted on Windows, but signals are handled in a thread of
+  // their own, so log under our log lock and exit without running static destructors
+  std::lock_guard<std::mutex> guard( log_mutex );
+  if( loglevel >= 1 ){
+    logfile << endl << "Caught signal " << signal << ". "
+	    << "Terminating after " << IIPcount << " accesses" << endl;
+  }
+  logfile.flush();
+  _exit( 0 );
 #endif
+}
 
-    logfile << endl << "Caught " << sigstr << " signal. "
-	    << "Terminating after " << IIPcount << " accesses" << endl
-	    << date
-	    << "<----------------------------------->" << endl << endl;
-    logfile.close();
-  }
 
-  exit( 0 );
+#ifndef WIN32
+/* Block or unblock our termination signals in the calling thread
+ */
+static void blockSignals( bool block )
+{
+  sigset_t signals;
+  sigemptyset( &signals );
+  sigaddset( &signals, SIGUSR1 );
+  sigaddset( &signals, SIGHUP );
+  sigaddset( &signals, SIGTERM );
+  sigaddset( &signals, SIGINT );
+  pthread_sigmask( block ? SIG_BLOCK : SIG_UNBLOCK, &signals, NULL );
 }
+#endif
 
 /**
  * Get the FCGI parameter as std::string.
@@ -148,16 +226,17 @@ std::string getFCGIParamAsString(const char *name, const FCGX_Request* request)
  * Get the content off a FCGI request.
  *
  * @param request pointer to the request object
+ * @param logger log file stream of the calling worker
  * @return the request content, or an empty string, if there is no Content-Length header specified
  */
-std::string getRequestContent(const FCGX_Request* request) {
+std::string getRequestContent(const FCGX_Request* request, ostream& logger) {
     // parse the content length as long
     char *contentLengthStr = FCGX_GetParam("CONTENT_LENGTH", request->envp);
     unsigned long contentLength = 0;
     if (contentLengthStr) {
         contentLength = std::strtol(contentLengthStr, &contentLengthStr, 10);
         if (contentLength > MAX_CONTENT_LENGTH) {
-            logfile << "Specified Content-Length (" << contentLength << ") exceeds maximum ("
+            logger << "Specified Content-Length (" << contentLength << ") exceeds maximum ("
                     << MAX_CONTENT_LENGTH << "). Reading data only up to maximum." << endl;
             contentLength = MAX_CONTENT_LENGTH;
         }
@@ -182,7 +261,7 @@ std::string getRequestContent(const FCGX_Request* request) {
         char *newBuffer = (char*) realloc(buffer, bufferSize + 1);
         if ( newBuffer == NULL ) {
             // newBuffer is NULL on allocation error, we free the old buffer.
-            logfile << "Not enough memory to read the contents of the request." << endl;
+            logger << "Not enough memory to read the contents of the request." << endl;
             free(buffer);
             return "";
         }
@@ -191,7 +270,7 @@ std::string getRequestContent(const FCGX_Request* request) {
         // read in the bytes from the request's input stream into the buffer
         bytesRead += FCGX_GetStr(bytesRead + buffer, bufferSize - bytesRead, request->in);
         if ( loglevel >= 6 ) {
-            logfile << "bytes read = " << bytesRead << ", buffer size = " << bufferSize << endl;
+            logger << "bytes read = " << bytesRead << ", buffer size = " << bufferSize << endl;
         }
         if ( bytesRead == 0 ) {
             // no bytes available to be read
@@ -201,7 +280,7 @@ std::string getRequestContent(const FCGX_Request* request) {
 
         error = FCGX_GetError(request->in);
         if ( error != 0 ) {
-            logfile << "Error occurred while reading request input (code " << error << ")" << endl;
+            logger << "Error occurred while reading request input (code " << error << ")" << endl;
             free(buffer);
             return "";
         }
@@ -214,8 +293,8 @@ std::string getRequestContent(const FCGX_Request* request) {
     std::string content(buffer);
     free(buffer);
     if ( loglevel >= 3 ) {
-        logfile << "Received request payload data (size = " << bytesRead << " bytes):" << endl;
-        logfile << content << endl;
+        logger << "Received request payload data (size = " << bytesRead << " bytes):" << endl;
+        logger << content << endl;
     }
     // truncate the content
     return content.substr(0, std::min(contentLength, content.length()));
@@ -241,790 +320,1199 @@ std::string sha256(std::string content) {
 }
 
 
-int main( int argc, char *argv[] )
-{
-  IIPcount = 0;
-  int i;
-
-
-  // Define ourselves a version
-  string version = string( VERSION );
-
-
-
-  /*************************************************
-    Initialise some variables from our environment
-  *************************************************/
+/// Configuration shared read-only by all worker threads
+struct ServerConfig {
+  int listen_socket;
+  unsigned int workers;
+  int jpeg_quality;
+  int max_CVT;
+  int max_layers;
+  string cors;
+  string base_url;
+  string cache_control;
+  map<string,string> uri_map;
+  bool allow_upscaling;
+  bool embed_icc;
+  bool jpeg_passthrough;
+  unsigned int kdu_readmode;
+  bool tiff_mmap;
+  string memcached_servers;
+  unsigned int memcached_timeout;
+#ifdef HAVE_MEMCACHED
+  MemcacheStore* memcachedStore;
+#endif
+  Watermark* watermark;
+  Transform* processor;
+  ImageCache* imageCache;
+  ImagePool* imagePool;
+  TileCache* tileCache;
+  ShardedCache* blendCache;
+  ShardedCache* channelCache;
+  unsigned int bulk_region_tiles;
+  unsigned int region_threads;
+  TileWarmer* tileWarmer;
+  char** argv;
+};
 
 
-  //  Check for a verbosity env variable and open an appendable logfile
-  //  if we want logging ie loglevel >= 0
 
-  loglevel = Environment::getVerbosity();
+/**
+ * Accept the next FCGI request. Calls are serialized as not all platforms
+ * allow concurrent accept() calls on the same socket. Termination signals
+ * are only unblocked while waiting here, so that they interrupt accept()
+ * rather than the requests being served by other workers.
+ * @param request pointer to the request object of the calling worker
+ * @return the FCGX_Accept_r() status, or -1 once we have been asked to stop
+ */
+static int acceptRequest( FCGX_Request* request ){
+  std::lock_guard<std::mutex> guard( accept_mutex );
+#ifndef WIN32
+  blockSignals( false );
+#endif
+  int status = stop_signal ? -1 : FCGX_Accept_r( request );
+#ifndef WIN32
+  blockSignals( true );
+#endif
+  return status;
+}
 
-  if( loglevel >= 1 ){
 
-    // Check for the requested log file path
-    string lf = Environment::getLogFile();
 
-    logfile.open( lf.c_str(), ios::app );
-    // If we cannot open this, set the loglevel to 0
-    if( !logfile ){
-      loglevel = 0;
-    }
+/**
+ * Worker loop: accept and handle requests until the FCGI socket is closed.
+ * Each worker owns its request, compressor, view, session and memcached
+ * connection. The image and tile caches are shared between workers.
+ * @param config shared server configuration
+ * @param worker worker number
+ */
+void IIPWorker( const ServerConfig* config, unsigned int worker )
+{
+  const string version = string( VERSION );
+  int i;
 
-    // Put a header marker and credit in the file
-    else{
+  // Each worker logs through a stream of its own, which writes whole lines to our log file
+  WorkerLogBuffer logbuffer;
+  ostream logger( &logbuffer );
 
-      // Get current time
-      time_t current_time = time( NULL );
-      char *date = ctime( &current_time );
+#ifdef HAVE_MEMCACHED
+  // Our memcached connection is not thread-safe, so create one per worker
+  Memcache memcached( config->memcached_servers, config->memcached_timeout );
+#endif
 
-      logfile << "<----------------------------------->" << endl
-	      << date << endl
-	      << "IIPImage Server. Version " << version << endl
-	      << "*** Ruven Pillay <ruven@users.sourceforge.net> ***" << endl << endl
-	      << "Verbosity level set to " << loglevel << endl;
-    }
+  // Set up our request timer
+  Timer request_timer;
+  Task* task = NULL;
 
+#ifndef DEBUG
+  FCGX_Request request;
+  if( FCGX_InitRequest( &request, config->listen_socket, 0 ) ){
+    if( loglevel >= 1 ) logger << "Worker " << worker << " unable to initialise FCGI request" << endl;
+    return;
   }
-
-
-  // Set our environment to UTC as all file modification times are GMT,
-  // but save our current state to allow us to reset before quitting
-  tz = getenv("TZ");
-  setenv("TZ","",1);
-  tzset();
+#endif
 
 
 
-  // Set up some FCGI items and make sure we are in FCGI mode
+  /****************
+    Main FCGI loop
+  ****************/
 
-#ifndef DEBUG
+#ifdef DEBUG
+  int status = true;
+  while( status ){
 
-  FCGX_Request request;
-  int listen_socket = 0;
-  bool standalone = false;
+    FILE *f = fopen( "test.jpg", "w" );
+    FileWriter writer( f );
+    status = false;
 
-  if( argv[1] && (string(argv[1]) == "--bind") ){
-    string socket = argv[2];
-    if( !socket.length() ){
-      logfile << "No socket specified" << endl << endl;
-      exit(1);
-    }
-    int backlog = DEFAULT_BACKLOG;
-    if( argv[3] && (string(argv[3]) == "--backlog") ){
-      string bklg = argv[4];
-      if( bklg.length() ) backlog = atoi( bklg.c_str() );
-    }
-    listen_socket = FCGX_OpenSocket( socket.c_str(), backlog );
-    if( listen_socket < 0 ){
-      logfile << "Unable to open socket '" << socket << "'" << endl << endl;
-      exit(1);
-    }
-    standalone = true;
-    logfile << "Running in standalone mode on socket: " << socket << " with backlog: " << backlog << endl << endl;
-  }
+#else
 
-  if( FCGX_InitRequest( &request, listen_socket, 0 ) ) return(1);
+  while( acceptRequest( &request ) >= 0 ){
 
-  // Check whether we are really in FCGI mode - only if we are not in standalone mode
-  if( FCGX_IsCGI() ){
-    if( !standalone ){
-      if( loglevel >= 1 ) logfile << "CGI-only mode detected" << endl << endl;
-      return( 1 );
-    }
-  }
-  else{
-    if( loglevel >= 1 ) logfile << "Running in FCGI mode" << endl << endl;
-  }
+    FCGIWriter writer( request.out );
 
 #endif
 
 
-  // Set our maximum image cache size
-  float max_image_cache_size = Environment::getMaxImageCacheSize();
-  imageCacheMapType imageCache;
-
-
-  // Get our image pattern variable
-  string filename_pattern = Environment::getFileNamePattern();
-
+    // Time each request
+    if( loglevel >= 2 ) request_timer.start();
 
-  // Get our default quality variable
-  int jpeg_quality = Environment::getJPEGQuality();
 
+    // Declare our image pointer here outside of the try scope
+    //  so that we can close the image on exceptions
+    IIPImage *image = NULL;
+    JPEGCompressor jpeg( config->jpeg_quality );
 
-  // Get our max CVT size
-  int max_CVT = Environment::getMaxCVT();
 
+    // View object for use with the CVT command etc
+    View view;
+    if( config->max_CVT != -1 ) view.setMaxSize( config->max_CVT );
+    if( config->max_layers != 0 ) view.setMaxLayers( config->max_layers );
+    view.setAllowUpscaling( config->allow_upscaling );
+    view.setEmbedICC( config->embed_icc );
 
-  // Get the default number of quality layers to decode
-  int max_layers = Environment::getMaxLayers();
 
 
-  // Get the filesystem prefix if any
-  string filesystem_prefix = Environment::getFileSystemPrefix();
+    // Create an IIPResponse object - we use this for the OBJ requests.
+    // As the commands return images etc, they handle their own responses.
+    IIPResponse response;
+    response.setCORS( config->cors );
+    response.setCacheControl( config->cache_control );
 
+    // create Session variable outside of try block, so that we can clear the image memory afterwards
+    Session session;
 
-  // Set up our watermark object
-  Watermark watermark( Environment::getWatermark(),
-		       Environment::getWatermarkOpacity(),
-		       Environment::getWatermarkProbability() );
+    // Whether the request failed, in which case its decoders are not reused
+    bool failed = false;
 
+    try{
 
-  // Get the CORS setting
-  string cors = Environment::getCORS();
+      // Set up our session data object
+      session.image = &image;
+      session.response = &response;
+      session.view = &view;
+      session.jpeg = &jpeg;
+      session.loglevel = loglevel;
+      session.logfile = &logger;
+      session.imageCache = config->imageCache;
+      session.imagePool = config->imagePool;
+      session.tileCache = config->tileCache;
+      session.blendCache = config->blendCache;
+      session.channelCache = config->channelCache;
+      session.bulkRegionTiles = config->bulk_region_tiles;
+      session.regionThreads = config->region_threads;
+      session.jpegPassthrough = config->jpeg_passthrough;
+      session.tileWarmer = config->tileWarmer;
+      session.out = &writer;
+      session.watermark = config->watermark;
+      session.headers.clear();
+      session.processor = config->processor;
+#ifdef HAVE_KAKADU
+      session.codecOptions["KAKADU_READMODE"] = config->kdu_readmode;
+#endif
+      session.codecOptions["TIFF_MMAP"] = config->tiff_mmap;
 
+      char* header = NULL;
+      string request_string;
+      string method = getFCGIParamAsString("REQUEST_METHOD", &request);
+      string contentType = getFCGIParamAsString("CONTENT_TYPE", &request);
+      string requestBody;
 
-  // Get any Base URL setting
-  string base_url = Environment::getBaseURL();
+#ifndef DEBUG
+      // If we have a URI prefix mapping, first test for a match between the map prefix string
+      //  and the full REQUEST_URI variable
+      if( !config->uri_map.empty() ){
 
+	string prefix = config->uri_map.begin()->first;
+	string command = config->uri_map.begin()->second;
 
-  // Get requested HTTP Cache-Control setting
-  string cache_control = Environment::getCacheControl();
+	header = FCGX_GetParam( "REQUEST_URI", request.envp );
+	const string request_uri = (header!=NULL) ? header : "";
 
+	// Try to find the prefix at the beginning of request URI
+	// Note that the first character will always be "/"
+	size_t len = prefix.length();
+	if( (len==0) || (request_uri.find(prefix)==1) ){
+	  // This is indeed a mapped request, so map our prefix with the appropriate protocol
+	  unsigned int start = (len>0) ? len+2 : 1; // Add 2 to remove both leading and trailing slashes
+	  // Strip out any query string if we are in prefix mode
+	  size_t q = request_uri.find_first_of('?');
+	  unsigned int end = (q==string::npos) ? request_uri.length() : q;
+	  request_string = command + "=" + request_uri.substr( start, end-start );
+	  if( loglevel >= 2 ) logger << "Request URI mapped to " << request_string << endl;
+	}
+      }
+#endif
 
-  // Get URI mapping if we are not using query strings
-  string uri_map_string = Environment::getURIMap();
-  map<string,string> uri_map;
+      // If the request string hasn't been set through a URI map, get it from the QUERY_STRING variable
+      if( request_string.empty() ){
+	// Get the query into a string
+#ifdef DEBUG
+	header = config->argv[1];
+#else
+	header = FCGX_GetParam( "QUERY_STRING", request.envp );
+#endif
 
+	request_string = (header!=NULL)? header : "";
+      }
 
-  // Get the allow upscaling setting
-  bool allow_upscaling = Environment::getAllowUpscaling();
 
 
-  // Get the ICC embedding setting
-  bool embed_icc = Environment::getEmbedICC();
+      // Check that we actually have a request string
+      if( request_string.empty() ){
+	throw string( "QUERY_STRING not set" );
+      }
 
+      if( loglevel >=2 ){
+	logger << "Full Request is " << request_string << endl;
+      }
 
-  // Create our image processing engine
-  Transform* processor = new Transform();
 
+      // Store some headers
+      session.headers["QUERY_STRING"] = request_string;
+      session.headers["BASE_URL"] = config->base_url;
 
-#ifdef HAVE_KAKADU
-  // Get the Kakadu readmode
-  unsigned int kdu_readmode = Environment::getKduReadMode();
+#ifndef DEBUG
+      // Get several other HTTP headers
+      if( (header = FCGX_GetParam("SERVER_PROTOCOL", request.envp)) ){
+        session.headers["SERVER_PROTOCOL"] = string(header);
+      }
+      if( (header = FCGX_GetParam("HTTP_HOST", request.envp)) ){
+        session.headers["HTTP_HOST"] = string(header);
+      }
+      if( (header = FCGX_GetParam("REQUEST_URI", request.envp)) ){
+        session.headers["REQUEST_URI"] = string(header);
+      }
+      if( (header = FCGX_GetParam("HTTPS", request.envp)) ) {
+        session.headers["HTTPS"] = string(header);
+      }
+      if( (header = FCGX_GetParam("HTTP_X_IIIF_ID", request.envp)) ){
+        session.headers["HTTP_X_IIIF_ID"] = string(header);
+      }
+
+      // Check for IF_MODIFIED_SINCE
+      if( (header = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", request.envp)) ){
+	session.headers["HTTP_IF_MODIFIED_SINCE"] = string(header);
+	if( loglevel >= 2 ){
+	  logger << "HTTP Header: If-Modified-Since: " << header << endl;
+	}
+      }
 #endif
 
+      string contentHash;
+      // read the payload, if the request uses POST
+      if ( method == "POST" && contentType.find("application/json") != std::string::npos) {
+          if ( loglevel >= 2 ) {
+              logger << "Request method: " << method << ", Content-Type: " << contentType << endl;
+          }
+          requestBody = getRequestContent(&request, logger);
+          // hash the request body and append it to the cache key identifier
+          contentHash = sha256(requestBody);
+      }
 
-  // Print out some information
-  if( loglevel >= 1 ){
-    logfile << "Setting maximum image cache size to " << max_image_cache_size << "MB" << endl;
-    logfile << "Setting filesystem prefix to '" << filesystem_prefix << "'" << endl;
-    logfile << "Setting default JPEG quality to " << jpeg_quality << endl;
-    logfile << "Setting maximum CVT size to " << max_CVT << endl;
-    logfile << "Setting HTTP Cache-Control header to '" << cache_control << "'" << endl;
-    logfile << "Setting 3D file sequence name pattern to '" << filename_pattern << "'" << endl;
-    if( !cors.empty() ) logfile << "Setting Cross Origin Resource Sharing to '" << cors << "'" << endl;
-    if( !base_url.empty() ) logfile << "Setting base URL to '" << base_url << "'" << endl;
-    if( max_layers != 0 ){
-      logfile << "Setting max quality layers (for supported file formats) to ";
-      if( max_layers < 0 ) logfile << "all layers" << endl;
-      else logfile << max_layers << endl;
-    }
-    logfile << "Setting Allow Upscaling to " << (allow_upscaling? "true" : "false") << endl;
-    logfile << "Setting ICC profile embedding to " << (embed_icc? "true" : "false") << endl;
-#ifdef HAVE_KAKADU
-    logfile << "Setting up JPEG2000 support via Kakadu SDK" << endl;
-    logfile << "Setting Kakadu read-mode to " << ((kdu_readmode==2) ? "resilient" : (kdu_readmode==1) ? "fussy" : "fast") << endl;
-#elif defined(HAVE_OPENJPEG)
-    logfile << "Setting up JPEG2000 support via OpenJPEG" << endl;
-#endif
-    logfile << "Setting image processing engine to " << processor->getDescription() << endl;
-#ifdef _OPENMP
-    int num_threads = 0;
-#pragma omp parallel
-    {
-      num_threads = omp_get_num_threads();
-    }
-    if( num_threads > 1 ) logfile << "OpenMP enabled for parallelized image processing with " << num_threads << " threads" << endl;
+#ifdef HAVE_MEMCACHED
+      // Check whether this exists in memcached, but only if we haven't had an if_modified_since
+      // request, which should always be faster to send
+      if( !header || session.headers["HTTP_IF_MODIFIED_SINCE"].empty() ){
+	char* memcached_response = NULL;
+	if( (memcached_response = memcached.retrieve( request_string + contentHash )) ){
+	  writer.putStr( memcached_response, memcached.length() );
+	  writer.flush();
+	  free( memcached_response );
+	  throw( 100 );
+	}
+      }
+
+      // Only keep a copy of our response if it is going to be stored
+      writer.capture( config->memcachedStore->connected() );
 #endif
-  }
 
 
-  // Setup our URI mapping for non-CGI requests
-  if( !uri_map_string.empty() ){
+      // Parse up the command list
 
-    // Check map is well-formed: maps must be of the form "prefix=>protocol"
-    size_t pos;
-    if( (pos = uri_map_string.find("=>")) != string::npos ){
+      list < pair<string,string> > requests;
+      list < pair<string,string> > :: const_iterator commands;
 
-      // Extract protocol
-      string prefix = uri_map_string.substr( 0, pos );
-      string protocol = uri_map_string.substr( pos+2 );
-      bool supported_protocol = false;
+      Tokenizer izer( request_string, "&" );
+      while( izer.hasMoreTokens() ){
+	pair <string,string> p;
+	string token = izer.nextToken();
+	int n = token.find_first_of( "=" );
+	p.first = token.substr( 0, n );
+	p.second = token.substr( n+1, token.length() );
+	if( p.first.length() && p.second.length() ) requests.push_back( p );
+      }
+
+
+      i = 0;
+      for( commands = requests.begin(); commands != requests.end(); commands++ ){
+
+	string command = (*commands).first;
+	string argument = (*commands).second;
+
+	if( loglevel >= 2 ){
+	  logger << "[" << i+1 << "/" << requests.size() << "]: Command / Argument is " << command << " : " << argument << endl;
+	  i++;
+	}
+
+	task = Task::factory( command );
+	if( task ) {
+        // append serialized request body as argument for the ZoomifyBlend command
+        if( dynamic_cast<ZoomifyBlend*>(task) || dynamic_cast<IIIFBlend*>(task) )
+        {
+            // Note that the request body may be empty, or incomplete, so the handler needs to take care of this
+            argument += ("&" + requestBody);
+        }
+	    task->run( &session, argument );
+	}
+
+	if( !task ){
+	  if( loglevel >= 1 ) logger << "Unsupported command: " << command << endl;
+	  // Unsupported command error code is 2 2
+	  response.setError( "2 2", command );
+	}
+
+
+	// Delete our task
+	if( task ){
+	  delete task;
+	  task = NULL;
+	}
 
-      // Make sure the command is one of our supported protocols: "IIP", "IIIF", "Zoomify", "DeepZoom"
-      string prtcl = protocol;
-      transform( prtcl.begin(), prtcl.end(), prtcl.begin(), ::tolower );
-      if( prtcl == "iip" || prtcl == "iiif" || prtcl == "iiifblend" || prtcl == "zoomify" || prtcl == "zoomifyblend" || prtcl == "deepzoom" ){
-	supported_protocol = true;
       }
 
-      if( loglevel > 0 ){
-	logfile << "Setting URI mapping to " << uri_map_string << ". "
-		<< ((supported_protocol)?"S":"Uns") << "upported protocol: " << protocol << endl;
+
+
+      ////////////////////////////////////////////////////////
+      ////////// Send out our Errors if necessary ////////////
+      ////////////////////////////////////////////////////////
+
+      /* Make sure something has actually been sent to the client
+	 If no response has been sent by now, we must have a malformed command
+       */
+      if( (!response.imageSent()) && (!response.isSet()) ){
+	// Malformed command syntax error code is 2 1
+	response.setError( "2 1", request_string );
       }
 
-      // IIP protocol requires "FIF" as first argument
-      if( prtcl == "iip" ) prtcl = "fif";
 
-      // Initialize our map
-      if( supported_protocol ) uri_map[prefix] = prtcl;
+      /* Once we have finished parsing all our OBJ and COMMAND requests
+	 send out our response.
+       */
+      if( response.isSet() ){
+	if( loglevel >= 4 ){
+	  logger << "---" << endl <<
+	    response.formatResponse() <<
+	    endl << "---" << endl;
+	}
+	if( writer.printf( response.formatResponse().c_str() ) == -1 ){
+	  if( loglevel >= 1 ) logger << "Error sending IIPResponse" << endl;
+	}
+      }
+
+
+      ////////////////////////////////////////////////////////
+      ////////// Insert the result into Memcached  ///////////
+      ////////// - Note that we never store errors ///////////
+      //////////   or 304 replies                  ///////////
+      ////////////////////////////////////////////////////////
+
+#ifdef HAVE_MEMCACHED
+      if( writer.sz > 0 && config->memcachedStore->connected() ){
+	// Send the response to the client first and hand our buffer over to the
+	// background store, so that the client does not wait for the insertion
+	writer.flush();
+	size_t length = writer.sz;
+	bool queued = config->memcachedStore->store( request_string + contentHash, writer.release(), length );
+	if( loglevel >= 3 ){
+	  logger << "Memcached :: " << (queued ? "queued " : "dropped ") << length
+		  << " bytes for storage" << endl;
+	}
+      }
+#endif
+
+
+
+      //////////////////////////////////////////////////////
+      //////////////// End of try block ////////////////////
+      //////////////////////////////////////////////////////
     }
-    else if( loglevel > 0 ) logfile << "Malformed URI map: " << uri_map_string << endl;
 
-  }
-  
+    /* Use this for sending various HTTP status codes
+     */
+    catch( const int& code ){
 
-  // Try to load our watermark
-  if( watermark.getImage().length() > 0 ){
-    watermark.init();
-    if( loglevel >= 1 ){
-      if( watermark.isSet() ){
-	logfile << "Loaded watermark image '" << watermark.getImage()
-		<< "': setting probability to " << watermark.getProbability()
-		<< " and opacity to " << watermark.getOpacity() << endl;
+      string status;
+
+      switch( code ){
+
+        case 304:
+	  status = "Status: 304 Not Modified\r\nServer: iipsrv/" + version + "\r\n\r\n";
+	  writer.printf( status.c_str() );
+	  writer.flush();
+          if( loglevel >= 2 ){
+	    logger << "Sending HTTP 304 Not Modified" << endl;
+	  }
+	  break;
+
+        case 100:
+	  if( loglevel >= 2 ){
+	    logger << "Memcached hit" << endl;
+	  }
+	  break;
+
+        default:
+          if( loglevel >= 1 ){
+	    logger << "Unsupported HTTP status code: " << code << endl << endl;
+	  }
+       }
+    }
+
+    /* Catch any errors
+     */
+    catch( const string& error ){
+
+      failed = true;
+
+      if( loglevel >= 1 ){
+	logger << endl << error << endl << endl;
+      }
+
+      if( response.errorIsSet() ){
+	if( loglevel >= 4 ){
+	  logger << "---" << endl <<
+	    response.formatResponse() <<
+	    endl << "---" << endl;
+	}
+	if( writer.printf( response.formatResponse().c_str() ) == -1 ){
+	  if( loglevel >= 1 ) logger << "Error sending IIPResponse" << endl;
+	}
       }
       else{
-	logfile << "Unable to load watermark image '" << watermark.getImage() << "'" << endl;
+	/* Display our advertising banner ;-)
+	 */
+	writer.printf( response.getAdvert().c_str() );
       }
+
     }
-  }
 
+    // Image file errors
+    catch( const file_error& error ){
+      failed = true;
+      string status = "Status: 404 Not Found\r\nServer: iipsrv/" + version +
+	(response.getCORS().length() ? "\r\n" + response.getCORS() : "") +
+	 "\r\n\r\n" + error.what();
+      writer.printf( status.c_str() );
+      writer.flush();
+      if( loglevel >= 2 ){
+	logger << error.what() << endl;
+	logger << "Sending HTTP 404 Not Found" << endl;
+      }
+    }
 
-#ifdef HAVE_MEMCACHED
+    // Parameter errors
+    catch( const invalid_argument& error ){
+      failed = true;
+      string status = "Status: 400 Bad Request\r\nServer: iipsrv/" + version +
+	(response.getCORS().length() ? "\r\n" + response.getCORS() : "") +
+	"\r\n\r\n" + error.what();
+      writer.printf( status.c_str() );
+      writer.flush();
+      if( loglevel >= 2 ){
+	logger << error.what() << endl;
+	logger << "Sending HTTP 400 Bad Request" << endl;
+      }
+    }
 
-  // Get our list of memcached servers if we have any and the timeout
-  string memcached_servers = Environment::getMemcachedServers();
-  unsigned int memcached_timeout = Environment::getMemcachedTimeout();
+    /* Default catch
+     */
+    catch( ... ){
+
+      failed = true;
+
+      if( loglevel >= 1 ){
+	logger << "Error: Default Catch: " << endl << endl;
+      }
+
+      /* Display our advertising banner ;-)
+       */
+      writer.printf( response.getAdvert().c_str() );
 
-  // Create our memcached object
-  Memcache memcached( memcached_servers, memcached_timeout );
-  if( loglevel >= 1 ){
-    if( memcached.connected() ){
-      logfile << "Memcached support enabled. Connected to servers: '" << memcached_servers
-	      << "' with timeout " << memcached_timeout << endl;
     }
-    else logfile << "Unable to connect to Memcached servers: '" << memcached.error() << "'" << endl;
+
+
+    /* Do some cleaning up etc. here after all the potential exceptions
+       have been handled
+     */
+    if( task ){
+      delete task;
+      task = NULL;
+    }
+
+    // this returns any images loaded, including the local 'image' pointer, to
+    // our pool of open images, which keeps or closes them
+    for ( int i = 0; i < session.images.size(); ++i ) {
+      config->imagePool->checkin( session.images[i], !failed );
+    }
+
+    image = NULL;
+    IIPcount ++;
+
+#ifdef DEBUG
+    fclose( f );
+#endif
+
+
+
+    // How long did this request take?
+    if( loglevel >= 2 ){
+      logger << "Total Request Time: " << request_timer.getTime() << " microseconds" << endl;
+    }
+
+
+    if( loglevel >= 2 ){
+      logger << "image closed and deleted" << endl
+	      << "Server count is " << IIPcount << endl << endl;
+    }
+
+
+
+    ///////// End of FCGI_ACCEPT while loop or for loop in debug mode //////////
   }
 
+#ifndef DEBUG
+  FCGX_Free( &request, 1 );
 #endif
 
+}
 
 
-  // Add a new line
-  if( loglevel >= 1 ) logfile << endl;
 
+int main( int argc, char *argv[] )
+{
+  IIPcount = 0;
 
-  /***********************************************************
-    Check for loadable modules - only if enabled by configure
-  ***********************************************************/
+  // Our termination signals are only unblocked by a worker waiting for a request. Block
+  // them before any thread is started, as threads inherit the mask. Signals caught during
+  // initialisation are then handled as soon as the first worker is ready
+#ifndef WIN32
+  blockSignals( true );
+#endif
 
-#ifdef ENABLE_DL
 
-  map <string, string> moduleList;
-  string modulePath;
-  envpara = getenv( "DECODER_MODULES" );
+  // Define ourselves a version
+  string version = string( VERSION );
 
-  if( envpara ){
 
-    modulePath = string( envpara );
 
-    // Try to open the module
+  /*************************************************
+    Initialise some variables from our environment
+  *************************************************/
 
-    Tokenizer izer( modulePath, "," );
-  
-    while( izer.hasMoreTokens() ){
-      
-      try{
-	string token = izer.nextToken();
-	DSOImage module;
-	module.Load( token );
-	string type = module.getImageType();
-	if( loglevel >= 1 ){
-	  logfile << "Loading external module: " << module.getDescription() << endl;
-	}
-	moduleList[ type ] = token;
-      }
-      catch( const string& error ){
-	if( loglevel >= 1 ) logfile << error << endl;
-      }
 
+  //  Check for a verbosity env variable and open an appendable logfile
+  //  if we want logging ie loglevel >= 0
+
+  loglevel = Environment::getVerbosity();
+
+  if( loglevel >= 1 ){
+
+    // Check for the requested log file path
+    string lf = Environment::getLogFile();
+
+    logfile.open( lf.c_str(), ios::app );
+    // If we cannot open this, set the loglevel to 0
+    if( !logfile ){
+      loglevel = 0;
     }
-    
-    // Tell us what's happened
-    if( loglevel >= 1 ) logfile << moduleList.size() << " external modules loaded" << endl;
 
+    // Put a header marker and credit in the file
+    else{
+
+      // Get current time
+      time_t current_time = time( NULL );
+      char *date = ctime( &current_time );
+
+      logfile << "<----------------------------------->" << endl
+	      << date << endl
+	      << "IIPImage Server. Version " << version << endl
+	      << "*** Ruven Pillay <ruven@users.sourceforge.net> ***" << endl << endl
+	      << "Verbosity level set to " << loglevel << endl;
+    }
+
+  }
+
+
+  // Set our environment to UTC as all file modification times are GMT,
+  // but save our current state to allow us to reset before quitting
+  tz = getenv("TZ");
+  setenv("TZ","",1);
+  tzset();
+
+
+
+  // Set up some FCGI items and make sure we are in FCGI mode
+
+  int listen_socket = 0;
+
+#ifndef DEBUG
+
+  bool standalone = false;
+
+  if( argv[1] && (string(argv[1]) == "--bind") ){
+    string socket = argv[2];
+    if( !socket.length() ){
+      logfile << "No socket specified" << endl << endl;
+      exit(1);
+    }
+    int backlog = DEFAULT_BACKLOG;
+    if( argv[3] && (string(argv[3]) == "--backlog") ){
+      string bklg = argv[4];
+      if( bklg.length() ) backlog = atoi( bklg.c_str() );
+    }
+    listen_socket = FCGX_OpenSocket( socket.c_str(), backlog );
+    if( listen_socket < 0 ){
+      logfile << "Unable to open socket '" << socket << "'" << endl << endl;
+      exit(1);
+    }
+    standalone = true;
+    logfile << "Running in standalone mode on socket: " << socket << " with backlog: " << backlog << endl << endl;
+  }
+
+  // Initialise the FCGI library explicitly as our worker threads use the thread-safe API
+  if( FCGX_Init() ) return(1);
+
+  // Check whether we are really in FCGI mode - only if we are not in standalone mode
+  if( FCGX_IsCGI() ){
+    if( !standalone ){
+      if( loglevel >= 1 ) logfile << "CGI-only mode detected" << endl << endl;
+      return( 1 );
+    }
+  }
+  else{
+    if( loglevel >= 1 ) logfile << "Running in FCGI mode" << endl << endl;
   }
 
 #endif
 
 
+  // Set our maximum image cache size
+  float max_image_cache_size = Environment::getMaxImageCacheSize();
+  float max_raw_tile_cache_size = Environment::getMaxRawTileCacheSize();
 
-  /***********************************************************
-    Set up a signal handler for USR1, TERM, HUP and INT signals
-    - to simplify things, they can all just shutdown the
-      server. We can rely on mod_fastcgi to restart us.
-    - SIGUSR1 and SIGHUP don't exist on Windows, though. 
-  ***********************************************************/
 
-#ifndef WIN32
-  signal( SIGUSR1, IIPSignalHandler );
-  signal( SIGHUP, IIPSignalHandler );
+  // Set the number of images whose metadata we cache and how often we check them for modification
+  unsigned int max_image_metadata = Environment::getMaxImageMetadata();
+  unsigned int metadata_revalidation_interval = Environment::getMetadataRevalidationInterval();
+  unsigned int negative_cache_ttl = Environment::getNegativeCacheTTL();
+  ImageCache imageCache( max_image_metadata, metadata_revalidation_interval, negative_cache_ttl );
+
+
+  // Persist the metadata of images below our image cache if an index directory has been given
+  MetadataIndex* metadataIndex = NULL;
+  string metadata_index = Environment::getMetadataIndex();
+  float max_metadata_index_size = Environment::getMaxMetadataIndexSize();
+  if( !metadata_index.empty() ){
+    try{
+      metadataIndex = new MetadataIndex( metadata_index, (unsigned long)( max_metadata_index_size * 1024000 ) );
+      imageCache.setIndex( metadataIndex );
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << error << endl;
+    }
+  }
+
+
+  // Set the maximum number of idle open images we keep
+  unsigned int max_open_images = Environment::getMaxOpenImages();
+  ImagePool imagePool( max_open_images );
+
+
+  // Get the number of request worker threads
+#ifdef DEBUG
+  unsigned int workers = 1;
+#else
+  unsigned int workers = Environment::getWorkerThreads();
+#endif
+
+
+  // Get the number of threads decoding the tiles of a region: by default the cores are
+  // shared out between our workers so that concurrent regions do not oversubscribe them
+  unsigned int region_threads = Environment::getRegionThreads();
+  if( region_threads == 0 ){
+#ifdef _OPENMP
+    region_threads = std::max( 1, omp_get_num_procs() / (int) workers );
+#else
+    region_threads = 1;
 #endif
+  }
 
-  signal( SIGTERM, IIPSignalHandler );
-  signal( SIGINT, IIPSignalHandler );
 
+  // Get the number of tile cache shards: by default use a single shard for
+  // a single worker and several per worker otherwise to spread lock contention,
+  // though no more than leave room in each shard for several large tiles
+  unsigned int cache_shards = Environment::getCacheShards();
+  if( cache_shards == 0 ) cache_shards = Cache::automaticShards( max_image_cache_size, max_raw_tile_cache_size, workers );
 
 
-  if( loglevel >= 1 ){
-    logfile << endl << "Initialisation Complete." << endl
-	    << "<----------------------------------->"
-	    << endl << endl;
+  // Set up our cache of final blended tiles - disabled if 0. It is sharded like the tile cache
+  float max_blend_cache_size = Environment::getMaxBlendCacheSize();
+  ShardedCache* blendCache = NULL;
+  if( max_blend_cache_size > 0 ){
+    blendCache = new ShardedCache( (unsigned long)( max_blend_cache_size * 1024000 ),
+				   Cache::automaticShards( max_blend_cache_size, 0.0, workers ) );
   }
 
 
-  // Set up our request timers and seed our random number generator with the millisecond count from it
-  Timer request_timer;
-  srand( request_timer.getTime() );
-
-  // Create our tile cache
-  Cache tileCache( max_image_cache_size );
-  Task* task = NULL;
+  // Set up our cache of windowed 8 bit blend channels - disabled if 0
+  float max_channel_cache_size = Environment::getMaxChannelCacheSize();
+  ShardedCache* channelCache = NULL;
+  if( max_channel_cache_size > 0 ){
+    channelCache = new ShardedCache( (unsigned long)( max_channel_cache_size * 1024000 ),
+				     Cache::automaticShards( max_channel_cache_size, 0.0, workers ) );
+  }
 
 
+  // Get our tile cache eviction policy
+  EvictionPolicy cache_policy = LRU_EVICTION;
+  string cache_policy_name = Environment::getCachePolicy();
+  if( cache_policy_name == "gdsf" ) cache_policy = GDSF_EVICTION;
+  else if( cache_policy_name != "lru" && loglevel >= 1 ){
+    logfile << "Unknown cache policy '" << cache_policy_name << "': using LRU" << endl;
+  }
 
-  /****************
-    Main FCGI loop
-  ****************/
 
-#ifdef DEBUG
-  int status = true;
-  while( status ){
+  // Get our tile cache admission control settings
+  bool cache_admission = false;
+  string cache_admission_name = Environment::getCacheAdmission();
+  if( cache_admission_name == "tinylfu" ) cache_admission = true;
+  else if( cache_admission_name != "none" && loglevel >= 1 ){
+    logfile << "Unknown cache admission filter '" << cache_admission_name << "': using none" << endl;
+  }
+  unsigned int bulk_region_tiles = Environment::getBulkRegionTiles();
+  unsigned int warm_resolutions = Environment::getWarmResolutions();
 
-    FILE *f = fopen( "test.jpg", "w" );
-    FileWriter writer( f );
-    status = false;
 
-#else
+  // Get our image pattern variable
+  string filename_pattern = Environment::getFileNamePattern();
 
-  while( FCGX_Accept_r( &request ) >= 0 ){
 
-    FCGIWriter writer( request.out );
+  // Get our default quality variable
+  int jpeg_quality = Environment::getJPEGQuality();
 
-#endif
 
+  // Get our max CVT size
+  int max_CVT = Environment::getMaxCVT();
 
-    // Time each request
-    if( loglevel >= 2 ) request_timer.start();
 
+  // Get the default number of quality layers to decode
+  int max_layers = Environment::getMaxLayers();
 
-    // Declare our image pointer here outside of the try scope
-    //  so that we can close the image on exceptions
-    IIPImage *image = NULL;
-    JPEGCompressor jpeg( jpeg_quality );
 
+  // Get the filesystem prefix if any
+  string filesystem_prefix = Environment::getFileSystemPrefix();
 
-    // View object for use with the CVT command etc
-    View view;
-    if( max_CVT != -1 ) view.setMaxSize( max_CVT );
-    if( max_layers != 0 ) view.setMaxLayers( max_layers );
-    view.setAllowUpscaling( allow_upscaling );
-    view.setEmbedICC( embed_icc );
 
+  // Set up our watermark object
+  Watermark watermark( Environment::getWatermark(),
+		       Environment::getWatermarkOpacity(),
+		       Environment::getWatermarkProbability() );
 
 
-    // Create an IIPResponse object - we use this for the OBJ requests.
-    // As the commands return images etc, they handle their own responses.
-    IIPResponse response;
-    response.setCORS( cors );
-    response.setCacheControl( cache_control );
+  // Get the CORS setting
+  string cors = Environment::getCORS();
 
-    // create Session variable outside of try block, so that we can clear the image memory afterwards
-    Session session;
 
-    try{
+  // Get any Base URL setting
+  string base_url = Environment::getBaseURL();
 
-      // Set up our session data object
-      session.image = &image;
-      session.response = &response;
-      session.view = &view;
-      session.jpeg = &jpeg;
-      session.loglevel = loglevel;
-      session.logfile = &logfile;
-      session.imageCache = &imageCache;
-      session.tileCache = &tileCache;
-      session.out = &writer;
-      session.watermark = &watermark;
-      session.headers.clear();
-      session.processor = processor;
-#ifdef HAVE_KAKADU
-      session.codecOptions["KAKADU_READMODE"] = kdu_readmode;
-#endif
 
-      char* header = NULL;
-      string request_string;
-      string method = getFCGIParamAsString("REQUEST_METHOD", &request);
-      string contentType = getFCGIParamAsString("CONTENT_TYPE", &request);
-      string requestBody;
+  // Get requested HTTP Cache-Control setting
+  string cache_control = Environment::getCacheControl();
 
-#ifndef DEBUG
-      // If we have a URI prefix mapping, first test for a match between the map prefix string
-      //  and the full REQUEST_URI variable
-      if( !uri_map.empty() ){
 
-	string prefix = uri_map.begin()->first;
-	string command = uri_map.begin()->second;
+  // Get URI mapping if we are not using query strings
+  string uri_map_string = Environment::getURIMap();
+  map<string,string> uri_map;
 
-	header = FCGX_GetParam( "REQUEST_URI", request.envp );
-	const string request_uri = (header!=NULL) ? header : "";
 
-	// Try to find the prefix at the beginning of request URI
-	// Note that the first character will always be "/"
-	size_t len = prefix.length();
-	if( (len==0) || (request_uri.find(prefix)==1) ){
-	  // This is indeed a mapped request, so map our prefix with the appropriate protocol
-	  unsigned int start = (len>0) ? len+2 : 1; // Add 2 to remove both leading and trailing slashes
-	  // Strip out any query string if we are in prefix mode
-	  size_t q = request_uri.find_first_of('?');
-	  unsigned int end = (q==string::npos) ? request_uri.length() : q;
-	  request_string = command + "=" + request_uri.substr( start, end-start );
-	  if( loglevel >= 2 ) logfile << "Request URI mapped to " << request_string << endl;
-	}
-      }
-#endif
+  // Get the allow upscaling setting
+  bool allow_upscaling = Environment::getAllowUpscaling();
 
-      // If the request string hasn't been set through a URI map, get it from the QUERY_STRING variable
-      if( request_string.empty() ){
-	// Get the query into a string
-#ifdef DEBUG
-	header = argv[1];
-#else
-	header = FCGX_GetParam( "QUERY_STRING", request.envp );
-#endif
 
-	request_string = (header!=NULL)? header : "";
-      }
+  // Get the ICC embedding setting
+  bool embed_icc = Environment::getEmbedICC();
 
 
+  // Get whether TIFF files are memory mapped
+  bool tiff_mmap = Environment::getTIFFMmap();
 
-      // Check that we actually have a request string
-      if( request_string.empty() ){
-	throw string( "QUERY_STRING not set" );
-      }
 
-      if( loglevel >=2 ){
-	logfile << "Full Request is " << request_string << endl;
-      }
+  // Get whether stored JPEG tiles may be sent without re-encoding
+  bool jpeg_passthrough = Environment::getJPEGPassthrough();
 
 
-      // Store some headers
-      session.headers["QUERY_STRING"] = request_string;
-      session.headers["BASE_URL"] = base_url;
+  // Create our image processing engine
+  Transform* processor = new Transform();
 
-#ifndef DEBUG
-      // Get several other HTTP headers
-      if( (header = FCGX_GetParam("SERVER_PROTOCOL", request.envp)) ){
-        session.headers["SERVER_PROTOCOL"] = string(header);
-      }
-      if( (header = FCGX_GetParam("HTTP_HOST", request.envp)) ){
-        session.headers["HTTP_HOST"] = string(header);
-      }
-      if( (header = FCGX_GetParam("REQUEST_URI", request.envp)) ){
-        session.headers["REQUEST_URI"] = string(header);
-      }
-      if( (header = FCGX_GetParam("HTTPS", request.envp)) ) {
-        session.headers["HTTPS"] = string(header);
-      }
-      if( (header = FCGX_GetParam("HTTP_X_IIIF_ID", request.envp)) ){
-        session.headers["HTTP_X_IIIF_ID"] = string(header);
-      }
 
-      // Check for IF_MODIFIED_SINCE
-      if( (header = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", request.envp)) ){
-	session.headers["HTTP_IF_MODIFIED_SINCE"] = string(header);
-	if( loglevel >= 2 ){
-	  logfile << "HTTP Header: If-Modified-Since: " << header << endl;
-	}
-      }
+#ifdef HAVE_KAKADU
+  // Get the Kakadu readmode
+  unsigned int kdu_readmode = Environment::getKduReadMode();
 #endif
 
-      string contentHash;
-      // read the payload, if the request uses POST
-      if ( method == "POST" && contentType.find("application/json") != std::string::npos) {
-          if ( loglevel >= 2 ) {
-              logfile << "Request method: " << method << ", Content-Type: " << contentType << endl;
-          }
-          requestBody = getRequestContent(&request);
-          // hash the request body and append it to the cache key identifier
-          contentHash = sha256(requestBody);
-      }
 
-#ifdef HAVE_MEMCACHED
-      // Check whether this exists in memcached, but only if we haven't had an if_modified_since
-      // request, which should always be faster to send
-      if( !header || session.headers["HTTP_IF_MODIFIED_SINCE"].empty() ){
-	char* memcached_response = NULL;
-	if( (memcached_response = memcached.retrieve( request_string + contentHash )) ){
-	  writer.putStr( memcached_response, memcached.length() );
-	  writer.flush();
-	  free( memcached_response );
-	  throw( 100 );
-	}
-      }
+  // Print out some information
+  if( loglevel >= 1 ){
+    logfile << "Setting maximum image cache size to " << max_image_cache_size << "MB" << endl;
+    logfile << "Setting number of worker threads to " << workers << endl;
+    logfile << "Setting number of tile cache shards to " << cache_shards << endl;
+    logfile << "Setting maximum number of open images to " << max_open_images << endl;
+    logfile << "Setting maximum number of images with cached metadata to " << max_image_metadata << endl;
+    logfile << "Setting image metadata revalidation interval to " << metadata_revalidation_interval << "s" << endl;
+    logfile << "Setting negative image cache time to live to " << negative_cache_ttl << "s" << endl;
+    if( metadataIndex ){
+      logfile << "Setting image metadata index to '" << metadataIndex->getDirectory() << "'";
+      if( max_metadata_index_size > 0 ) logfile << " of at most " << max_metadata_index_size << "MB";
+      logfile << endl;
+    }
+    logfile << "Setting maximum blended tile cache size to " << max_blend_cache_size << "MB";
+    if( blendCache ) logfile << " in " << blendCache->getNumShards() << " shards";
+    logfile << endl;
+    logfile << "Setting maximum blend channel cache size to " << max_channel_cache_size << "MB";
+    if( channelCache ) logfile << " in " << channelCache->getNumShards() << " shards";
+    logfile << endl;
+    logfile << "Setting filesystem prefix to '" << filesystem_prefix << "'" << endl;
+    logfile << "Setting default JPEG quality to " << jpeg_quality << endl;
+    logfile << "Setting maximum CVT size to " << max_CVT << endl;
+    logfile << "Setting HTTP Cache-Control header to '" << cache_control << "'" << endl;
+    logfile << "Setting 3D file sequence name pattern to '" << filename_pattern << "'" << endl;
+    if( !cors.empty() ) logfile << "Setting Cross Origin Resource Sharing to '" << cors << "'" << endl;
+    if( !base_url.empty() ) logfile << "Setting base URL to '" << base_url << "'" << endl;
+    if( max_layers != 0 ){
+      logfile << "Setting max quality layers (for supported file formats) to ";
+      if( max_layers < 0 ) logfile << "all layers" << endl;
+      else logfile << max_layers << endl;
+    }
+    logfile << "Setting Allow Upscaling to " << (allow_upscaling? "true" : "false") << endl;
+    logfile << "Setting ICC profile embedding to " << (embed_icc? "true" : "false") << endl;
+    logfile << "Setting JPEG tile passthrough to " << (jpeg_passthrough? "true" : "false") << endl;
+    logfile << "Setting TIFF memory mapping to " << (tiff_mmap? "true" : "false") << endl;
+#ifdef HAVE_KAKADU
+    logfile << "Setting up JPEG2000 support via Kakadu SDK" << endl;
+    logfile << "Setting Kakadu read-mode to " << ((kdu_readmode==2) ? "resilient" : (kdu_readmode==1) ? "fussy" : "fast") << endl;
+#elif defined(HAVE_OPENJPEG)
+    logfile << "Setting up JPEG2000 support via OpenJPEG" << endl;
 #endif
+    logfile << "Setting image processing engine to " << processor->getDescription() << endl;
+#ifdef _OPENMP
+    int num_threads = 0;
+#pragma omp parallel
+    {
+      num_threads = omp_get_num_threads();
+    }
+    if( num_threads > 1 ) logfile << "OpenMP enabled for parallelized image processing with " << num_threads << " threads" << endl;
+#endif
+  }
 
 
-      // Parse up the command list
-
-      list < pair<string,string> > requests;
-      list < pair<string,string> > :: const_iterator commands;
-
-      Tokenizer izer( request_string, "&" );
-      while( izer.hasMoreTokens() ){
-	pair <string,string> p;
-	string token = izer.nextToken();
-	int n = token.find_first_of( "=" );
-	p.first = token.substr( 0, n );
-	p.second = token.substr( n+1, token.length() );
-	if( p.first.length() && p.second.length() ) requests.push_back( p );
-      }
-
-
-      i = 0;
-      for( commands = requests.begin(); commands != requests.end(); commands++ ){
+  // Setup our URI mapping for non-CGI requests
+  if( !uri_map_string.empty() ){
 
-	string command = (*commands).first;
-	string argument = (*commands).second;
+    // Check map is well-formed: maps must be of the form "prefix=>protocol"
+    size_t pos;
+    if( (pos = uri_map_string.find("=>")) != string::npos ){
 
-	if( loglevel >= 2 ){
-	  logfile << "[" << i+1 << "/" << requests.size() << "]: Command / Argument is " << command << " : " << argument << endl;
-	  i++;
-	}
+      // Extract protocol
+      string prefix = uri_map_string.substr( 0, pos );
+      string protocol = uri_map_string.substr( pos+2 );
+      bool supported_protocol = false;
 
-	task = Task::factory( command );
-	if( task ) {
-        // append serialized request body as argument for the ZoomifyBlend command
-        if( dynamic_cast<ZoomifyBlend*>(task) || dynamic_cast<IIIFBlend*>(task) )
-        {
-            // Note that the request body may be empty, or incomplete, so the handler needs to take care of this
-            argument += ("&" + requestBody);
-        }
-	    task->run( &session, argument );
-	}
+      // Make sure the command is one of our supported protocols: "IIP", "IIIF", "Zoomify", "DeepZoom"
+      string prtcl = protocol;
+      transform( prtcl.begin(), prtcl.end(), prtcl.begin(), ::tolower );
+      if( prtcl == "iip" || prtcl == "iiif" || prtcl == "iiifblend" || prtcl == "zoomify" || prtcl == "zoomifyblend" || prtcl == "deepzoom" ){
+	supported_protocol = true;
+      }
 
-	if( !task ){
-	  if( loglevel >= 1 ) logfile << "Unsupported command: " << command << endl;
-	  // Unsupported command error code is 2 2
-	  response.setError( "2 2", command );
-	}
+      if( loglevel > 0 ){
+	logfile << "Setting URI mapping to " << uri_map_string << ". "
+		<< ((supported_protocol)?"S":"Uns") << "upported protocol: " << protocol << endl;
+      }
 
+      // IIP protocol requires "FIF" as first argument
+      if( prtcl == "iip" ) prtcl = "fif";
 
-	// Delete our task
-	if( task ){
-	  delete task;
-	  task = NULL;
-	}
+      // Initialize our map
+      if( supported_protocol ) uri_map[prefix] = prtcl;
+    }
+    else if( loglevel > 0 ) logfile << "Malformed URI map: " << uri_map_string << endl;
+
+  }
+  
 
+  // Try to load our watermark
+  if( watermark.getImage().length() > 0 ){
+    watermark.init();
+    if( loglevel >= 1 ){
+      if( watermark.isSet() ){
+	logfile << "Loaded watermark image '" << watermark.getImage()
+		<< "': setting probability to " << watermark.getProbability()
+		<< " and opacity to " << watermark.getOpacity() << endl;
+      }
+      else{
+	logfile << "Unable to load watermark image '" << watermark.getImage() << "'" << endl;
       }
+    }
+  }
 
 
+#ifdef HAVE_MEMCACHED
 
-      ////////////////////////////////////////////////////////
-      ////////// Send out our Errors if necessary ////////////
-      ////////////////////////////////////////////////////////
+  // Get our list of memcached servers if we have any and the timeout
+  string memcached_servers = Environment::getMemcachedServers();
+  unsigned int memcached_timeout = Environment::getMemcachedTimeout();
 
-      /* Make sure something has actually been sent to the client
-	 If no response has been sent by now, we must have a malformed command
-       */
-      if( (!response.imageSent()) && (!response.isSet()) ){
-	// Malformed command syntax error code is 2 1
-	response.setError( "2 1", request_string );
-      }
+  // Each worker creates its own memcached object - check our settings here
+  if( loglevel >= 1 ){
+    Memcache memcached( memcached_servers, memcached_timeout );
+    if( memcached.connected() ){
+      logfile << "Memcached support enabled. Connected to servers: '" << memcached_servers
+	      << "' with timeout " << memcached_timeout << endl;
+    }
+    else logfile << "Unable to connect to Memcached servers: '" << memcached.error() << "'" << endl;
+  }
 
+  // Responses are inserted by a single background thread with its own connection
+  MemcacheStore memcached_store( memcached_servers, memcached_timeout );
 
-      /* Once we have finished parsing all our OBJ and COMMAND requests
-	 send out our response.
-       */
-      if( response.isSet() ){
-	if( loglevel >= 4 ){
-	  logfile << "---" << endl <<
-	    response.formatResponse() <<
-	    endl << "---" << endl;
-	}
-	if( writer.printf( response.formatResponse().c_str() ) == -1 ){
-	  if( loglevel >= 1 ) logfile << "Error sending IIPResponse" << endl;
-	}
-      }
+#endif
 
 
-      ////////////////////////////////////////////////////////
-      ////////// Insert the result into Memcached  ///////////
-      ////////// - Note that we never store errors ///////////
-      //////////   or 304 replies                  ///////////
-      ////////////////////////////////////////////////////////
 
-#ifdef HAVE_MEMCACHED
-      if( memcached.connected() ){
-	Timer memcached_timer;
-	memcached_timer.start();
-	memcached.store( request_string + contentHash, writer.buffer, writer.sz );
-	if( loglevel >= 3 ){
-	  logfile << "Memcached :: stored " << writer.sz << " bytes in "
-		  << memcached_timer.getTime() << " microseconds" << endl;
-	}
+  // Create our tile cache: use a shared memory segment if one has been named
+  // and we are able to attach to it, otherwise an in-process cache
+  TileCache* tileCache = NULL;
+  string shared_tile_cache = Environment::getSharedTileCache();
+  if( !shared_tile_cache.empty() ){
+#ifdef HAVE_SHM
+    try{
+      tileCache = new SharedMemoryCache( shared_tile_cache, max_image_cache_size );
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << error << endl;
+    }
+#else
+    if( loglevel >= 1 ) logfile << "Shared memory tile cache not supported on this platform" << endl;
+#endif
+  }
+
+  // Add an on-disk second level below our in-process cache if a directory has been given
+  TileCache* diskCache = NULL;
+  string disk_tile_cache = Environment::getDiskTileCache();
+  if( !disk_tile_cache.empty() ){
+    if( tileCache ){
+      if( loglevel >= 1 ) logfile << "Disk tile cache can only be used with the in-process tile cache" << endl;
+    }
+    else{
+#ifdef HAVE_DISKCACHE
+      try{
+	diskCache = new DiskCache( disk_tile_cache, Environment::getMaxDiskTileCacheSize() );
+      }
+      catch( const string& error ){
+	if( loglevel >= 1 ) logfile << error << endl;
       }
+#else
+      if( loglevel >= 1 ) logfile << "Disk tile cache not supported on this platform" << endl;
 #endif
+    }
+  }
 
+  if( !tileCache ){
+    Cache* cache = new Cache( max_image_cache_size, max_raw_tile_cache_size, cache_shards, cache_policy, cache_admission );
+    cache->setSecondLevel( diskCache );
+    tileCache = cache;
+  }
+  if( loglevel >= 1 ){
+    logfile << "Setting tile cache to " << tileCache->getDescription() << endl;
+    if( diskCache ){
+      logfile << "Setting second level tile cache to " << diskCache->getDescription()
+	      << " holding " << diskCache->getNumElements() << " tiles" << endl;
+    }
+    if( bulk_region_tiles > 0 ) logfile << "Setting bulk region size to " << bulk_region_tiles << " tiles" << endl;
+#ifdef _OPENMP
+    logfile << "Setting region decoding threads to " << region_threads << endl;
+#endif
+  }
 
 
-      //////////////////////////////////////////////////////
-      //////////////// End of try block ////////////////////
-      //////////////////////////////////////////////////////
-    }
+  // Set up background warming of the lowest resolutions of newly opened images
+  TileWarmer* tileWarmer = NULL;
+  if( warm_resolutions > 0 ){
+    tileWarmer = new TileWarmer( tileCache, &imagePool, &watermark, warm_resolutions, jpeg_quality );
+    if( loglevel >= 1 ) logfile << "Setting tile cache warming to lowest " << warm_resolutions << " resolutions" << endl;
+  }
 
-    /* Use this for sending various HTTP status codes
-     */
-    catch( const int& code ){
 
-      string status;
 
-      switch( code ){
+  // Add a new line
+  if( loglevel >= 1 ) logfile << endl;
 
-        case 304:
-	  status = "Status: 304 Not Modified\r\nServer: iipsrv/" + version + "\r\n\r\n";
-	  writer.printf( status.c_str() );
-	  writer.flush();
-          if( loglevel >= 2 ){
-	    logfile << "Sending HTTP 304 Not Modified" << endl;
-	  }
-	  break;
 
-        case 100:
-	  if( loglevel >= 2 ){
-	    logfile << "Memcached hit" << endl;
-	  }
-	  break;
+  /***********************************************************
+    Check for loadable modules - only if enabled by configure
+  ***********************************************************/
 
-        default:
-          if( loglevel >= 1 ){
-	    logfile << "Unsupported HTTP status code: " << code << endl << endl;
-	  }
-       }
-    }
+#ifdef ENABLE_DL
 
-    /* Catch any errors
-     */
-    catch( const string& error ){
+  map <string, string> moduleList;
+  string modulePath;
+  envpara = getenv( "DECODER_MODULES" );
 
-      if( loglevel >= 1 ){
-	logfile << endl << error << endl << endl;
-      }
+  if( envpara ){
 
-      if( response.errorIsSet() ){
-	if( loglevel >= 4 ){
-	  logfile << "---" << endl <<
-	    response.formatResponse() <<
-	    endl << "---" << endl;
-	}
-	if( writer.printf( response.formatResponse().c_str() ) == -1 ){
-	  if( loglevel >= 1 ) logfile << "Error sending IIPResponse" << endl;
+    modulePath = string( envpara );
+
+    // Try to open the module
+
+    Tokenizer izer( modulePath, "," );
+  
+    while( izer.hasMoreTokens() ){
+      
+      try{
+	string token = izer.nextToken();
+	DSOImage module;
+	module.Load( token );
+	string type = module.getImageType();
+	if( loglevel >= 1 ){
+	  logfile << "Loading external module: " << module.getDescription() << endl;
 	}
+	moduleList[ type ] = token;
       }
-      else{
-	/* Display our advertising banner ;-)
-	 */
-	writer.printf( response.getAdvert().c_str() );
+      catch( const string& error ){
+	if( loglevel >= 1 ) logfile << error << endl;
       }
 
     }
+    
+    // Tell us what's happened
+    if( loglevel >= 1 ) logfile << moduleList.size() << " external modules loaded" << endl;
 
-    // Image file errors
-    catch( const file_error& error ){
-      string status = "Status: 404 Not Found\r\nServer: iipsrv/" + version +
-	(response.getCORS().length() ? "\r\n" + response.getCORS() : "") +
-	 "\r\n\r\n" + error.what();
-      writer.printf( status.c_str() );
-      writer.flush();
-      if( loglevel >= 2 ){
-	logfile << error.what() << endl;
-	logfile << "Sending HTTP 404 Not Found" << endl;
-      }
-    }
+  }
 
-    // Parameter errors
-    catch( const invalid_argument& error ){
-      string status = "Status: 400 Bad Request\r\nServer: iipsrv/" + version +
-	(response.getCORS().length() ? "\r\n" + response.getCORS() : "") +
-	"\r\n\r\n" + error.what();
-      writer.printf( status.c_str() );
-      writer.flush();
-      if( loglevel >= 2 ){
-	logfile << error.what() << endl;
-	logfile << "Sending HTTP 400 Bad Request" << endl;
-      }
-    }
+#endif
 
-    /* Default catch
-     */
-    catch( ... ){
 
-      if( loglevel >= 1 ){
-	logfile << "Error: Default Catch: " << endl << endl;
-      }
 
-      /* Display our advertising banner ;-)
-       */
-      writer.printf( response.getAdvert().c_str() );
+  /***********************************************************
+    Set up a signal handler for USR1, TERM, HUP and INT signals
+    - to simplify things, they can all just shutdown the
+      server. We can rely on mod_fastcgi to restart us.
+    - The handler is installed without SA_RESTART, so that
+      it interrupts the worker waiting in accept()
+    - SIGUSR1 and SIGHUP don't exist on Windows, though. 
+  ***********************************************************/
 
-    }
+#ifndef WIN32
+  struct sigaction action;
+  memset( &action, 0, sizeof(action) );
+  action.sa_handler = IIPSignalHandler;
+  sigemptyset( &action.sa_mask );
+  sigaction( SIGUSR1, &action, NULL );
+  sigaction( SIGHUP, &action, NULL );
+  sigaction( SIGTERM, &action, NULL );
+  sigaction( SIGINT, &action, NULL );
+#else
+  signal( SIGTERM, IIPSignalHandler );
+  signal( SIGINT, IIPSignalHandler );
+#endif
 
 
-    /* Do some cleaning up etc. here after all the potential exceptions
-       have been handled
-     */
-    if( task ){
-      delete task;
-      task = NULL;
-    }
 
-    // this deletes any images loaded as well as the local 'image' pointer
-    for ( int i = 0; i < session.images.size(); ++i ) {
-      delete session.images[i];
-    }
+  if( loglevel >= 1 ){
+    logfile << endl << "Initialisation Complete." << endl
+	    << "<----------------------------------->"
+	    << endl << endl;
+  }
 
-    image = NULL;
-    IIPcount ++;
 
-#ifdef DEBUG
-    fclose( f );
+  // Gather the configuration shared by our workers
+  ServerConfig config;
+  config.listen_socket = listen_socket;
+  config.workers = workers;
+  config.jpeg_quality = jpeg_quality;
+  config.max_CVT = max_CVT;
+  config.max_layers = max_layers;
+  config.cors = cors;
+  config.base_url = base_url;
+  config.cache_control = cache_control;
+  config.uri_map = uri_map;
+  config.allow_upscaling = allow_upscaling;
+  config.embed_icc = embed_icc;
+  config.jpeg_passthrough = jpeg_passthrough;
+  config.tiff_mmap = tiff_mmap;
+#ifdef HAVE_KAKADU
+  config.kdu_readmode = kdu_readmode;
+#else
+  config.kdu_readmode = 0;
+#endif
+#ifdef HAVE_MEMCACHED
+  config.memcached_servers = memcached_servers;
+  config.memcached_timeout = memcached_timeout;
+  config.memcachedStore = &memcached_store;
 #endif
+  config.watermark = &watermark;
+  config.processor = processor;
+  config.imageCache = &imageCache;
+  config.imagePool = &imagePool;
+  config.blendCache = blendCache;
+  config.channelCache = channelCache;
+  config.bulk_region_tiles = bulk_region_tiles;
+  config.region_threads = region_threads;
+  config.tileCache = tileCache;
+  config.tileWarmer = tileWarmer;
+  config.argv = argv;
+
+
+  // Start any additional workers and run the first one in our main thread
+  vector<std::thread> threads;
+  for( unsigned int n = 1; n < workers; n++ ){
+    threads.push_back( std::thread( IIPWorker, &config, n ) );
+  }
 
+  IIPWorker( &config, 0 );
 
+  for( unsigned int n = 0; n < threads.size(); n++ ) threads[n].join();
 
-    // How long did this request take?
-    if( loglevel >= 2 ){
-      logfile << "Total Request Time: " << request_timer.getTime() << " microseconds" << endl;
-    }
+  if( stop_signal && loglevel >= 1 ){
 
+    // Reset our time zone environment
+    if(tz) setenv("TZ", tz, 1);
+    else unsetenv("TZ");
+    tzset();
 
-    if( loglevel >= 2 ){
-      logfile << "image closed and deleted" << endl
-	      << "Server count is " << IIPcount << endl << endl;
-    }
+    time_t current_time = time( NULL );
+    char *date = ctime( &current_time );
 
+    // No strsignal on Windows
+#ifdef WIN32
+    int sigstr = stop_signal;
+#else
+    char *sigstr = strsignal( stop_signal );
+#endif
+
+    logfile << endl << "Caught " << sigstr << " signal. "
+	    << "Terminating after " << IIPcount << " accesses" << endl
+	    << date
+	    << "<----------------------------------->" << endl;
+  }
+
+  if( tileWarmer ){
+    if( loglevel >= 1 ){
+      logfile << endl << "Tile cache warming: " << tileWarmer->getTiles() << " tiles from "
+	      << tileWarmer->getImages() << " images" << endl;
+    }
+    delete tileWarmer;
+  }
 
+  if( loglevel >= 1 ){
+    logfile << endl << "Tile cache admissions: " << tileCache->getAdmitted() << " admitted, "
+	    << tileCache->getRejected() << " rejected" << endl;
+  }
 
-    ///////// End of FCGI_ACCEPT while loop or for loop in debug mode //////////
+  delete tileCache;
+  if( diskCache ) delete diskCache;
+  if( blendCache ) delete blendCache;
+  if( channelCache ) delete channelCache;
+  if( metadataIndex ){
+    imageCache.setIndex( NULL );
+    delete metadataIndex;
   }
 
 
 
   if( loglevel >= 1 ){
-    logfile << endl << "Terminating after " << IIPcount << " iterations" << endl;
+    logfile << "Terminating after " << IIPcount << " iterations" << endl;
     logfile.close();
   }
 
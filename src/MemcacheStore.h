@@ -0,0 +1,157 @@
+// Background Memcached Response Store
+
+/*  IIP Image Server
+
+    Copyright (C) 2020 KML Vision GmbH.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _MEMCACHESTORE_H
+#define _MEMCACHESTORE_H
+
+
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdlib>
+
+#ifdef WIN32
+#include "../windows/MemcachedWindows.h"
+#else
+#include "Memcached.h"
+#endif
+
+
+
+/// Stores responses in Memcached from a background thread
+/**
+ *  Workers hand over the response buffer once the response has been sent
+ *  to the client, so that the client never waits for the cache insertion.
+ *  The store has its own Memcached connection, which is only used by the
+ *  background thread. Responses are dropped if too much data is pending.
+ */
+
+class MemcacheStore {
+
+ private:
+
+  /// A pending insertion
+  struct Item {
+    std::string key;
+    char* data;
+    size_t length;
+  };
+
+  /// Our own connection - used only by our thread
+  Memcache memcache;
+
+  /// Pending insertions
+  std::deque<Item> queue;
+
+  /// Number of bytes pending
+  size_t queued;
+
+  /// Maximum number of bytes pending
+  size_t maxQueued;
+
+  /// Whether our thread should exit
+  bool stopping;
+
+  /// Lock and condition protecting our queue
+  std::mutex lock;
+  std::condition_variable ready;
+
+  /// Our background thread
+  std::thread worker;
+
+
+  /// Background thread: store queued responses until stopped
+  void run(){
+    std::unique_lock<std::mutex> guard( lock );
+    while( true ){
+      ready.wait( guard, [this]{ return stopping || !queue.empty(); } );
+      if( queue.empty() ) return;
+      Item item = queue.front();
+      queue.pop_front();
+      guard.unlock();
+      memcache.store( item.key, item.data, item.length );
+      free( item.data );
+      guard.lock();
+      queued -= item.length;
+    }
+  }
+
+
+ public:
+
+  /// Constructor
+  /** @param servernames list of memcached servers
+      @param timeout memcached timeout
+      @param max maximum number of bytes waiting to be stored
+  */
+  MemcacheStore( const std::string& servernames, unsigned int timeout, size_t max = 32*1024000 ) :
+    memcache( servernames, timeout ), queued( 0 ), maxQueued( max ), stopping( false ) {
+    if( memcache.connected() ) worker = std::thread( &MemcacheStore::run, this );
+  };
+
+
+  /// Destructor - store any pending responses and stop our thread
+  ~MemcacheStore(){
+    {
+      std::lock_guard<std::mutex> guard( lock );
+      stopping = true;
+    }
+    ready.notify_one();
+    if( worker.joinable() ) worker.join();
+    for( std::deque<Item>::iterator i = queue.begin(); i != queue.end(); ++i ) free( i->data );
+  };
+
+
+  /// Queue a response for storage
+  /** @param key key used for cache
+      @param data response allocated with malloc() - ownership passes to the store
+      @param length length of response
+      @return whether the response was queued - otherwise it has been freed
+  */
+  bool store( const std::string& key, char* data, size_t length ){
+    {
+      std::lock_guard<std::mutex> guard( lock );
+      if( data && worker.joinable() && queued + length <= maxQueued ){
+	Item item = { key, data, length };
+	queue.push_back( item );
+	queued += length;
+	data = NULL;
+      }
+    }
+    if( data ){
+      free( data );
+      return false;
+    }
+    ready.notify_one();
+    return true;
+  };
+
+
+  /// Tell us whether we are connected to any memcached servers
+  bool connected(){ return memcache.connected(); };
+
+};
+
+
+#endif
@@ -25,6 +25,10 @@
 #define _MEMCACHED_H
 
 #include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
 #include <libmemcached/memcached.h>
 
 #ifdef LIBMEMCACHED_VERSION_STRING
@@ -57,6 +61,87 @@ class Memcache {
   bool _connected;
 
 
+  /// 64 bit rotate left
+  static inline uint64_t rotl64( uint64_t x, int r ){ return (x << r) | (x >> (64 - r)); }
+
+
+  /// 64 bit finalization mix of MurmurHash3
+  static inline uint64_t fmix64( uint64_t k ){
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+  }
+
+
+  /// Create a fixed length memcached key from a key of any length
+  /** Uses the 128 bit x64 variant of MurmurHash3, so that keys always fit within
+      the 250 byte memcached limit. Collisions are caught by storing the full key
+      with the data and checking it on retrieval
+      @param key full key
+      @return "iipsrv::" followed by 32 hex digits
+   */
+  static std::string hashKey( const std::string& key ){
+
+    const unsigned char* data = (const unsigned char*) key.data();
+    const size_t len = key.length();
+    const size_t nblocks = len / 16;
+
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+    // Body
+    for( size_t i = 0; i < nblocks; i++ ){
+      uint64_t k1, k2;
+      memcpy( &k1, data + i*16, 8 );
+      memcpy( &k2, data + i*16 + 8, 8 );
+
+      k1 *= c1; k1 = rotl64( k1, 31 ); k1 *= c2; h1 ^= k1;
+      h1 = rotl64( h1, 27 ); h1 += h2; h1 = h1*5 + 0x52dce729;
+
+      k2 *= c2; k2 = rotl64( k2, 33 ); k2 *= c1; h2 ^= k2;
+      h2 = rotl64( h2, 31 ); h2 += h1; h2 = h2*5 + 0x38495ab5;
+    }
+
+    // Tail
+    const unsigned char* tail = data + nblocks*16;
+    uint64_t k1 = 0, k2 = 0;
+    switch( len & 15 ){
+    case 15: k2 ^= ((uint64_t)tail[14]) << 48;
+    case 14: k2 ^= ((uint64_t)tail[13]) << 40;
+    case 13: k2 ^= ((uint64_t)tail[12]) << 32;
+    case 12: k2 ^= ((uint64_t)tail[11]) << 24;
+    case 11: k2 ^= ((uint64_t)tail[10]) << 16;
+    case 10: k2 ^= ((uint64_t)tail[ 9]) << 8;
+    case  9: k2 ^= ((uint64_t)tail[ 8]);
+      k2 *= c2; k2 = rotl64( k2, 33 ); k2 *= c1; h2 ^= k2;
+    case  8: k1 ^= ((uint64_t)tail[ 7]) << 56;
+    case  7: k1 ^= ((uint64_t)tail[ 6]) << 48;
+    case  6: k1 ^= ((uint64_t)tail[ 5]) << 40;
+    case  5: k1 ^= ((uint64_t)tail[ 4]) << 32;
+    case  4: k1 ^= ((uint64_t)tail[ 3]) << 24;
+    case  3: k1 ^= ((uint64_t)tail[ 2]) << 16;
+    case  2: k1 ^= ((uint64_t)tail[ 1]) << 8;
+    case  1: k1 ^= ((uint64_t)tail[ 0]);
+      k1 *= c1; k1 = rotl64( k1, 31 ); k1 *= c2; h1 ^= k1;
+    };
+
+    // Finalization
+    h1 ^= len; h2 ^= len;
+    h1 += h2; h2 += h1;
+    h1 = fmix64( h1 ); h2 = fmix64( h2 );
+    h1 += h2; h2 += h1;
+
+    char hex[33];
+    snprintf( hex, 33, "%016llx%016llx", (unsigned long long) h1, (unsigned long long) h2 );
+    return std::string( "iipsrv::" ) + hex;
+  }
+
+
  public:
 
   /// Constructor
@@ -102,32 +187,60 @@ class Memcache {
 
 
   /// Insert data into our cache
-  /** @param key key used for cache
+  /** The data is stored under a hash of the key and is preceded by the length
+      of the full key and the full key itself
+      @param key key used for cache
       @param data pointer to the data to be stored
       @param length length of data to be stored
   */
   void store( const std::string& key, void* data, unsigned int length ){
 
     if( !_connected ) return;
- 
-    std::string k = "iipsrv::" + key;
+
+    std::string k = hashKey( key );
+
+    uint32_t key_length = key.length();
+    size_t total = sizeof(key_length) + key_length + length;
+    char* value = (char*) malloc( total );
+    if( !value ) return;
+    memcpy( value, &key_length, sizeof(key_length) );
+    memcpy( value + sizeof(key_length), key.data(), key_length );
+    memcpy( value + sizeof(key_length) + key_length, data, length );
+
     _rc = memcached_set( _memc, k.c_str(), k.length(),
-                        (char*) data, length,
+                        value, total,
                         _timeout, 0 );
+    free( value );
   }
 
 
   /// Retrieve data from our cache
-  /** @param key key for cache data
-      @return pointer to data
+  /** Entries whose stored key does not match the requested key are treated as misses
+      @param key key for cache data
+      @return pointer to data, which must be released with free(), or NULL
   */
   char* retrieve( const std::string& key ){
 
     if( !_connected ) return NULL;
 
     uint32_t flags;
-    std::string k = "iipsrv::" + key;
-    return memcached_get( _memc, k.c_str(), k.length(), &_length, &flags, &_rc );
+    std::string k = hashKey( key );
+    char* value = memcached_get( _memc, k.c_str(), k.length(), &_length, &flags, &_rc );
+    if( !value ) return NULL;
+
+    // Verify the full key and move the data to the start of our buffer
+    uint32_t key_length = 0;
+    if( _length >= sizeof(key_length) ) memcpy( &key_length, value, sizeof(key_length) );
+    if( key_length != key.length() || _length < sizeof(key_length) + key_length ||
+	memcmp( value + sizeof(key_length), key.data(), key_length ) != 0 ){
+      free( value );
+      _length = 0;
+      return NULL;
+    }
+
+    _length -= sizeof(key_length) + key_length;
+    memmove( value, value + sizeof(key_length) + key_length, _length );
+    return value;
   }
 
 
@@ -0,0 +1,409 @@
+// Member functions for MetadataIndex.h
+
+/*  IIP Image Server
+
+    Copyright (C) 2020 KML Vision GmbH.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <algorithm>
+#include <vector>
+
+#ifdef WIN32
+#include <direct.h>
+#define mkdir(path,mode) _mkdir(path)
+#else
+#include <dirent.h>
+#endif
+
+#if _MSC_VER
+#define S_ISREG(mode) (((mode) & S_IFMT) == S_IFREG)
+#endif
+
+#include "MetadataIndex.h"
+
+
+// Magic number and layout version identifying our records
+#define INDEX_MAGIC 0x4949504D
+#define INDEX_VERSION 1
+
+
+using namespace std;
+
+
+
+/// Serialises values into a record
+class RecordWriter {
+
+ public:
+
+  string data;
+
+  template <class T> void put( const T& v ){ data.append( (const char*) &v, sizeof(T) ); };
+
+  void put( const string& s ){
+    put( (uint32_t) s.size() );
+    data.append( s );
+  };
+
+  template <class T> void put( const vector<T>& v ){
+    put( (uint32_t) v.size() );
+    for( size_t i = 0; i < v.size(); i++ ) put( v[i] );
+  };
+
+};
+
+
+
+/// Reads values back from a record, failing rather than reading beyond its end
+class RecordReader {
+
+ private:
+
+  const string& data;
+  size_t pos;
+  bool ok;
+
+ public:
+
+  RecordReader( const string& d ) : data( d ), pos( 0 ), ok( true ) {};
+
+  template <class T> void get( T& v ){
+    if( !ok || data.size() - pos < sizeof(T) ){ ok = false; return; }
+    memcpy( &v, data.data() + pos, sizeof(T) );
+    pos += sizeof(T);
+  };
+
+  void get( string& s ){
+    uint32_t n = 0;
+    get( n );
+    if( !ok || data.size() - pos < n ){ ok = false; return; }
+    s.assign( data, pos, n );
+    pos += n;
+  };
+
+  // Each element takes at least a byte, which bounds the size of corrupt vectors
+  template <class T> void get( vector<T>& v ){
+    uint32_t n = 0;
+    get( n );
+    if( !ok || data.size() - pos < n ){ ok = false; return; }
+    v.resize( n );
+    for( size_t i = 0; i < n; i++ ) get( v[i] );
+  };
+
+  /// Whether the whole record has been read successfully
+  bool complete(){ return ok && pos == data.size(); };
+
+  /// Whether everything so far has been read successfully
+  bool good(){ return ok; };
+
+};
+
+
+
+MetadataIndex::MetadataIndex( const string& d, unsigned long max ) :
+  maxSize( max ), currentSize( 0 ), queued( 0 ), stopping( false ){
+
+  directory = d;
+  while( directory.length() > 1 && directory[directory.length()-1] == '/' ) directory.erase( directory.length()-1 );
+
+  if( mkdir( directory.c_str(), 0755 ) != 0 && errno != EEXIST ){
+    throw string( "MetadataIndex :: Unable to create directory '" + directory + "': " + strerror(errno) );
+  }
+
+  worker = std::thread( &MetadataIndex::run, this );
+}
+
+
+
+MetadataIndex::~MetadataIndex(){
+  {
+    std::lock_guard<std::mutex> guard( lock );
+    stopping = true;
+  }
+  ready.notify_one();
+  if( worker.joinable() ) worker.join();
+}
+
+
+
+void MetadataIndex::run(){
+
+  // Count what a previous run or other processes have left in the index
+  if( maxSize > 0 ) prune();
+
+  std::unique_lock<std::mutex> guard( lock );
+  while( true ){
+    ready.wait( guard, [this]{ return stopping || !queue.empty(); } );
+    if( queue.empty() ) return;
+    Record record = queue.front();
+    queue.pop_front();
+    guard.unlock();
+    write( record );
+    if( maxSize > 0 && currentSize > maxSize ) prune();
+    guard.lock();
+    queued -= record.data.size();
+  }
+}
+
+
+
+uint64_t MetadataIndex::hash( const string& path ){
+  // 64 bit FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for( string::const_iterator i = path.begin(); i != path.end(); ++i ){
+    h ^= (unsigned char) *i;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+
+string MetadataIndex::recordPath( const string& path, string& subdirectory ){
+  // Spread our records over 256 subdirectories to keep directories small
+  char name[17];
+  snprintf( name, sizeof(name), "%016llx", (unsigned long long) hash( path ) );
+  subdirectory = directory + "/" + string( name, 2 );
+  return subdirectory + "/" + name;
+}
+
+
+
+bool MetadataIndex::load( IIPImage& image ){
+
+  string path = image.fileSystemPrefix + image.imagePath;
+
+  struct stat sb;
+  if( stat( path.c_str(), &sb ) != 0 || !S_ISREG(sb.st_mode) ) return false;
+
+  string subdirectory;
+  ifstream file( recordPath( path, subdirectory ).c_str(), ios::in | ios::binary );
+  if( !file ) return false;
+  string data( (istreambuf_iterator<char>( file )), istreambuf_iterator<char>() );
+
+  // Only use records of this file as it is now - the hash of another path may collide
+  RecordReader record( data );
+  uint32_t magic = 0, version = 0;
+  string indexed;
+  uint64_t size = 0;
+  int64_t mtime = 0;
+  record.get( magic );
+  record.get( version );
+  record.get( indexed );
+  record.get( size );
+  record.get( mtime );
+  if( !record.good() || magic != INDEX_MAGIC || version != INDEX_VERSION || indexed != path ||
+      size != (uint64_t) sb.st_size || mtime != (int64_t) sb.st_mtime ) return false;
+
+  // Load into a copy so that the image is unchanged by a corrupt record
+  IIPImage loaded( image );
+  int32_t format = 0, colourspace = 0, sampleType = 0;
+  uint32_t entries = 0;
+  record.get( format );
+  record.get( loaded.virtual_levels );
+  record.get( loaded.lut );
+  record.get( loaded.image_widths );
+  record.get( loaded.image_heights );
+  record.get( loaded.directory_offsets );
+  record.get( loaded.tile_width );
+  record.get( loaded.tile_height );
+  record.get( colourspace );
+  record.get( loaded.numResolutions );
+  record.get( loaded.bpc );
+  record.get( loaded.channels );
+  record.get( sampleType );
+  record.get( loaded.min );
+  record.get( loaded.max );
+  record.get( loaded.quality_layers );
+  record.get( loaded.histogram );
+  record.get( entries );
+  loaded.metadata.clear();
+  for( uint32_t i = 0; i < entries && record.good(); i++ ){
+    string key, value;
+    record.get( key );
+    record.get( value );
+    loaded.metadata[key] = value;
+  }
+  if( !record.complete() || loaded.bpc == 0 ) return false;
+
+  // Set up the image as Initialise() does for single files
+  loaded.format = (ImageFormat) format;
+  loaded.colourspace = (ColourSpaces) colourspace;
+  loaded.sampleType = (SampleType) sampleType;
+  loaded.isFile = true;
+  loaded.timestamp = sb.st_mtime;
+  loaded.horizontalAnglesList.assign( 1, 0 );
+  loaded.verticalAnglesList.assign( 1, 90 );
+
+  image = loaded;
+  return true;
+}
+
+
+
+void MetadataIndex::store( const IIPImage& image ){
+
+  if( !image.isFile || image.bpc == 0 ) return;
+
+  string path = image.fileSystemPrefix + image.imagePath;
+
+  struct stat sb;
+  if( stat( path.c_str(), &sb ) != 0 || sb.st_mtime != image.timestamp ) return;
+
+  RecordWriter record;
+  record.put( (uint32_t) INDEX_MAGIC );
+  record.put( (uint32_t) INDEX_VERSION );
+  record.put( path );
+  record.put( (uint64_t) sb.st_size );
+  record.put( (int64_t) sb.st_mtime );
+  record.put( (int32_t) image.format );
+  record.put( image.virtual_levels );
+  record.put( image.lut );
+  record.put( image.image_widths );
+  record.put( image.image_heights );
+  record.put( image.directory_offsets );
+  record.put( image.tile_width );
+  record.put( image.tile_height );
+  record.put( (int32_t) image.colourspace );
+  record.put( image.numResolutions );
+  record.put( image.bpc );
+  record.put( image.channels );
+  record.put( (int32_t) image.sampleType );
+  record.put( image.min );
+  record.put( image.max );
+  record.put( image.quality_layers );
+  record.put( image.histogram );
+  record.put( (uint32_t) image.metadata.size() );
+  for( map<const string,string>::const_iterator i = image.metadata.begin(); i != image.metadata.end(); ++i ){
+    record.put( i->first );
+    record.put( i->second );
+  }
+
+  // Hand the record over to our thread
+  Record pending;
+  string subdirectory;
+  pending.path = recordPath( path, subdirectory );
+  pending.data.swap( record.data );
+  {
+    std::lock_guard<std::mutex> guard( lock );
+    if( stopping || queued + pending.data.size() > maxQueued ) return;
+    queued += pending.data.size();
+    queue.push_back( pending );
+  }
+  ready.notify_one();
+}
+
+
+
+void MetadataIndex::write( const Record& record ){
+
+  // Write to a temporary file of our own and rename it over any existing record
+  const string& target = record.path;
+  mkdir( target.substr( 0, target.find_last_of( '/' ) ).c_str(), 0755 );
+
+  char unique[32];
+  snprintf( unique, sizeof(unique), ".%08x%08x", (unsigned int) random_device()(),
+	    (unsigned int) std::hash<std::thread::id>()( std::this_thread::get_id() ) );
+  string temporary = target + unique;
+
+  ofstream file( temporary.c_str(), ios::out | ios::binary | ios::trunc );
+  if( !file ) return;
+  file.write( record.data.data(), record.data.size() );
+  file.close();
+
+  if( !file ){
+    remove( temporary.c_str() );
+    return;
+  }
+
+  // Account for the record we replace
+  struct stat sb;
+  unsigned long replaced = ( stat( target.c_str(), &sb ) == 0 ) ? sb.st_size : 0;
+
+#ifdef WIN32
+  remove( target.c_str() );
+#endif
+  if( rename( temporary.c_str(), target.c_str() ) != 0 ){
+    remove( temporary.c_str() );
+    return;
+  }
+  currentSize += record.data.size();
+  currentSize = ( currentSize > replaced ) ? currentSize - replaced : 0;
+}
+
+
+
+void MetadataIndex::prune(){
+
+#ifndef WIN32
+  // List the records of all our subdirectories
+  struct Entry {
+    time_t mtime;
+    unsigned long size;
+    string path;
+    bool operator<( const Entry& e ) const { return mtime < e.mtime; };
+  };
+  vector<Entry> entries;
+  unsigned long total = 0;
+
+  DIR* dir = opendir( directory.c_str() );
+  if( !dir ) return;
+  struct dirent* entry;
+  while( (entry = readdir( dir )) ){
+    if( entry->d_name[0] == '.' ) continue;
+    string subdirectory = directory + "/" + entry->d_name;
+    DIR* sub = opendir( subdirectory.c_str() );
+    if( !sub ) continue;
+    struct dirent* file;
+    while( (file = readdir( sub )) ){
+      if( file->d_name[0] == '.' ) continue;
+      Entry e;
+      e.path = subdirectory + "/" + file->d_name;
+      struct stat sb;
+      if( stat( e.path.c_str(), &sb ) != 0 || !S_ISREG(sb.st_mode) ) continue;
+      e.mtime = sb.st_mtime;
+      e.size = sb.st_size;
+      total += e.size;
+      entries.push_back( e );
+    }
+    closedir( sub );
+  }
+  closedir( dir );
+
+  // Delete the oldest records until we are back to three quarters of our maximum size,
+  // so that we do not have to list the index again after every record we write
+  if( total > maxSize ){
+    sort( entries.begin(), entries.end() );
+    for( vector<Entry>::const_iterator i = entries.begin(); i != entries.end() && total > maxSize / 4 * 3; ++i ){
+      if( remove( i->path.c_str() ) == 0 ) total -= i->size;
+    }
+  }
+  currentSize = total;
+#else
+  // Records are never deleted on Windows
+  currentSize = 0;
+#endif
+}
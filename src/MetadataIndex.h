@@ -0,0 +1,149 @@
+// Persistent Image Metadata Index
+
+/*  IIP Image Server
+
+    Copyright (C) 2020 KML Vision GmbH.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _METADATAINDEX_H
+#define _METADATAINDEX_H
+
+
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+#include "IIPImage.h"
+
+
+
+/// On-disk index of parsed image metadata, used below the in-process image cache
+/**
+ *  Each image file has a small record holding everything parsed when the
+ *  image is first opened: its format, pyramid dimensions and directory
+ *  offsets, tile size, sample format, min and max values, metadata fields
+ *  and, once computed, its histogram. Records are keyed by the image's full
+ *  path and are only valid for the file size and modification time they were
+ *  written for, so that images which have changed are parsed again. Records
+ *  are written to a temporary file which is then renamed, so that concurrent
+ *  readers, including other processes, never see a partial record. Records
+ *  are written by a background thread, so that requests never wait for the
+ *  disk, and are dropped if too many are pending. Once the index outgrows its
+ *  maximum size, the least recently written records are deleted. Records
+ *  use the native byte order and are not portable between machines. Only
+ *  single image files are indexed, not image sequences.
+ */
+
+class MetadataIndex {
+
+ private:
+
+  /// A record waiting to be written
+  struct Record {
+    std::string path;   ///< record file
+    std::string data;
+  };
+
+  /// Index directory
+  std::string directory;
+
+  /// Maximum size of our records in bytes - 0 for no limit
+  unsigned long maxSize;
+
+  /// Size of our records in bytes, as last counted and since written
+  unsigned long currentSize;
+
+  /// Records waiting to be written
+  std::deque<Record> queue;
+
+  /// Number of bytes waiting to be written
+  size_t queued;
+
+  /// Maximum number of bytes waiting to be written
+  static const size_t maxQueued = 4*1024000;
+
+  /// Whether our thread should exit
+  bool stopping;
+
+  /// Lock and condition protecting our queue
+  std::mutex lock;
+  std::condition_variable ready;
+
+  /// Our background thread
+  std::thread worker;
+
+
+  /// Hash function for image paths - stable across restarts
+  static uint64_t hash( const std::string& path );
+
+  /// Return the record file of an image path
+  /** @param path full image path
+      @param subdirectory set to the directory holding the record
+   */
+  std::string recordPath( const std::string& path, std::string& subdirectory );
+
+  /// Background thread: write queued records until stopped
+  void run();
+
+  /// Write a record to its file
+  /** @param record record to write
+   */
+  void write( const Record& record );
+
+  /// Delete the least recently written records until our index is well within its maximum size
+  /** Also recounts the size of our records, as other processes may share the directory */
+  void prune();
+
+
+ public:
+
+  /// Constructor
+  /** @param directory index directory - created if it does not exist
+      @param max maximum size in bytes of the records in the index - 0 for no limit
+   */
+  MetadataIndex( const std::string& directory, unsigned long max = 0 );
+
+
+  /// Destructor - write any pending records and stop our thread
+  ~MetadataIndex();
+
+
+  /// Load the metadata of an image from its record
+  /** @param image image whose path, file system prefix and file name pattern are set
+      @return true if an up to date record was found and loaded into the image, which
+      then no longer needs to be initialised or have its image information loaded
+   */
+  bool load( IIPImage& image );
+
+
+  /// Queue the record of an image for writing, replacing any existing record
+  /** Images whose file has changed since they were loaded are not stored
+      @param image image whose image information has been loaded
+   */
+  void store( const IIPImage& image );
+
+
+  /// Return the index directory
+  const std::string& getDirectory(){ return directory; };
+
+};
+
+
+#endif
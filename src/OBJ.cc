@@ -72,6 +72,8 @@ void OBJ::run( Session* s, const std::string& a )
   else if( argument == "min-max-sample-values" ) min_max_values();
   // List of available resolutions
   else if( argument == "resolutions" ) resolutions();
+  // Tile cache usage - not tied to an image
+  else if( argument == "cache-stats" ) cache_stats();
 
   // Colorspace
   /* The request can have a suffix, which we don't need, so do a
@@ -267,6 +269,60 @@ void OBJ::resolutions(){
 }
 
 
+void OBJ::cache_stats(){
+
+  // Statistics change with every request, so never let them be cached
+  session->response->setCacheControl( "no-cache" );
+  session->out->capture( false );
+
+  char tmp[256];
+  TileCache* tc = session->tileCache;
+
+  snprintf( tmp, 256, "Cache-stats:tiles=%u size=%.1f admitted=%lu rejected=%lu",
+	    tc->getNumElements(), tc->getMemorySize(), tc->getAdmitted(), tc->getRejected() );
+  session->response->addResponse( tmp );
+
+  CacheStatistics* stats = tc->getStatistics();
+  if( !stats ){
+    if( session->loglevel >= 2 ) *(session->logfile) << "OBJ :: Cache-stats: no statistics kept by tile cache" << endl;
+    return;
+  }
+
+  // Hit rates over the last 1, 5 and 15 minutes
+  string rates = "Cache-stats/hit-rate:";
+  const unsigned int windows[3] = { 60, 300, 900 };
+  for( unsigned int i = 0; i < 3; i++ ){
+    double rate = stats->getHitRate( windows[i] );
+    if( rate < 0 ) snprintf( tmp, 256, "%s%us=-", i ? " " : "", windows[i] );
+    else snprintf( tmp, 256, "%s%us=%.3f", i ? " " : "", windows[i], rate );
+    rates += tmp;
+  }
+  session->response->addResponse( rates );
+
+  // Counters of each compression type and resolution level that has been used
+  const char* types[CacheStatistics::numTypes] = { "raw", "jpeg", "deflate", "png" };
+  for( unsigned int t = 0; t < CacheStatistics::numTypes; t++ ){
+    CompressionType ct = (CompressionType) t;
+    for( unsigned int r = 0; r < CacheStatistics::numLevels; r++ ){
+      int64_t hits = stats->get( CacheStatistics::HITS, ct, r );
+      int64_t misses = stats->get( CacheStatistics::MISSES, ct, r );
+      int64_t insertions = stats->get( CacheStatistics::INSERTIONS, ct, r );
+      if( hits == 0 && misses == 0 && insertions == 0 ) continue;
+      snprintf( tmp, 256, "Cache-stats/%s/%u%s:hits=%lld misses=%lld insertions=%lld evictions=%lld bytes=%lld",
+		types[t], r, ( r == CacheStatistics::numLevels-1 ) ? "+" : "",
+		(long long) hits, (long long) misses, (long long) insertions,
+		(long long) stats->get( CacheStatistics::EVICTIONS, ct, r ),
+		(long long) stats->get( CacheStatistics::BYTES, ct, r ) );
+      session->response->addResponse( tmp );
+    }
+  }
+
+  if( session->loglevel >= 2 ){
+    *(session->logfile) << "OBJ :: Cache-stats handler returning " << rates << endl;
+  }
+}
+
+
 void OBJ::colorspace( std::string arg ){
 
   checkImage();
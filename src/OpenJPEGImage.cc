@@ -116,9 +116,9 @@ void OpenJPEGImage::loadImageInfo(int /*seq*/, int /*ang*/)
           << flush;
 #endif
 
-  static opj_image_t* l_image; // Image structure
-  static opj_stream_t* l_stream; // File stream
-  static opj_codec_t* l_codec; // Handle to a decompressor
+  static thread_local opj_image_t* l_image; // Image structure
+  static thread_local opj_stream_t* l_stream; // File stream
+  static thread_local opj_codec_t* l_codec; // Handle to a decompressor
 
   class Finally {
     // This class makes sure that the resources are deallocated properly
@@ -420,9 +420,9 @@ void OpenJPEGImage::process(unsigned int res, int layers,
                             unsigned int tw, unsigned int th, int tile,
                             void* d)
 {
-  static opj_image_t* out_image; // Decoded image
-  static opj_stream_t* l_stream; // File stream
-  static opj_codec_t* l_codec; // Handle to a decompressor
+  static thread_local opj_image_t* out_image; // Decoded image
+  static thread_local opj_stream_t* l_stream; // File stream
+  static thread_local opj_codec_t* l_codec; // Handle to a decompressor
 
   unsigned int factor = 1; // Downsampling factor - set it to default value
   int vipsres = (numResolutions - 1) - res; // Reverse resolution number
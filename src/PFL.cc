@@ -119,6 +119,7 @@ void PFL::run( Session* session, const std::string& argument ){
 
   // Create our tilemanager object
   TileManager tilemanager( session->tileCache, *session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
+  tilemanager.setRegionThreads( session->regionThreads );
 
 
   // Use our horizontal views function to get a list of available spectral images
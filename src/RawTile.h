@@ -27,6 +27,8 @@
 #include <string>
 #include <cstdlib>
 #include <ctime>
+#include <memory>
+#include <utility>
 
 
 
@@ -41,9 +43,69 @@ enum SampleType { FIXEDPOINT, FLOATINGPOINT };
 
 
 /// Class to represent a single image tile
+/**
+ *  Tile data is either owned by the tile itself (memoryManaged), points to
+ *  memory owned elsewhere, or is held in a reference-counted buffer shared
+ *  with other tiles. Copies of a tile with a shared buffer share the same
+ *  bytes instead of copying them, which is how cached tiles are handed out.
+ *  Shared data is immutable: code that modifies a tile's data in place must
+ *  first call unshare(), which copies the data only if it is still shared,
+ *  and code that replaces the data must release the old data with
+ *  deallocate().
+ */
 
 class RawTile{
 
+ private:
+
+  /// Frees shared data according to the sample format it was allocated with, unless released
+  struct Deleter {
+    int bpc;
+    SampleType sampleType;
+    bool released;
+    void operator()( void* d ) const { if( !released ) destroy( d, bpc, sampleType ); }
+  };
+
+
+  /// Copy all tile information except for the data
+  void copyInfo( const RawTile& tile ) {
+    tileNum = tile.tileNum;
+    resolution = tile.resolution;
+    hSequence = tile.hSequence;
+    vSequence = tile.vSequence;
+    compressionType = tile.compressionType;
+    quality = tile.quality;
+    encodedQuality = tile.encodedQuality;
+    filename = tile.filename;
+    timestamp = tile.timestamp;
+    dataLength = tile.dataLength;
+    width = tile.width;
+    height = tile.height;
+    channels = tile.channels;
+    bpc = tile.bpc;
+    sampleType = tile.sampleType;
+    padded = tile.padded;
+  }
+
+
+  /// Share the data of another tile if it is shared, or otherwise copy it
+  void copyData( const RawTile& tile ) {
+    if( tile.buffer ){
+      buffer = tile.buffer;
+      data = tile.data;
+      memoryManaged = 0;
+      return;
+    }
+    buffer.reset();
+    data = NULL;
+    memoryManaged = 1;
+    if( tile.data && dataLength > 0 ){
+      data = allocate( dataLength, bpc, sampleType );
+      memcpy( data, tile.data, dataLength );
+    }
+  }
+
+
  public:
 
   /// The tile number for this tile
@@ -64,6 +126,10 @@ class RawTile{
   /// Compression rate or quality
   int quality;
 
+  /// Quality at which JPEG data was actually encoded where this differs from the
+  /// quality the tile is indexed under, as for JPEG tiles passed through from the image - 0 otherwise
+  int encodedQuality;
+
   /// Name of the file from which this tile comes
   std::string filename;
 
@@ -78,6 +144,9 @@ class RawTile{
   /** This is used in the destructor to make sure we deallocate correctly */
   int memoryManaged;
 
+  /// Reference-counted owner of data shared with other tiles - empty otherwise
+  std::shared_ptr<void> buffer;
+
   /// The size of the data pointed to by data
   unsigned int dataLength;
 
@@ -100,6 +169,46 @@ class RawTile{
   bool padded;
 
 
+  /// Allocate a data buffer of the type appropriate to a sample format
+  /** @param length size in bytes
+      @param b bits per channel
+      @param s sample type
+      @return buffer to be freed with destroy()
+   */
+  static void* allocate( unsigned int length, int b, SampleType s ) {
+    switch( b ){
+      case 32:
+	if( s == FLOATINGPOINT ) return new float[(length+3)/4];
+	return new unsigned int[(length+3)/4];
+      case 16:
+	return new unsigned short[(length+1)/2];
+      default:
+	return new unsigned char[length];
+    }
+  }
+
+
+  /// Free a data buffer allocated for a sample format
+  /** @param d buffer
+      @param b bits per channel
+      @param s sample type
+   */
+  static void destroy( void* d, int b, SampleType s ) {
+    switch( b ){
+      case 32:
+	if( s == FLOATINGPOINT ) delete[] (float*) d;
+	else delete[] (unsigned int*) d;
+	break;
+      case 16:
+	delete[] (unsigned short*) d;
+	break;
+      default:
+	delete[] (unsigned char*) d;
+	break;
+    }
+  }
+
+
   /// Main constructor
   /** @param tn tile number
       @param res resolution
@@ -115,108 +224,103 @@ class RawTile{
     width = w; height = h; bpc = b; dataLength = 0; data = NULL;
     tileNum = tn; resolution = res; hSequence = hs ; vSequence = vs;
     memoryManaged = 1; channels = c; compressionType = UNCOMPRESSED; quality = 0;
+    encodedQuality = 0;
     timestamp = 0; sampleType = FIXEDPOINT; padded = false;
   };
 
 
   /// Destructor to free the data array if is has previously be allocated locally
   ~RawTile() {
-    if( data && memoryManaged ){
-      switch( bpc ){
-      case 32:
-        if( sampleType == FLOATINGPOINT ) delete[] (float*) data;
-        else delete[] (unsigned int*) data;
-        break;
-      case 16:
-	delete[] (unsigned short*) data;
-        break;
-      default:
-	delete[] (unsigned char*) data;
-        break;
-      }
-    }
+    if( data && memoryManaged ) destroy( data, bpc, sampleType );
   }
 
 
-  /// Copy constructor - handles copying of data buffer
+  /// Copy constructor - shares shared data and copies any other data
   RawTile( const RawTile& tile ) {
+    copyInfo( tile );
+    copyData( tile );
+  }
 
-    tileNum = tile.tileNum;
-    resolution = tile.resolution;
-    hSequence = tile.hSequence;
-    vSequence = tile.vSequence;
-    compressionType = tile.compressionType;
-    quality = tile.quality;
-    filename = tile.filename;
-    timestamp = tile.timestamp;
-    memoryManaged = tile.memoryManaged;
-    dataLength = tile.dataLength;
-    width = tile.width;
-    height = tile.height;
-    channels = tile.channels;
-    bpc = tile.bpc;
-    sampleType = tile.sampleType;
-    padded = tile.padded;
-
-    switch( bpc ){
-      case 32:
-	if( sampleType == FLOATINGPOINT ) data = new float[dataLength/4];
-	else data = new unsigned int[dataLength/4];
-	break;
-      case 16:
-	data = new unsigned short[dataLength/2];
-	break;
-      default:
-	data = new unsigned char[dataLength];
-	break;
-    }
 
-    if( data && (dataLength > 0) && tile.data ){
-      memcpy( data, tile.data, dataLength );
-      memoryManaged = 1;
+  /// Move constructor - takes over owned or shared data and copies data owned elsewhere
+  RawTile( RawTile&& tile ) {
+    copyInfo( tile );
+    if( tile.memoryManaged || tile.buffer ){
+      data = tile.data;
+      memoryManaged = tile.memoryManaged;
+      buffer = std::move( tile.buffer );
+      tile.data = NULL;
+      tile.memoryManaged = 1;
     }
+    else copyData( tile );
   }
 
 
-  /// Copy assignment constructor
+  /// Copy assignment operator - shares shared data and copies any other data
   RawTile& operator= ( const RawTile& tile ) {
+    if( this == &tile ) return *this;
+    deallocate();
+    copyInfo( tile );
+    copyData( tile );
+    return *this;
+  }
 
-    tileNum = tile.tileNum;
-    resolution = tile.resolution;
-    hSequence = tile.hSequence;
-    vSequence = tile.vSequence;
-    compressionType = tile.compressionType;
-    quality = tile.quality;
-    filename = tile.filename;
-    timestamp = tile.timestamp;
-    memoryManaged = tile.memoryManaged;
-    dataLength = tile.dataLength;
-    width = tile.width;
-    height = tile.height;
-    channels = tile.channels;
-    bpc = tile.bpc;
-    sampleType = tile.sampleType;
-    padded = tile.padded;
 
-    switch( bpc ){
-      case 32:
-	if( sampleType == FLOATINGPOINT ) data = new float[dataLength/4];
-	else data = new int[dataLength/4];
-	break;
-      case 16:
-	data = new unsigned short[dataLength/2];
-	break;
-      default:
-	data = new unsigned char[dataLength];
-	break;
+  /// Move assignment operator - takes over owned or shared data and copies data owned elsewhere
+  RawTile& operator= ( RawTile&& tile ) {
+    if( this == &tile ) return *this;
+    deallocate();
+    copyInfo( tile );
+    if( tile.memoryManaged || tile.buffer ){
+      data = tile.data;
+      memoryManaged = tile.memoryManaged;
+      buffer = std::move( tile.buffer );
+      tile.data = NULL;
+      tile.memoryManaged = 1;
     }
+    else copyData( tile );
+    return *this;
+  }
 
-    if( data && (dataLength > 0) && tile.data ){
-      memcpy( data, tile.data, dataLength );
-      memoryManaged = 1;
+
+  /// Hand our data over to a reference-counted buffer, so that copies share it
+  /** Data not owned by the tile is copied first */
+  void share() {
+    if( buffer || !data ) return;
+    if( !memoryManaged ){
+      void* d = allocate( dataLength, bpc, sampleType );
+      memcpy( d, data, dataLength );
+      data = d;
     }
+    Deleter deleter = { bpc, sampleType, false };
+    buffer = std::shared_ptr<void>( data, deleter );
+    memoryManaged = 0;
+  }
 
-    return *this;
+
+  /// Make sure our data is not shared with any other tile before modifying it
+  /** Shared data is copied, unless this tile holds the last reference to it */
+  void unshare() {
+    if( !buffer ) return;
+    if( buffer.use_count() == 1 ) std::get_deleter<Deleter>( buffer )->released = true;
+    else{
+      void* d = allocate( dataLength, bpc, sampleType );
+      memcpy( d, data, dataLength );
+      data = d;
+    }
+    buffer.reset();
+    memoryManaged = 1;
+  }
+
+
+  /// Release our data before replacing it
+  /** Owned data is freed and shared data is left to its other holders. Data
+      subsequently assigned to the tile is owned by it */
+  void deallocate() {
+    if( data && memoryManaged ) destroy( data, bpc, sampleType );
+    buffer.reset();
+    data = NULL;
+    memoryManaged = 1;
   }
 
 
@@ -0,0 +1,561 @@
+// Member functions for SharedMemoryCache.h
+
+/*  IIP Image Server
+
+    Copyright (C) 2020 KML Vision GmbH.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <cstring>
+#include <sstream>
+
+#include "SharedMemoryCache.h"
+
+
+// Magic number and layout version identifying our segments
+#define SHM_MAGIC 0x49495053
+#define SHM_VERSION 3
+
+// Smallest chunk size
+#define SHM_MIN_CHUNK 1024
+
+// Average number of bytes per bucket in our hash index
+#define SHM_BYTES_PER_BUCKET 16384
+
+// Slab class of chunks that hold no tile
+#define SHM_FREE_CHUNK SHM_SLAB_CLASSES
+
+
+using namespace std;
+
+
+
+/// Per slab class bookkeeping
+struct SlabClass {
+  uint64_t chunk_size;
+  uint64_t free_list;    // First free chunk
+  uint64_t lru_head;     // Most recently used item
+  uint64_t lru_tail;     // Least recently used item
+  uint64_t num_pages;    // Pages assigned to this class
+};
+
+
+/// Segment header at offset 0 of the segment. All links are byte offsets
+/// from the start of the segment, with 0 meaning none.
+struct SharedMemoryCache::Header {
+  volatile uint32_t magic;
+  uint32_t version;
+  uint64_t size;
+  uint64_t num_buckets;
+  uint64_t buckets;
+  uint64_t pages;
+  uint64_t num_pages;
+  uint64_t pages_used;
+  uint64_t num_items;
+  uint64_t bytes_used;
+  pthread_mutex_t mutex;
+  SlabClass classes[SHM_SLAB_CLASSES];
+};
+
+
+/// Chunk header, followed by the cache index and then the tile data
+struct SharedMemoryCache::Item {
+  uint64_t hash_next;
+  uint64_t lru_prev;
+  uint64_t lru_next;
+  uint64_t hash;
+  uint32_t slab_class;   // SHM_FREE_CHUNK if the chunk holds no tile
+  uint32_t key_length;
+  uint32_t data_length;
+  int32_t tileNum;
+  int32_t resolution;
+  int32_t hSequence;
+  int32_t vSequence;
+  int32_t compressionType;
+  int32_t quality;
+  int32_t encodedQuality;
+  uint32_t width;
+  uint32_t height;
+  int32_t channels;
+  int32_t bpc;
+  int32_t sampleType;
+  int32_t padded;
+  int64_t timestamp;
+};
+
+
+
+SharedMemoryCache::SharedMemoryCache( const string& n, float max ){
+
+  name = n;
+  if( name.empty() || name[0] != '/' ) name = "/" + name;
+
+  base = NULL;
+  header = NULL;
+  size = (size_t)( max * 1024000 );
+
+  // Try to create the segment. If it already exists, attach to it instead
+  bool creator = true;
+  int fd = shm_open( name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600 );
+
+  if( fd < 0 ){
+    if( errno != EEXIST ){
+      throw string( "SharedMemoryCache :: Unable to create shared memory segment '" + name + "': " + strerror(errno) );
+    }
+    creator = false;
+    fd = shm_open( name.c_str(), O_RDWR, 0600 );
+    if( fd < 0 ){
+      throw string( "SharedMemoryCache :: Unable to open shared memory segment '" + name + "': " + strerror(errno) );
+    }
+  }
+
+  // Size and initialise the segment under a lock on the shared memory object. The lock
+  // is released if its holder dies, so whichever process finds the segment not fully
+  // set up, including one left behind by a creator that died, initialises it
+  if( flock( fd, LOCK_EX ) != 0 ){
+    close( fd );
+    if( creator ) shm_unlink( name.c_str() );
+    throw string( "SharedMemoryCache :: Unable to lock shared memory segment '" + name + "': " + strerror(errno) );
+  }
+
+  struct stat sb;
+  if( fstat( fd, &sb ) != 0 ) sb.st_size = 0;
+
+  if( sb.st_size < (off_t) sizeof(Header) ){
+    if( size < sizeof(Header) + SHM_PAGE_SIZE || ftruncate( fd, size ) != 0 ){
+      close( fd );
+      if( creator ) shm_unlink( name.c_str() );
+      throw string( "SharedMemoryCache :: Unable to size shared memory segment '" + name + "'" );
+    }
+  }
+  else size = sb.st_size;
+
+  void* ptr = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if( ptr == MAP_FAILED ){
+    int error = errno;
+    close( fd );
+    if( creator ) shm_unlink( name.c_str() );
+    throw string( "SharedMemoryCache :: Unable to map shared memory segment '" + name + "': " + strerror(error) );
+  }
+
+  base = (unsigned char*) ptr;
+  header = (Header*) base;
+
+  if( header->magic != SHM_MAGIC ){
+    this->initialise();
+    // Publish the segment only once fully set up
+    __sync_synchronize();
+    header->magic = SHM_MAGIC;
+  }
+
+  // Closing our descriptor also releases our lock
+  close( fd );
+
+  if( header->version != SHM_VERSION || header->size != size ){
+    munmap( base, size );
+    base = NULL;
+    throw string( "SharedMemoryCache :: Shared memory segment '" + name + "' has an incompatible layout" );
+  }
+
+}
+
+
+
+SharedMemoryCache::~SharedMemoryCache(){
+  if( base ) munmap( base, size );
+}
+
+
+
+void SharedMemoryCache::initialise(){
+
+  header->version = SHM_VERSION;
+  header->size = size;
+
+  // Our bucket array follows the header and the pages follow the buckets,
+  // aligned to the system page size
+  header->buckets = ( sizeof(Header) + 63 ) & ~((uint64_t)63);
+  header->num_buckets = size / SHM_BYTES_PER_BUCKET;
+  if( header->num_buckets < 1024 ) header->num_buckets = 1024;
+
+  uint64_t alignment = sysconf( _SC_PAGESIZE );
+  header->pages = ( header->buckets + header->num_buckets*sizeof(uint64_t) + alignment - 1 ) / alignment * alignment;
+  header->num_pages = ( size > header->pages ) ? ( size - header->pages ) / SHM_PAGE_SIZE : 0;
+
+  // Set up our process-shared mutex. Make it robust so that a process dying
+  // while holding the lock does not block all the others
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init( &attr );
+  pthread_mutexattr_setpshared( &attr, PTHREAD_PROCESS_SHARED );
+#ifdef HAVE_ROBUST_MUTEX
+  pthread_mutexattr_setrobust( &attr, PTHREAD_MUTEX_ROBUST );
+#endif
+  pthread_mutex_init( &header->mutex, &attr );
+  pthread_mutexattr_destroy( &attr );
+
+  this->reset();
+}
+
+
+
+void SharedMemoryCache::reset(){
+
+  memset( buckets(), 0, header->num_buckets * sizeof(uint64_t) );
+
+  for( unsigned int i=0; i<SHM_SLAB_CLASSES; i++ ){
+    header->classes[i].chunk_size = (uint64_t) SHM_MIN_CHUNK << i;
+    header->classes[i].free_list = 0;
+    header->classes[i].lru_head = 0;
+    header->classes[i].lru_tail = 0;
+    header->classes[i].num_pages = 0;
+  }
+
+  header->pages_used = 0;
+  header->num_items = 0;
+  header->bytes_used = 0;
+}
+
+
+
+bool SharedMemoryCache::lock(){
+  int status = pthread_mutex_lock( &header->mutex );
+#ifdef HAVE_ROBUST_MUTEX
+  // The previous owner died with the lock held, so our structures may be
+  // inconsistent: simply start again with an empty cache
+  if( status == EOWNERDEAD ){
+    this->reset();
+    if( pthread_mutex_consistent( &header->mutex ) == 0 ) return true;
+    pthread_mutex_unlock( &header->mutex );
+    return false;
+  }
+#endif
+  // Any other failure, such as a lock that can no longer be recovered, leaves us
+  // without the lock, so the cache is simply bypassed
+  return ( status == 0 );
+}
+
+
+
+void SharedMemoryCache::unlock(){
+  pthread_mutex_unlock( &header->mutex );
+}
+
+
+
+uint64_t* SharedMemoryCache::buckets(){
+  return (uint64_t*)( base + header->buckets );
+}
+
+
+
+uint64_t SharedMemoryCache::hash( const string& key ){
+  // 64 bit FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for( size_t i=0; i<key.length(); i++ ){
+    h ^= (unsigned char) key[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+
+uint64_t SharedMemoryCache::find( const string& key, uint64_t h ){
+  uint64_t offset = buckets()[ h % header->num_buckets ];
+  while( offset ){
+    Item* it = item( offset );
+    if( it->hash == h && it->key_length == key.length() &&
+	memcmp( (unsigned char*)it + sizeof(Item), key.c_str(), key.length() ) == 0 ) return offset;
+    offset = it->hash_next;
+  }
+  return 0;
+}
+
+
+
+void SharedMemoryCache::touch( uint64_t offset ){
+
+  Item* it = item( offset );
+  SlabClass& sc = header->classes[ it->slab_class ];
+  if( sc.lru_head == offset ) return;
+
+  // Unlink
+  if( it->lru_prev ) item( it->lru_prev )->lru_next = it->lru_next;
+  if( it->lru_next ) item( it->lru_next )->lru_prev = it->lru_prev;
+  if( sc.lru_tail == offset ) sc.lru_tail = it->lru_prev;
+
+  // Insert at the head
+  it->lru_prev = 0;
+  it->lru_next = sc.lru_head;
+  if( sc.lru_head ) item( sc.lru_head )->lru_prev = offset;
+  sc.lru_head = offset;
+  if( !sc.lru_tail ) sc.lru_tail = offset;
+}
+
+
+
+void SharedMemoryCache::remove( uint64_t offset ){
+
+  Item* it = item( offset );
+  SlabClass& sc = header->classes[ it->slab_class ];
+
+  // Remove from the hash chain
+  uint64_t* link = &buckets()[ it->hash % header->num_buckets ];
+  while( *link && *link != offset ) link = &item( *link )->hash_next;
+  if( *link ) *link = it->hash_next;
+
+  // Remove from the LRU list
+  if( it->lru_prev ) item( it->lru_prev )->lru_next = it->lru_next;
+  else sc.lru_head = it->lru_next;
+  if( it->lru_next ) item( it->lru_next )->lru_prev = it->lru_prev;
+  else sc.lru_tail = it->lru_prev;
+
+  // Return the chunk to the free list - we use hash_next as our free list link
+  it->hash_next = sc.free_list;
+  it->slab_class = SHM_FREE_CHUNK;
+  sc.free_list = offset;
+
+  header->num_items--;
+  header->bytes_used -= sc.chunk_size;
+}
+
+
+
+void SharedMemoryCache::carve( uint64_t page, unsigned int slab_class ){
+
+  SlabClass& sc = header->classes[ slab_class ];
+  for( uint64_t c = 0; c + sc.chunk_size <= SHM_PAGE_SIZE; c += sc.chunk_size ){
+    Item* it = item( page + c );
+    it->slab_class = SHM_FREE_CHUNK;
+    it->hash_next = sc.free_list;
+    sc.free_list = page + c;
+  }
+  sc.num_pages++;
+}
+
+
+
+bool SharedMemoryCache::rebalance( unsigned int slab_class ){
+
+  // Take a page from the class holding the most pages
+  unsigned int donor = SHM_SLAB_CLASSES;
+  for( unsigned int i=0; i<SHM_SLAB_CLASSES; i++ ){
+    if( i != slab_class && header->classes[i].num_pages > 0 &&
+	( donor == SHM_SLAB_CLASSES || header->classes[i].num_pages > header->classes[donor].num_pages ) ) donor = i;
+  }
+  if( donor == SHM_SLAB_CLASSES ) return false;
+
+  // Use the page holding its least recently used tile, or one of its free chunks if it has no tiles
+  SlabClass& dc = header->classes[ donor ];
+  uint64_t chunk = dc.lru_tail ? dc.lru_tail : dc.free_list;
+  if( !chunk ) return false;
+  uint64_t page = header->pages + ( chunk - header->pages ) / SHM_PAGE_SIZE * SHM_PAGE_SIZE;
+
+  // Evict every tile in the page and unlink its chunks from the donor's free list
+  for( uint64_t c = 0; c + dc.chunk_size <= SHM_PAGE_SIZE; c += dc.chunk_size ){
+    if( item( page + c )->slab_class != SHM_FREE_CHUNK ) this->remove( page + c );
+  }
+  uint64_t* link = &dc.free_list;
+  while( *link ){
+    if( *link >= page && *link < page + SHM_PAGE_SIZE ) *link = item( *link )->hash_next;
+    else link = &item( *link )->hash_next;
+  }
+  dc.num_pages--;
+
+  this->carve( page, slab_class );
+  return true;
+}
+
+
+
+uint64_t SharedMemoryCache::allocate( unsigned int slab_class ){
+
+  SlabClass& sc = header->classes[ slab_class ];
+
+  // Carve a new page into chunks if we have no free chunks and pages remain
+  if( !sc.free_list && header->pages_used < header->num_pages ){
+    this->carve( header->pages + header->pages_used * SHM_PAGE_SIZE, slab_class );
+    header->pages_used++;
+  }
+
+  // Otherwise evict the least recently used tile of this class or, if this class
+  // has no tiles to evict, move a page over from the class holding the most pages
+  if( !sc.free_list && sc.lru_tail ) this->remove( sc.lru_tail );
+  if( !sc.free_list ) this->rebalance( slab_class );
+
+  if( !sc.free_list ) return 0;
+
+  uint64_t offset = sc.free_list;
+  sc.free_list = item( offset )->hash_next;
+  return offset;
+}
+
+
+
+void SharedMemoryCache::insert( const RawTile& r, unsigned long, bool bulk ){
+
+  if( !base || bulk ) return;
+
+  string key = getIndex( r.filename, r.resolution, r.tileNum,
+			 r.hSequence, r.vSequence, r.compressionType, r.quality );
+
+  // Find the smallest slab class large enough for this tile
+  uint64_t needed = sizeof(Item) + key.length() + r.dataLength;
+  unsigned int slab_class = 0;
+  while( slab_class < SHM_SLAB_CLASSES && header->classes[slab_class].chunk_size < needed ) slab_class++;
+  if( slab_class == SHM_SLAB_CLASSES || !r.data ) return;
+
+  uint64_t h = hash( key );
+
+  if( !this->lock() ) return;
+
+  // If this tile already exists and is up to date, simply touch it
+  uint64_t offset = this->find( key, h );
+  if( offset ){
+    if( item( offset )->timestamp >= (int64_t) r.timestamp ){
+      this->touch( offset );
+      this->unlock();
+      return;
+    }
+    this->remove( offset );
+  }
+
+  offset = this->allocate( slab_class );
+  if( !offset ){
+    this->unlock();
+    return;
+  }
+
+  Item* it = item( offset );
+  it->hash = h;
+  it->slab_class = slab_class;
+  it->key_length = key.length();
+  it->data_length = r.dataLength;
+  it->tileNum = r.tileNum;
+  it->resolution = r.resolution;
+  it->hSequence = r.hSequence;
+  it->vSequence = r.vSequence;
+  it->compressionType = r.compressionType;
+  it->quality = r.quality;
+  it->encodedQuality = r.encodedQuality;
+  it->width = r.width;
+  it->height = r.height;
+  it->channels = r.channels;
+  it->bpc = r.bpc;
+  it->sampleType = r.sampleType;
+  it->padded = r.padded;
+  it->timestamp = r.timestamp;
+
+  unsigned char* ptr = (unsigned char*)it + sizeof(Item);
+  memcpy( ptr, key.c_str(), key.length() );
+  memcpy( ptr + key.length(), r.data, r.dataLength );
+
+  // Link into our index and at the head of the LRU list
+  uint64_t& bucket = buckets()[ h % header->num_buckets ];
+  it->hash_next = bucket;
+  bucket = offset;
+
+  SlabClass& sc = header->classes[ slab_class ];
+  it->lru_prev = 0;
+  it->lru_next = sc.lru_head;
+  if( sc.lru_head ) item( sc.lru_head )->lru_prev = offset;
+  sc.lru_head = offset;
+  if( !sc.lru_tail ) sc.lru_tail = offset;
+
+  header->num_items++;
+  header->bytes_used += sc.chunk_size;
+
+  this->unlock();
+}
+
+
+
+bool SharedMemoryCache::getTile( const string& f, int r, int t, int h, int v, CompressionType c, int q, RawTile& tile ){
+
+  if( !base ) return false;
+
+  string key = getIndex( f, r, t, h, v, c, q );
+  uint64_t hv = hash( key );
+
+  if( !this->lock() ) return false;
+
+  uint64_t offset = this->find( key, hv );
+  if( !offset ){
+    this->unlock();
+    return false;
+  }
+
+  this->touch( offset );
+
+  Item* it = item( offset );
+
+  RawTile cached( it->tileNum, it->resolution, it->hSequence, it->vSequence,
+		  it->width, it->height, it->channels, it->bpc );
+  cached.compressionType = (CompressionType) it->compressionType;
+  cached.quality = it->quality;
+  cached.encodedQuality = it->encodedQuality;
+  cached.filename = f;
+  cached.timestamp = it->timestamp;
+  cached.sampleType = (SampleType) it->sampleType;
+  cached.padded = it->padded;
+
+  // Point at the data in the segment - the assignment below makes a private copy
+  cached.dataLength = it->data_length;
+  cached.data = (unsigned char*)it + sizeof(Item) + it->key_length;
+  cached.memoryManaged = 0;
+
+  tile = cached;
+  cached.data = NULL;
+
+  this->unlock();
+
+  return true;
+}
+
+
+
+unsigned int SharedMemoryCache::getNumElements(){
+  if( !base || !this->lock() ) return 0;
+  unsigned int n = header->num_items;
+  this->unlock();
+  return n;
+}
+
+
+
+float SharedMemoryCache::getMemorySize(){
+  if( !base || !this->lock() ) return 0;
+  float s = (float)( header->bytes_used / 1024000.0 );
+  this->unlock();
+  return s;
+}
+
+
+
+string SharedMemoryCache::getDescription(){
+  stringstream description;
+  description << "shared memory segment '" << name << "' of "
+	      << (size / 1024000.0) << "MB";
+  return description.str();
+}
@@ -0,0 +1,178 @@
+// Shared Memory Tile Cache Class
+
+/*  IIP Image Server
+
+    Copyright (C) 2020 KML Vision GmbH.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _SHAREDMEMORYCACHE_H
+#define _SHAREDMEMORYCACHE_H
+
+
+#include <string>
+#include <stdint.h>
+#include "TileCache.h"
+
+
+
+/// Number of slab size classes: chunks from 1KB up to the page size in powers of two
+#define SHM_SLAB_CLASSES 11
+
+/// Size of the pages handed out to slab classes and carved into chunks
+#define SHM_PAGE_SIZE 1048576
+
+
+
+/// Tile cache living in a POSIX shared memory segment, so that several
+/// iipsrv processes on the same node share the tiles any of them decodes.
+/**
+ *  The segment holds a header with a process-shared robust mutex, a fixed
+ *  array of hash buckets and a pool of pages. Pages are assigned on demand
+ *  to slab classes of power-of-two chunk sizes. Each chunk holds one tile:
+ *  its hash chain and LRU links, the tile metadata, the full cache index
+ *  (to verify hash matches) and the tile data. When a slab class runs out
+ *  of chunks and no free pages are left, the least recently used tile of
+ *  that class is evicted. A class without any tiles to evict instead takes
+ *  over the page holding the least recently used tile of the class with the
+ *  most pages, so that pages are never permanently tied to one class. The
+ *  segment is sized and initialised under a lock on the shared memory object,
+ *  so a segment left half set up by a process that died is initialised by
+ *  the next. Tiles larger than a page are not cached.
+ */
+
+class SharedMemoryCache : public TileCache {
+
+ private:
+
+  /// Segment header - defined in SharedMemoryCache.cc
+  struct Header;
+
+  /// Chunk header - defined in SharedMemoryCache.cc
+  struct Item;
+
+  /// Name of our shared memory object
+  std::string name;
+
+  /// Start of our mapped segment
+  unsigned char* base;
+
+  /// Size of our mapped segment in bytes
+  size_t size;
+
+  /// Segment header
+  Header* header;
+
+
+  /// Initialise the segment layout - called with the lock on the shared memory object held
+  void initialise();
+
+  /// Clear all tiles and page assignments - called with the lock held
+  void reset();
+
+  /// Lock the segment, recovering if another process died while holding the lock
+  /** @return whether the lock was acquired */
+  bool lock();
+
+  /// Unlock the segment
+  void unlock();
+
+  /// Convert an offset into an item pointer
+  Item* item( uint64_t offset ) { return (Item*)( base + offset ); }
+
+  /// Return the bucket array
+  uint64_t* buckets();
+
+  /// Hash function for our cache index
+  static uint64_t hash( const std::string& key );
+
+  /// Find an item in the index
+  /** @return offset of item or 0 if not found */
+  uint64_t find( const std::string& key, uint64_t h );
+
+  /// Move an item to the head of its slab class LRU list
+  void touch( uint64_t offset );
+
+  /// Remove an item from the index and LRU list and return its chunk to the free list
+  void remove( uint64_t offset );
+
+  /// Carve a page into free chunks of a slab class
+  /** @param page offset of page
+      @param slab_class slab class
+   */
+  void carve( uint64_t page, unsigned int slab_class );
+
+  /// Move the page holding the least recently used tile of the slab class with the most pages to another class
+  /** Tiles in the page are evicted
+      @param slab_class slab class to receive the page
+      @return whether a page was moved
+   */
+  bool rebalance( unsigned int slab_class );
+
+  /// Allocate a chunk from a slab class
+  /** @return offset of chunk or 0 if nothing could be allocated */
+  uint64_t allocate( unsigned int slab_class );
+
+
+ public:
+
+  /// Constructor
+  /** Create or attach to a named shared memory segment
+      @param name name of the shared memory object (e.g. /iipsrv)
+      @param max size of the segment in MB - ignored if the segment already exists
+   */
+  SharedMemoryCache( const std::string& name, float max );
+
+  /// Destructor - unmaps the segment, which persists for other processes
+  ~SharedMemoryCache();
+
+  /// Insert a tile
+  /** Eviction is always least recently used within a slab class, so the cost is ignored.
+      Tiles from bulk reads are not stored.
+      @param r Tile to be inserted
+      @param cost time taken to generate the tile in microseconds
+      @param bulk whether the tile is part of a bulk read
+   */
+  void insert( const RawTile& r, unsigned long cost = 0, bool bulk = false );
+
+  /// Get a tile from the cache
+  /**
+   *  @param f filename
+   *  @param r resolution number
+   *  @param t tile number
+   *  @param h horizontal sequence number
+   *  @param v vertical sequence number
+   *  @param c compression type
+   *  @param q compression quality
+   *  @param tile RawTile to copy the cached tile into
+   *  @return true if the tile was found
+   */
+  bool getTile( const std::string& f, int r, int t, int h, int v, CompressionType c, int q, RawTile& tile );
+
+  /// Return the number of tiles in the cache
+  unsigned int getNumElements();
+
+  /// Return the number of MB stored
+  float getMemorySize();
+
+  /// Return a description of the cache backend
+  std::string getDescription();
+
+};
+
+
+#endif
@@ -23,11 +23,158 @@
 
 #include "TPTImage.h"
 #include <sstream>
+#include <cstring>
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_VFS_H
+#include <sys/vfs.h>
+#endif
+#define TPT_MMAP
+#endif
 
 
 using namespace std;
 
 
+
+/// A TIFF file mapped into memory, which libtiff reads through our client procedures
+struct TPTImage::MappedFile {
+  unsigned char* base;
+  toff_t size;
+  toff_t offset;   ///< current read position
+  int fd;          ///< kept open to check whether the file changes under the mapping
+  time_t mtime;    ///< modification time of the file when mapped
+};
+
+
+#ifdef TPT_MMAP
+
+/// libtiff client procedures reading from a MappedFile
+static tsize_t mappedRead( thandle_t h, tdata_t buf, tsize_t size )
+{
+  TPTImage::MappedFile* m = (TPTImage::MappedFile*) h;
+  if( size < 0 || m->offset >= m->size ) return 0;
+  if( (toff_t) size > m->size - m->offset ) size = (tsize_t)( m->size - m->offset );
+  memcpy( buf, m->base + m->offset, size );
+  m->offset += size;
+  return size;
+}
+
+static tsize_t mappedWrite( thandle_t, tdata_t, tsize_t ){ return -1; }
+
+static toff_t mappedSeek( thandle_t h, toff_t off, int whence )
+{
+  TPTImage::MappedFile* m = (TPTImage::MappedFile*) h;
+  if( whence == SEEK_CUR ) off += m->offset;
+  else if( whence == SEEK_END ) off += m->size;
+  m->offset = off;
+  return off;
+}
+
+// The mapping is released by TPTImage once the TIFF is closed
+static int mappedClose( thandle_t ){ return 0; }
+
+static toff_t mappedSize( thandle_t h ){ return ((TPTImage::MappedFile*) h)->size; }
+
+static int mappedMap( thandle_t h, tdata_t* base, toff_t* size )
+{
+  TPTImage::MappedFile* m = (TPTImage::MappedFile*) h;
+  *base = m->base;
+  *size = m->size;
+  return 1;
+}
+
+static void mappedUnmap( thandle_t, tdata_t, toff_t ){}
+
+
+/// Whether a file is on a network filesystem, where a mapping can fault if the file changes
+static bool networkFilesystem( int fd )
+{
+#ifdef HAVE_SYS_VFS_H
+  struct statfs fs;
+  if( fstatfs( fd, &fs ) != 0 ) return true;
+  switch( (unsigned long) fs.f_type ){
+    case 0x6969:        // NFS
+    case 0x517B:        // SMB
+    case 0xFF534D42:    // CIFS
+    case 0xFE534D42:    // SMB2
+    case 0x00C36400:    // Ceph
+    case 0x5346414F:    // AFS
+    case 0x01021997:    // 9P
+    case 0x65735546:    // FUSE
+      return true;
+    default:
+      return false;
+  }
+#else
+  return false;
+#endif
+}
+
+#endif
+
+
+
+/// Estimate the quality with which a JPEG stream was encoded
+/** Compares the stream's first luminance quantization table with the standard
+    table which libjpeg scales according to the quality factor
+    @param data JPEG stream
+    @param length length of stream in bytes
+    @return quality factor (1-100) or 0 if no quantization table was found
+ */
+static int estimateJPEGQuality( const unsigned char* data, size_t length )
+{
+  static const unsigned int luminance[64] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+  };
+
+  // Walk through the marker segments up to the start of the scan
+  size_t i = 2;
+  while( i + 4 <= length && data[i] == 0xFF && data[i+1] != 0xDA && data[i+1] != 0xD9 ){
+
+    size_t end = i + 2 + ( (data[i+2] << 8) | data[i+3] );
+    if( end > length ) break;
+
+    // A DQT segment can hold several tables of 8 or 16 bit values
+    if( data[i+1] == 0xDB ){
+      size_t j = i + 4;
+      while( j < end ){
+	bool wide = data[j] >> 4;
+	unsigned int n = wide ? 128 : 64;
+	if( j + 1 + n > end ) break;
+	if( (data[j] & 0x0F) == 0 ){
+	  double sum = 0, standard = 0;
+	  for( unsigned int k=0; k<64; k++ ){
+	    sum += wide ? ( (data[j+1+2*k] << 8) | data[j+2+2*k] ) : data[j+1+k];
+	    standard += luminance[k];
+	  }
+	  // libjpeg scales the standard table by 5000/quality below a quality of 50
+	  // and by 200-2*quality above
+	  double scale = 100.0 * sum / standard;
+	  int quality = (int)( ( scale <= 100.0 ) ? ( 200.0 - scale ) / 2.0 + 0.5 : 5000.0 / scale + 0.5 );
+	  return ( quality < 1 ) ? 1 : ( quality > 100 ) ? 100 : quality;
+	}
+	j += 1 + n;
+      }
+    }
+    i = end;
+  }
+
+  return 0;
+}
+
+
 void TPTImage::openImage()
 {
 
@@ -42,9 +189,7 @@ void TPTImage::openImage()
   updateTimestamp( filename );
 
   // Try to open and allocate a buffer
-  if( ( tiff = TIFFOpen( filename.c_str(), "rm" ) ) == NULL ){
-    throw file_error( "tiff open failed for: " + filename );
-  }
+  openTIFF( filename );
 
   // Load our metadata if not already loaded
   if( bpc == 0 ) loadImageInfo( currentX, currentY );
@@ -92,15 +237,19 @@ void TPTImage::loadImageInfo( int seq, int ang )
   current_dir = TIFFCurrentDirectory( tiff );
   TIFFSetDirectory( tiff, 0 );
 
-  // Store the list of image dimensions available
+  // Store the list of image dimensions available and the offsets of their directories,
+  // so that we can later change resolution without walking the chain of directories
+  directory_offsets.clear();
   image_widths.push_back( w );
   image_heights.push_back( h );
+  directory_offsets.push_back( TIFFCurrentDirOffset( tiff ) );
 
   for( count = 0; TIFFReadDirectory( tiff ); count++ ){
     TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &w );
     TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &h );
     image_widths.push_back( w );
     image_heights.push_back( h );
+    directory_offsets.push_back( TIFFCurrentDirOffset( tiff ) );
   }
   // Reset the TIFF directory
   TIFFSetDirectory( tiff, current_dir );
@@ -174,12 +323,111 @@ void TPTImage::loadImageInfo( int seq, int ang )
 }
 
 
+void TPTImage::openTIFF( const string& filename, bool map )
+{
+#ifdef TPT_MMAP
+  // Map the whole file once, unless it is on a network filesystem or cannot be mapped,
+  // in which case we fall back to reading it
+  if( tiff_mmap && map ){
+    int fd = open( filename.c_str(), O_RDONLY );
+    if( fd != -1 ){
+      struct stat st;
+      void* base = MAP_FAILED;
+      if( fstat( fd, &st ) == 0 && st.st_size > 0 && !networkFilesystem( fd ) ){
+	base = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+      }
+      if( base == MAP_FAILED ) close( fd );
+      else{
+	mapped = new MappedFile;
+	mapped->base = (unsigned char*) base;
+	mapped->size = st.st_size;
+	mapped->offset = 0;
+	mapped->fd = fd;
+	mapped->mtime = st.st_mtime;
+#ifdef HAVE_MADVISE
+	// Tiles are read at random, so avoid reading ahead pages we may never need
+	madvise( base, st.st_size, MADV_RANDOM );
+#endif
+	tiff = TIFFClientOpen( filename.c_str(), "r", (thandle_t) mapped, mappedRead, mappedWrite,
+			       mappedSeek, mappedClose, mappedSize, mappedMap, mappedUnmap );
+	if( !tiff ) unmapFile();
+      }
+    }
+  }
+  if( !tiff )
+#endif
+  tiff = TIFFOpen( filename.c_str(), "rm" );
+
+  if( tiff == NULL ){
+    throw file_error( "tiff open failed for: " + filename );
+  }
+}
+
+
+void TPTImage::unmapFile()
+{
+#ifdef TPT_MMAP
+  if( mapped ){
+    munmap( mapped->base, mapped->size );
+    close( mapped->fd );
+    delete mapped;
+    mapped = NULL;
+  }
+#endif
+}
+
+
+bool TPTImage::mappingChanged()
+{
+#ifdef TPT_MMAP
+  if( !mapped ) return false;
+  struct stat st;
+  if( fstat( mapped->fd, &st ) != 0 ) return true;
+  return ( (toff_t) st.st_size != mapped->size || st.st_mtime != mapped->mtime );
+#else
+  return false;
+#endif
+}
+
+
+void TPTImage::prefetchTiles( int seq, int ang, unsigned int res, const vector<unsigned int>& tiles )
+{
+#if defined(TPT_MMAP) && defined(HAVE_MADVISE)
+  if( !tiff_mmap || tiles.empty() ) return;
+
+  // Any error here is raised again when the tiles themselves are read
+  try{
+    setDirectory( seq, ang, res, tiles[0] );
+  }
+  catch( ... ){
+    return;
+  }
+
+  toff_t *offsets = NULL, *bytecounts = NULL;
+  if( !mapped ) return;
+  if( !TIFFGetField( tiff, TIFFTAG_TILEOFFSETS, &offsets ) ||
+      !TIFFGetField( tiff, TIFFTAG_TILEBYTECOUNTS, &bytecounts ) ) return;
+
+  // madvise() requires a page aligned address
+  static const toff_t page = sysconf( _SC_PAGESIZE );
+  const unsigned int ntiles = TIFFNumberOfTiles( tiff );
+
+  for( vector<unsigned int>::const_iterator t = tiles.begin(); t != tiles.end(); ++t ){
+    if( *t >= ntiles || offsets[*t] >= mapped->size || bytecounts[*t] > mapped->size - offsets[*t] ) continue;
+    toff_t start = offsets[*t] - ( offsets[*t] % page );
+    madvise( mapped->base + start, offsets[*t] + bytecounts[*t] - start, MADV_WILLNEED );
+  }
+#endif
+}
+
+
 void TPTImage::closeImage()
 {
   if( tiff != NULL ){
     TIFFClose( tiff );
     tiff = NULL;
   }
+  unmapFile();
   if( tile_buf != NULL ){
     _TIFFfree( tile_buf );
     tile_buf = NULL;
@@ -187,11 +435,8 @@ void TPTImage::closeImage()
 }
 
 
-RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsigned int tile )
+void TPTImage::setDirectory( int seq, int ang, unsigned int res, unsigned int tile )
 {
-  uint32 im_width, im_height, tw, th, ntlx, ntly;
-  uint32 rem_x, rem_y;
-  uint16 colour;
   string filename;
 
 
@@ -213,10 +458,24 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
   // Open the TIFF if it's not already open
   if( !tiff ){
     filename = getFileName( seq, ang );
-    if( ( tiff = TIFFOpen( filename.c_str(), "rm" ) ) == NULL ){
-      throw file_error( "tiff open failed for:" + filename );
-    }
+    openTIFF( filename );
+  }
+
+#ifdef TPT_MMAP
+  // Accessing a mapping of a file that has since been truncated or rewritten in place
+  // raises SIGBUS, so reopen such a file to be read with read() instead. Its tiles
+  // now carry the new modification time, so that older cached tiles are not used
+  else if( mappingChanged() ){
+    closeImage();
+    filename = getFileName( seq, ang );
+    openTIFF( filename, false );
+    struct stat st;
+    if( fstat( TIFFFileno( tiff ), &st ) == 0 ) timestamp = st.st_mtime;
+    image_widths.clear(); image_heights.clear();
+    min.clear(); max.clear();
+    loadImageInfo( seq, ang );
   }
+#endif
 
 
   // Reload our image information in case the tile size etc is different
@@ -231,8 +490,15 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
   int vipsres = ( numResolutions - 1 ) - res;
 
 
-  // Change to the right directory for the resolution
-  if( !TIFFSetDirectory( tiff, vipsres ) ) {
+  // Change to the right directory for the resolution. If we know its offset, go there directly
+  // rather than walking the chain of directories, and only if we are not there already
+  if( (unsigned int) vipsres < directory_offsets.size() ){
+    toff_t offset = (toff_t) directory_offsets[vipsres];
+    if( TIFFCurrentDirOffset( tiff ) != offset && !TIFFSetSubDirectory( tiff, offset ) ){
+      throw file_error( "TIFFSetSubDirectory failed" );
+    }
+  }
+  else if( !TIFFSetDirectory( tiff, vipsres ) ) {
     throw file_error( "TIFFSetDirectory failed" );
   }
 
@@ -244,6 +510,19 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
     throw file_error( tile_no.str() );
   }
 
+}
+
+
+RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsigned int tile )
+{
+  uint32 im_width, im_height, tw, th, ntlx, ntly;
+  uint32 rem_x, rem_y;
+  uint16 colour;
+
+
+  // Open the image and change to the directory of our resolution
+  setDirectory( seq, ang, res, tile );
+
 
   // Get the size of this tile, the current image,
   //  the number of samples and the colourspace.
@@ -365,3 +644,87 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
 
 }
 
+
+
+bool TPTImage::getJPEGTile( int seq, int ang, unsigned int res, unsigned int tile, RawTile& rawtile )
+{
+  uint32 im_width, im_height, tw, th, ntlx;
+  uint32 count = 0;
+  uint16 compression = COMPRESSION_NONE, photometric = 0, planar = PLANARCONFIG_CONTIG;
+  toff_t* bytecounts = NULL;
+  unsigned char* tables = NULL;
+
+
+  // Only 8 bit greyscale and YCbCr streams can be decoded without the TIFF tags.
+  // Palette images are declared as 3 channel sRGB, but are excluded by their photometric tag
+  if( bpc != 8 || !( channels == 1 || channels == 3 ) ) return false;
+
+
+  // Open the image and change to the directory of our resolution
+  setDirectory( seq, ang, res, tile );
+
+  TIFFGetField( tiff, TIFFTAG_COMPRESSION, &compression );
+  TIFFGetField( tiff, TIFFTAG_PHOTOMETRIC, &photometric );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_PLANARCONFIG, &planar );
+
+  if( compression != COMPRESSION_JPEG || planar != PLANARCONFIG_CONTIG ) return false;
+  if( !( ( channels == 1 && photometric == PHOTOMETRIC_MINISBLACK ) ||
+	 ( channels == 3 && photometric == PHOTOMETRIC_YCBCR ) ) ) return false;
+
+
+  // Edge tiles are stored padded to the full tile size and need to be cropped
+  TIFFGetField( tiff, TIFFTAG_TILEWIDTH, &tw );
+  TIFFGetField( tiff, TIFFTAG_TILELENGTH, &th );
+  TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &im_width );
+  TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &im_height );
+  ntlx = ( im_width + tw - 1 ) / tw;
+  if( ( (tile % ntlx) + 1 ) * tw > im_width || ( (tile / ntlx) + 1 ) * th > im_height ) return false;
+
+  if( !TIFFGetField( tiff, TIFFTAG_TILEBYTECOUNTS, &bytecounts ) || bytecounts[tile] < 4 ) return false;
+  tsize_t size = (tsize_t) bytecounts[tile];
+
+
+  // Tiles usually share their quantization and Huffman tables, which are stored
+  // once as an abbreviated stream of tables only, ending with an EOI marker
+  if( !TIFFGetField( tiff, TIFFTAG_JPEGTABLES, &count, &tables ) || count < 4 ||
+      tables[count-2] != 0xFF || tables[count-1] != 0xD9 ){
+    tables = NULL;
+    count = 0;
+  }
+
+  // The tables without their EOI marker are followed by the tile's stream
+  // without its SOI marker, which the end of the tables overwrites
+  size_t offset = tables ? count - 4 : 0;
+  unsigned char* buffer = new unsigned char[offset + size];
+
+  tsize_t length = TIFFReadRawTile( tiff, (ttile_t) tile, buffer + offset, size );
+  if( length < 4 || buffer[offset] != 0xFF || buffer[offset+1] != 0xD8 ){
+    delete[] buffer;
+    if( length == -1 ) throw file_error( "TIFFReadRawTile failed for " + getFileName( seq, ang ) );
+    return false;
+  }
+  if( tables ) memcpy( buffer, tables, count - 2 );
+
+
+  rawtile.deallocate();
+  rawtile.tileNum = tile;
+  rawtile.resolution = res;
+  rawtile.hSequence = seq;
+  rawtile.vSequence = ang;
+  rawtile.width = tw;
+  rawtile.height = th;
+  rawtile.channels = channels;
+  rawtile.bpc = 8;
+  rawtile.sampleType = FIXEDPOINT;
+  rawtile.data = buffer;
+  rawtile.dataLength = offset + length;
+  rawtile.memoryManaged = 1;
+  rawtile.padded = false;
+  rawtile.compressionType = JPEG;
+  rawtile.quality = estimateJPEGQuality( buffer, rawtile.dataLength );
+  rawtile.filename = getImagePath();
+  rawtile.timestamp = timestamp;
+
+  return true;
+
+}
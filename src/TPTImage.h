@@ -34,6 +34,11 @@
 /// Image class for Tiled Pyramidal Images: Inherits from IIPImage. Uses libtiff
 class TPTImage : public IIPImage {
 
+ public:
+
+  /// A file mapped into memory, which libtiff reads through our own procedures - defined in TPTImage.cc
+  struct MappedFile;
+
  private:
 
   /// Pointer to the TIFF library struct
@@ -42,21 +47,50 @@ class TPTImage : public IIPImage {
   /// Tile data buffer pointer
   tdata_t tile_buf;
 
+  /// Our memory mapped file or NULL if the file is read with read()
+  MappedFile *mapped;
+
+  /// Open our TIFF, mapping it into memory if requested and possible
+  /** @param filename file to open
+      @param map whether the file may be mapped - otherwise it is read with read()
+   */
+  void openTIFF( const std::string& filename, bool map = true );
+
+  /// Unmap our file after the TIFF has been closed
+  void unmapFile();
+
+  /// Whether our mapped file has been truncated or rewritten since it was mapped
+  bool mappingChanged();
+
+  /// Open the image if necessary and change to the directory of a resolution
+  /** @param x horizontal sequence angle
+      @param y vertical sequence angle
+      @param r resolution
+      @param t tile number, which must exist at this resolution
+   */
+  void setDirectory( int x, int y, unsigned int r, unsigned int t );
+
 
  public:
 
+  /// Whether to map files into memory instead of reading them with read()
+  /** Files on network filesystems are always read with read() */
+  bool tiff_mmap;
+
   /// Constructor
-  TPTImage():IIPImage(), tiff( NULL ), tile_buf( NULL ) {};
+  TPTImage():IIPImage(), tiff( NULL ), tile_buf( NULL ), mapped( NULL ), tiff_mmap( false ) {};
 
   /// Constructor
   /** @param path image path
    */
-  TPTImage( const std::string& path ): IIPImage( path ), tiff( NULL ), tile_buf( NULL ) {};
+  TPTImage( const std::string& path ): IIPImage( path ), tiff( NULL ), tile_buf( NULL ),
+    mapped( NULL ), tiff_mmap( false ) {};
 
   /// Copy Constructor
   /** @param image IIPImage object
    */
-  TPTImage( const TPTImage& image ): IIPImage( image ), tiff( NULL ),tile_buf( NULL ) {};
+  TPTImage( const TPTImage& image ): IIPImage( image ), tiff( NULL ),tile_buf( NULL ),
+    mapped( NULL ), tiff_mmap( image.tiff_mmap ) {};
 
   /// Assignment Operator
   /** @param image TPTImage object
@@ -67,6 +101,8 @@ class TPTImage : public IIPImage {
       IIPImage::operator=(image);
       tiff = image.tiff;
       tile_buf = image.tile_buf;
+      mapped = image.mapped;
+      tiff_mmap = image.tiff_mmap;
     }
     return *this;
   }
@@ -75,7 +111,7 @@ class TPTImage : public IIPImage {
   /** @param image IIPImage object
    */
   TPTImage( const IIPImage& image ): IIPImage( image ) {
-    tiff = NULL; tile_buf = NULL; 
+    tiff = NULL; tile_buf = NULL; mapped = NULL; tiff_mmap = false;
   };
 
   /// Destructor
@@ -93,6 +129,9 @@ class TPTImage : public IIPImage {
   /// Overloaded function for closing a TIFF image
   void closeImage();
 
+  /// Overloaded function returning a new, unopened TIFF decoder for this image
+  IIPImage* clone(){ return new TPTImage( *this ); };
+
   /// Overloaded function for getting a particular tile
   /** @param x horizontal sequence angle
       @param y vertical sequence angle
@@ -102,6 +141,26 @@ class TPTImage : public IIPImage {
    */
   RawTile getTile( int x, int y, unsigned int r, int l, unsigned int t );
 
+  /// Overloaded function for getting a tile in its stored JPEG encoding
+  /** Supported for complete 8 bit greyscale or YCbCr JPEG compressed tiles, whose
+      stream is combined with the shared JPEG tables of the image
+      @param x horizontal sequence angle
+      @param y vertical sequence angle
+      @param r resolution
+      @param t tile number
+      @param tile RawTile to hold the JPEG stream
+      @return whether the tile could be read as a JPEG stream
+   */
+  bool getJPEGTile( int x, int y, unsigned int r, unsigned int t, RawTile& tile );
+
+  /// Overloaded function for reading ahead the tiles of a region from a memory mapped file
+  /** @param x horizontal sequence angle
+      @param y vertical sequence angle
+      @param r resolution
+      @param tiles tile numbers of the region
+   */
+  void prefetchTiles( int x, int y, unsigned int r, const std::vector<unsigned int>& tiles );
+
 };
 
 
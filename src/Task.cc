@@ -95,6 +95,9 @@ void QLT::run( Session* session, const string& argument ){
       }
     }
 
+    // Stored JPEG tiles must be re-encoded to honour a different quality
+    if( factor != session->jpeg->getQuality() ) session->jpegPassthrough = false;
+
     session->jpeg->setQuality( factor );
   }
 
@@ -35,6 +35,9 @@
 #include "Timer.h"
 #include "Writer.h"
 #include "Cache.h"
+#include "ImageCache.h"
+#include "ImagePool.h"
+#include "TileWarmer.h"
 #include "Watermark.h"
 #include "Transforms.h"
 #ifdef HAVE_PNG
@@ -47,20 +50,6 @@
 
 
 
-#ifdef HAVE_EXT_POOL_ALLOCATOR
-#include <ext/pool_allocator.h>
-typedef HASHMAP < std::string, IIPImage,
-			      __gnu_cxx::hash< const std::string >,
-			      std::equal_to< const std::string >,
-			      __gnu_cxx::__pool_alloc< std::pair<const std::string,IIPImage> >
-			      > imageCacheMapType;
-#else
-typedef HASHMAP <std::string,IIPImage> imageCacheMapType;
-#endif
-
-
-
-
 
 
 /// Structure to hold our session data
@@ -77,12 +66,19 @@ struct Session {
   Watermark* watermark;
   Transform* processor;
   int loglevel;
-  std::ofstream* logfile;
+  std::ostream* logfile;
   std::map <const std::string, std::string> headers;
   std::map <const std::string, unsigned int> codecOptions;
 
-  imageCacheMapType *imageCache;
-  Cache* tileCache;
+  ImageCache* imageCache;
+  ImagePool* imagePool;
+  TileCache* tileCache;
+  ShardedCache* blendCache;
+  ShardedCache* channelCache;
+  unsigned int bulkRegionTiles;
+  unsigned int regionThreads;
+  bool jpegPassthrough;
+  TileWarmer* tileWarmer;
 
 #ifdef DEBUG
   FileWriter* out;
@@ -145,6 +141,7 @@ class OBJ : public Task {
   void vertical_views();
   void min_max_values();
   void resolutions();
+  void cache_stats();
   void metadata( std::string field );
 
 };
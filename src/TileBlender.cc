@@ -10,16 +10,78 @@
 #include <cstdint>
 #include <stdio.h>
 #include <sstream>
+#include <exception>
 #include <vector>
 #include <limits.h>
+#include <cctype>
 #include <jansson.h> // used for parsing json strings
 #include "Environment.h"
 #include "TileBlender.h"
+#include "BlendEngine.h"
 #include "Task.h"
 
 
 using namespace std;
 
+
+/// Whether windowing and contrast can be left to the blend engine working on the raw
+/// channel data, i.e. no other transforms have been requested
+static bool rawBlending(View *view) {
+    return !view->shaded && view->ctw.empty() && view->gamma == 1.0 && !view->inverted && !view->cmapped &&
+           view->colourspace != BINARY && !view->equalization && view->flip == 0 && view->getRotation() == 0.0;
+}
+
+
+/// Whether a channel's 8 bit preprocessed tile only depends on its window, gamma, inversion and
+/// contrast, and can therefore be cached
+static bool channelCaching(View *view) {
+    return !view->shaded && view->ctw.empty() && !view->cmapped && view->colourspace != BINARY &&
+           !view->equalization && view->flip == 0 && view->getRotation() == 0.0;
+}
+
+
+/// Cache key for all view settings that may change a blended tile
+static string viewKey(Session *session) {
+    View *view = session->view;
+    ostringstream key;
+    key.precision(9);
+    key << view->xangle << ',' << view->yangle << ',' << view->getLayers() << ','
+        << view->contrast << ',' << view->gamma << ',' << view->inverted << ','
+        << view->cmapped << ',' << view->cmap << ',' << view->shaded << ',' << view->shade[0] << ',' << view->shade[1] << ','
+        << view->colourspace << ',' << view->flip << ',' << view->getRotation() << ',' << view->equalization << ','
+        << view->embedICC();
+    for (unsigned int i = 0; i < view->ctw.size(); ++i) {
+        for (unsigned int j = 0; j < view->ctw[i].size(); ++j) key << ',' << view->ctw[i][j];
+    }
+    return key.str();
+}
+
+
+/// Resize a region using the interpolation method requested in the server configuration
+static void resizeRegion(Session *session, RawTile &region, unsigned int width, unsigned int height,
+                         std::ostream &log, const std::string &logging_prefix) {
+    Timer function_timer;
+    string interpolation_type;
+    if (session->loglevel >= 5) function_timer.start();
+
+    unsigned int interpolation = Environment::getInterpolation();
+    switch (interpolation) {
+        case 0:
+            interpolation_type = "nearest neighbour";
+            session->processor->interpolate_nearestneighbour(region, width, height);
+            break;
+        default:
+            interpolation_type = "bilinear";
+            session->processor->interpolate_bilinear(region, width, height);
+            break;
+    }
+
+    if (session->loglevel >= 5) {
+        log << logging_prefix + "Resizing using " << interpolation_type << " interpolation in "
+            << function_timer.getTime() << " microseconds" << endl;
+    }
+}
+
 bool TileBlender::loadBlendingSettingsFromJson(const char *string_to_parse,
                                                std::vector<BlendingSetting> &blending_settings) {
     json_t *j_root;
@@ -80,98 +142,125 @@ bool TileBlender::loadBlendingSettingsFromJson(const char *string_to_parse,
 }
 
 
-void TileBlender::getRawTilesAndPreprocess(Session *session, int resolution, int tile,
-                                           const std::vector<BlendingSetting> &blending_settings) {
+RawTile TileBlender::preprocessTile(Session *session, IIPImage *image, int resolution, int tile,
+                                    const BlendingSetting &setting, std::ostream &log) {
     // timer for individual functions
     Timer function_timer;
     const std::string logging_prefix("TileBlender :: Tiles :: ");
 
-    // get raw tiles and preprocess
-    for (int i = 0; i < session->images.size(); ++i) {
-        IIPImage *image = session->images[i];
+    if (image->getColourSpace() != GREYSCALE || image->channels != 1 || (image->bpc != 16 && image->bpc != 8)) {
+        throw string(logging_prefix + "only 16/8bit grayscale images supported");
+    }
 
-        if (image->getColourSpace() != GREYSCALE || image->channels != 1 || (image->bpc != 16 && image->bpc != 8)) {
-            throw string(logging_prefix + "only 16/8bit grayscale images supported");
+    // Reuse this channel's windowed tile if it has not changed since an earlier request
+    const bool cacheable = session->channelCache && channelCaching(session->view);
+    std::string channel_key;
+    if (cacheable) {
+        ostringstream key;
+        key.precision(9);
+        key << image->getImagePath() << '@' << image->timestamp << ':' << resolution << ':' << tile << ':'
+            << session->view->xangle << ':' << session->view->yangle << ':' << session->view->getLayers() << ':'
+            << setting.min << ':' << setting.max << ':' << session->view->gamma << ':' << session->view->inverted << ':'
+            << session->view->contrast;
+        channel_key = key.str();
+
+        RawTile cached;
+        if (session->channelCache->getTile(channel_key, cached)) {
+            if (session->loglevel >= 3) log << logging_prefix + "Windowed channel cache hit" << endl;
+            return cached;
         }
-        // for each image:
-        // 1. get tiles (from cache)
-        TileManager tilemanager(session->tileCache, image, session->watermark, session->jpeg, session->logfile,
-                                session->loglevel);
+    }
 
-        // First calculate histogram if we have asked for either binarization,
-        //  histogram equalization or contrast stretching
-        if (session->view->requireHistogram() && image->histogram.size() == 0) {
+    // 1. get tile (from cache)
+    TileManager tilemanager(session->tileCache, image, session->watermark, session->jpeg, &log, session->loglevel);
 
-            if (session->loglevel >= 4) function_timer.start();
+    // First calculate histogram if we have asked for either binarization,
+    //  histogram equalization or contrast stretching
+    if (session->view->requireHistogram() && image->histogram.size() == 0) {
 
-            // Retrieve an uncompressed version of our smallest tile
-            // which should be sufficient for calculating the histogram
-            RawTile thumbnail = tilemanager.getTile(0, 0, 0, session->view->yangle, session->view->getLayers(),
-                                                    UNCOMPRESSED);
+        if (session->loglevel >= 4) function_timer.start();
 
-            // Calculate histogram
-            image->histogram =
-                    session->processor->histogram(thumbnail, image->max, image->min);
+        // Retrieve an uncompressed version of our smallest tile
+        // which should be sufficient for calculating the histogram
+        RawTile thumbnail = tilemanager.getTile(0, 0, 0, session->view->yangle, session->view->getLayers(),
+                                                UNCOMPRESSED);
 
-            if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Calculated histogram in "
-                                    << function_timer.getTime() << " microseconds" << endl;
-            }
+        // Calculate histogram
+        image->histogram =
+                session->processor->histogram(thumbnail, image->max, image->min);
 
-            // Insert the histogram into our image cache
-            const string key = image->getImagePath();
-            imageCacheMapType::iterator i = session->imageCache->find(key);
-            if (i != session->imageCache->end()) (i->second).histogram = image->histogram;
-        }
-
-        CompressionType ct;
-        // Request uncompressed tile if raw pixel data is required for processing
-        if (
-                image->getNumBitsPerPixel() >= 8 ||   // image->getNumBitsPerPixel() > 8
-                image->getColourSpace() == CIELAB ||
-                image->getNumChannels() == 2 ||
-                image->getNumChannels() > 3 ||
-                (session->view->colourspace == GREYSCALE && image->getNumChannels() == 3 &&
-                 image->getNumBitsPerPixel() == 8) ||
-                session->view->floatProcessing() ||
-                session->view->equalization ||
-                session->view->getRotation() != 0.0 ||
-                session->view->flip != 0)
-            ct = UNCOMPRESSED;
-        else ct = JPEG;
-
-
-        // Embed ICC profile
-        if (session->view->embedICC() && (image->getMetadata("icc").size() > 0)) {
-            if (session->loglevel >= 3) {
-                *(session->logfile) << logging_prefix + "embedding ICC profile with size "
-                                    << image->getMetadata("icc").size() << " bytes" << endl;
-            }
-            session->jpeg->setICCProfile(image->getMetadata("icc"));
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Calculated histogram in "
+                                << function_timer.getTime() << " microseconds" << endl;
         }
 
+        // Insert the histogram into our image cache
+        const string key = image->getImagePath();
+        session->imageCache->setHistogram(key, image->histogram);
+    }
 
-        RawTile rawtile = tilemanager.getTile(resolution, tile, session->view->xangle,
-                                              session->view->yangle, session->view->getLayers(), ct);
+    CompressionType ct;
+    // Request uncompressed tile if raw pixel data is required for processing
+    if (
+            image->getNumBitsPerPixel() >= 8 ||   // image->getNumBitsPerPixel() > 8
+            image->getColourSpace() == CIELAB ||
+            image->getNumChannels() == 2 ||
+            image->getNumChannels() > 3 ||
+            (session->view->colourspace == GREYSCALE && image->getNumChannels() == 3 &&
+             image->getNumBitsPerPixel() == 8) ||
+            session->view->floatProcessing() ||
+            session->view->equalization ||
+            session->view->getRotation() != 0.0 ||
+            session->view->flip != 0)
+        ct = UNCOMPRESSED;
+    else ct = JPEG;
+
+
+    RawTile rawtile = tilemanager.getTile(resolution, tile, session->view->xangle,
+                                          session->view->yangle, session->view->getLayers(), ct);
+
+    if (rawtile.compressionType != UNCOMPRESSED) {
+        throw string(
+                logging_prefix +
+                "rawtile.compressionType -> retrieved image data already compressed, uncompressed data buffer required");
+    }
 
-        if (rawtile.compressionType != UNCOMPRESSED) {
-            throw string(
-                    logging_prefix +
-                    "rawtile.compressionType -> retrieved image data already compressed, uncompressed data buffer required");
-        }
+    // Leave windowing and contrast to the blend engine if nothing else needs to be done. If we
+    // keep windowed channels, use the engine's windowing here instead of the float pipeline
+    if (rawBlending(session->view)) {
+        if (!cacheable) return rawtile;
+
+        BlendChannel channel;
+        channel.data = rawtile.data;
+        channel.bpc = rawtile.bpc;
+        channel.min = setting.min;
+        channel.max = setting.max;
+        channel.contrast = session->view->contrast;
+        channel.single_valued = false;
+        channel.r = channel.g = channel.b = 0;
+
+        RawTile windowed(rawtile.tileNum, rawtile.resolution, rawtile.hSequence, rawtile.vSequence,
+                         rawtile.width, rawtile.height, 1, 8);
+        windowed.dataLength = rawtile.width * rawtile.height;
+        windowed.data = new uint8_t[windowed.dataLength];
+        BlendEngine::window(channel, rawtile.width, rawtile.height, static_cast<uint8_t *>(windowed.data));
+
+        session->channelCache->insert(channel_key, windowed);
+        return windowed;
+    }
 
-        // 2. preprocess each tile (min/max contrast stretching)  TODO: check all preprocessing steps if they make sense for the blending case....
-        // Only use our float pipeline if necessary
-        if (rawtile.bpc >= 8 || session->view->floatProcessing()) {
-            if (session->loglevel >= 5) {
-                function_timer.start();
-            }
+    // 2. preprocess each tile (min/max contrast stretching)  TODO: check all preprocessing steps if they make sense for the blending case....
+    // Only use our float pipeline if necessary
+    if (rawtile.bpc >= 8 || session->view->floatProcessing()) {
+        if (session->loglevel >= 5) {
+            function_timer.start();
+        }
 
-            // Make a copy of our max and min as we may change these
-            vector<float> min;
-            vector<float> max;
+        // Make a copy of our max and min as we may change these
+        vector<float> min;
+        vector<float> max;
 
-            // Change our image max and min if we have asked for a contrast stretch
+        // Change our image max and min if we have asked for a contrast stretch
 //      if (session->view->contrast == -1) {
 //
 //        // Find first non-zero bin in histogram
@@ -195,200 +284,574 @@ void TileBlender::getRawTilesAndPreprocess(Session *session, int resolution, int
 //        session->view->contrast = 1.0;
 //
 //        if (session->loglevel >= 5) {
-//          *(session->logfile) << "TileBlender :: Applying contrast stretch for image range of "
+//          log << "TileBlender :: Applying contrast stretch for image range of "
 //                              << n0 << " - " << n1 << " in "
 //                              << function_timer.getTime() << " microseconds" << endl;
 //        }
 //
 //      }
 
-            // Apply normalization and float conversion
-            // assign given min/max values for histogram stretching
-            min.push_back(blending_settings[i].min);
-            max.push_back(blending_settings[i].max);
+        // Apply normalization and float conversion
+        // assign given min/max values for histogram stretching
+        min.push_back(setting.min);
+        max.push_back(setting.max);
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Normalizing between [" << min[0] << ", " << max[0] <<
+                                "] and converting to float";
+            function_timer.start();
+        }
+        session->processor->normalize(rawtile, max, min);
+        if (session->loglevel >= 4) {
+            log << " in " << function_timer.getTime() << " microseconds" << endl;
+        }
+
+
+        // Apply hill shading if requested
+        if (session->view->shaded) {
             if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Normalizing between [" << min[0] << ", " << max[0] <<
-                                    "] and converting to float";
+                log << logging_prefix + "Applying hill-shading";
                 function_timer.start();
             }
-            session->processor->normalize(rawtile, max, min);
+            session->processor->shade(rawtile, session->view->shade[0], session->view->shade[1]);
             if (session->loglevel >= 4) {
-                *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+                log << " in " << function_timer.getTime() << " microseconds" << endl;
             }
+        }
 
 
-            // Apply hill shading if requested
-            if (session->view->shaded) {
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << logging_prefix + "Applying hill-shading";
-                    function_timer.start();
-                }
-                session->processor->shade(rawtile, session->view->shade[0], session->view->shade[1]);
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-                }
+        // Apply color twist if requested
+        if (session->view->ctw.size()) {
+            if (session->loglevel >= 4) {
+                log << logging_prefix + "Applying color twist";
+                function_timer.start();
+            }
+            session->processor->twist(rawtile, session->view->ctw);
+            if (session->loglevel >= 4) {
+                log << " in " << function_timer.getTime() << " microseconds" << endl;
             }
+        }
 
 
-            // Apply color twist if requested
-            if (session->view->ctw.size()) {
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << logging_prefix + "Applying color twist";
-                    function_timer.start();
-                }
-                session->processor->twist(rawtile, session->view->ctw);
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-                }
+        // Apply any gamma correction
+        if (session->view->gamma != 1.0) {
+            float gamma = session->view->gamma;
+            if (session->loglevel >= 4) {
+                log << logging_prefix + "Applying gamma of " << gamma;
+                function_timer.start();
             }
+            session->processor->gamma(rawtile, gamma);
+            if (session->loglevel >= 4) {
+                log << " in " << function_timer.getTime() << " microseconds" << endl;
+            }
+        }
 
 
-            // Apply any gamma correction
-            if (session->view->gamma != 1.0) {
-                float gamma = session->view->gamma;
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << logging_prefix + "Applying gamma of " << gamma;
-                    function_timer.start();
-                }
-                session->processor->gamma(rawtile, gamma);
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-                }
+        // Apply inversion if requested
+        if (session->view->inverted) {
+            if (session->loglevel >= 4) {
+                log << logging_prefix + "Applying inversion";
+                function_timer.start();
+            }
+            session->processor->inv(rawtile);
+            if (session->loglevel >= 4) {
+                log << " in " << function_timer.getTime() << " microseconds" << endl;
             }
+        }
 
 
-            // Apply inversion if requested
-            if (session->view->inverted) {
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << logging_prefix + "Applying inversion";
-                    function_timer.start();
-                }
-                session->processor->inv(rawtile);
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-                }
+        // Apply color mapping if requested
+        if (session->view->cmapped) {
+            if (session->loglevel >= 4) {
+                log << logging_prefix + "Applying color map";
+                function_timer.start();
             }
+            session->processor->cmap(rawtile, session->view->cmap);
+            if (session->loglevel >= 4) {
+                log << " in " << function_timer.getTime() << " microseconds" << endl;
+            }
+        }
+
+
+        // Apply any contrast adjustments and/or clip to 8bit from 16 or 32 bit
+        float contrast = session->view->contrast;
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Applying contrast of " << contrast
+                                << " and converting to 8 bit";
+            function_timer.start();
+        }
+        session->processor->contrast(rawtile, contrast);
+        if (session->loglevel >= 4) {
+            log << " in " << function_timer.getTime() << " microseconds" << endl;
+        }
+    }
+    // end tile float processing
+    // start tile processing
+
+    // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image
+    if (rawtile.channels == 2 || rawtile.channels > 3) {
+        unsigned int bands = (rawtile.channels == 2) ? 1 : 3;
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Flattening channels to " << bands;
+            function_timer.start();
+        }
+        session->processor->flatten(rawtile, bands);
+        if (session->loglevel >= 4) {
+            log << " in " << function_timer.getTime() << " microseconds" << endl;
+        }
+    }
 
 
-            // Apply color mapping if requested
-            if (session->view->cmapped) {
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << logging_prefix + "Applying color map";
-                    function_timer.start();
-                }
-                session->processor->cmap(rawtile, session->view->cmap);
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-                }
+    // Convert to greyscale if requested
+    if ((*session->image)->getColourSpace() == sRGB && session->view->colourspace == GREYSCALE) {
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Converting to greyscale";
+            function_timer.start();
+        }
+        session->processor->greyscale(rawtile);
+        if (session->loglevel >= 4) {
+            log << " in " << function_timer.getTime() << " microseconds" << endl;
+        }
+    }
+
+
+    // Convert to binary (bi-level) if requested
+    if (session->view->colourspace == BINARY) {
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Converting to binary with threshold ";
+            function_timer.start();
+        }
+        unsigned int threshold = session->processor->threshold(image->histogram);
+        session->processor->binary(rawtile, threshold);
+        if (session->loglevel >= 4) {
+            log << threshold << " in " << function_timer.getTime() << " microseconds" << endl;
+        }
+    }
+
+
+    // Apply histogram equalization
+    if (session->view->equalization) {
+        if (session->loglevel >= 4) function_timer.start();
+        // Perform histogram equalization
+        session->processor->equalize(rawtile, image->histogram);
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Applying histogram equalization in "
+                                << function_timer.getTime() << " microseconds" << endl;
+        }
+    }
+
+    // Apply flip
+    if (session->view->flip != 0) {
+        Timer flip_timer;
+        if (session->loglevel >= 5) {
+            flip_timer.start();
+        }
+
+        session->processor->flip(rawtile, session->view->flip);
+
+        if (session->loglevel >= 5) {
+            log << logging_prefix + "Flipping tile ";
+            if (session->view->flip == 1) log << "horizontally";
+            else log << "vertically";
+            log << " in " << flip_timer.getTime() << " microseconds" << endl;
+        }
+    }
+
+    // Apply rotation - can apply this safely after gamma and contrast adjustment
+    if (session->view->getRotation() != 0.0) {
+        float rotation = session->view->getRotation();
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Rotating tile by " << rotation << " degrees";
+            function_timer.start();
+        }
+        session->processor->rotate(rawtile, rotation);
+        if (session->loglevel >= 4) {
+            log << " in " << function_timer.getTime() << " microseconds" << endl;
+        }
+    }
+
+    if (cacheable) session->channelCache->insert(channel_key, rawtile);
+
+    return rawtile;
+}
+
+
+std::string TileBlender::blendKey(Session *session, int resolution, int tile,
+                                  const std::vector<BlendingSetting> &blending_settings) {
+    // Channels are independent of their order, so sort them into a canonical form
+    std::vector<std::string> channels;
+    for (int i = 0; i < session->images.size(); ++i) {
+        std::string lut = blending_settings[i].lut;
+        std::transform(lut.begin(), lut.end(), lut.begin(), ::toupper);
+        ostringstream channel;
+        channel << session->images[i]->getImagePath() << '@' << session->images[i]->timestamp << ':'
+                << lut << ':' << blending_settings[i].min << ':' << blending_settings[i].max;
+        channels.push_back(channel.str());
+    }
+    std::sort(channels.begin(), channels.end());
+
+    ostringstream key;
+    for (unsigned int i = 0; i < channels.size(); ++i) key << channels[i] << '|';
+    key << resolution << ':' << tile << '|' << viewKey(session) << '|' << session->jpeg->getQuality();
+    return key.str();
+}
+
+
+void TileBlender::getRawTilesAndPreprocess(Session *session, int resolution, int tile,
+                                           const std::vector<BlendingSetting> &blending_settings) {
+    const std::string logging_prefix("TileBlender :: Tiles :: ");
+
+    // Set up any ICC profile first as all channels share our JPEG compressor
+    for (int i = 0; i < session->images.size(); ++i) {
+        IIPImage *image = session->images[i];
+        if (session->view->embedICC() && (image->getMetadata("icc").size() > 0)) {
+            if (session->loglevel >= 3) {
+                *(session->logfile) << logging_prefix + "Embedding ICC profile with size "
+                                    << image->getMetadata("icc").size() << " bytes" << endl;
             }
+            session->jpeg->setICCProfile(image->getMetadata("icc"));
+        }
+    }
+
+    // Fetch, decode and preprocess each channel concurrently. Every channel has its own
+    // TileManager and log buffer, and any error is rethrown once all channels have finished
+    int n = session->images.size();
+    unsigned int offset = this->raw_tiles.size();
+    this->raw_tiles.resize(offset + n);
+    std::vector<std::string> logs(n);
+    std::exception_ptr error;
+
+    // Keep to this worker's share of the cores
+    int threads = std::max(1, std::min(n, (int) session->regionThreads));
+
+#if defined(_OPENMP)
+#pragma omp parallel for schedule(dynamic, 1) num_threads(threads) if (threads > 1)
+#endif
+    for (int i = 0; i < n; ++i) {
+        std::ostringstream log;
+        try {
+            this->raw_tiles[offset + i] = preprocessTile(session, session->images[i], resolution, tile, blending_settings[i], log);
+        }
+        catch (...) {
+#if defined(_OPENMP)
+#pragma omp critical
+#endif
+            if (!error) error = std::current_exception();
+        }
+        logs[i] = log.str();
+    }
+
+    for (int i = 0; i < n; ++i) *(session->logfile) << logs[i];
+    if (error) std::rethrow_exception(error);
+}
+
+
+RawTile TileBlender::preprocessRegion(Session *session, IIPImage *image, int requested_res,
+                                      unsigned int view_left, unsigned int view_top,
+                                      unsigned int view_width, unsigned int view_height,
+                                      unsigned int resampled_width, unsigned int resampled_height,
+                                      const BlendingSetting &setting, std::ostream &log) {
+    // timer for individual functions
+    Timer function_timer;
+    const std::string logging_prefix("TileBlender :: Regions :: ");
+
+    if (image->getColourSpace() != GREYSCALE || image->channels != 1 || (image->bpc != 16 && image->bpc != 8)) {
+        throw string(logging_prefix + "only 16/8bit grayscale images supported");
+    }
+    // for each image:
+    // 1. get region (from cache)
+    TileManager tilemanager(session->tileCache, image, session->watermark, session->jpeg, &log, session->loglevel);
+    tilemanager.setBulkRegionTiles(session->bulkRegionTiles);
+    tilemanager.setRegionThreads(session->regionThreads);
+    tilemanager.setImagePool(session->imagePool);
+
+    // First calculate histogram if we have asked for either binarization,
+    //  histogram equalization or contrast stretching
+    if (session->view->requireHistogram() && image->histogram.size() == 0) {
+
+        if (session->loglevel >= 4) function_timer.start();
+
+        // Retrieve an uncompressed version of our smallest tile
+        // which should be sufficient for calculating the histogram
+        RawTile thumbnail = tilemanager.getTile(0, 0, 0, session->view->yangle, session->view->getLayers(),
+                                                UNCOMPRESSED);
+
+        // Calculate histogram
+        image->histogram =
+                session->processor->histogram(thumbnail, image->max, image->min);
+
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Calculated histogram in "
+                                << function_timer.getTime() << " microseconds" << endl;
+        }
+
+        // Insert the histogram into our image cache
+        const string key = image->getImagePath();
+        session->imageCache->setHistogram(key, image->histogram);
+    }
+
+    CompressionType ct;
+    // Request uncompressed tile if raw pixel data is required for processing
+    if (
+            image->getNumBitsPerPixel() >= 8 ||   // image->getNumBitsPerPixel() > 8
+            image->getColourSpace() == CIELAB ||
+            image->getNumChannels() == 2 ||
+            image->getNumChannels() > 3 ||
+            (session->view->colourspace == GREYSCALE && image->getNumChannels() == 3 &&
+             image->getNumBitsPerPixel() == 8) ||
+            session->view->floatProcessing() ||
+            session->view->equalization ||
+            session->view->getRotation() != 0.0 ||
+            session->view->flip != 0)
+        ct = UNCOMPRESSED;
+    else ct = JPEG;
+
+
+    RawTile raw_region = tilemanager.getRegion(requested_res,
+                                               session->view->xangle, session->view->yangle,
+                                               session->view->getLayers(),
+                                               view_left, view_top, view_width, view_height);
+
+    if (raw_region.compressionType != UNCOMPRESSED) {
+        throw string(
+                logging_prefix +
+                "raw_region.compressionType -> retrieved image data already compressed, uncompressed data buffer required");
+    }
+
+    // Leave windowing, contrast and resizing to the blend engine if nothing else needs to be done
+    if (rawBlending(session->view)) return raw_region;
+
+    // 2. preprocess each tile (min/max contrast stretching)  TODO: check all preprocessing steps if they make sense for the blending case....
+    // Only use our float pipeline if necessary
+    if (raw_region.bpc >= 8 || session->view->floatProcessing()) {
+        if (session->loglevel >= 5) {
+            function_timer.start();
+        }
 
+        // Make a copy of our max and min as we may change these
+        vector<float> min;
+        vector<float> max;
 
-            // Apply any contrast adjustments and/or clip to 8bit from 16 or 32 bit
-            float contrast = session->view->contrast;
+        // Change our image max and min if we have asked for a contrast stretch
+//      if (session->view->contrast == -1) {
+//
+//        // Find first non-zero bin in histogram
+//        unsigned int n0 = 0;
+//        while (image->histogram[n0] == 0) ++n0;
+//
+//        // Find highest bin
+//        unsigned int n1 = image->histogram.size() - 1;
+//        while (image->histogram[n1] == 0) --n1;
+//
+//        // Histogram has been calculated using 8 bits, so scale up to native bit depth
+//        if (raw_region.bpc > 8 && raw_region.sampleType == FIXEDPOINT) {
+//          n0 = n0 << (raw_region.bpc - 8);
+//          n1 = n1 << (raw_region.bpc - 8);
+//        }
+//
+//        min.assign(raw_region.bpc, (float) n0);
+//        max.assign(raw_region.bpc, (float) n1);
+//
+//        // Reset our contrast
+//        session->view->contrast = 1.0;
+//
+//        if (session->loglevel >= 5) {
+//          log << "TileBlender :: Applying contrast stretch for image range of "
+//                              << n0 << " - " << n1 << " in "
+//                              << function_timer.getTime() << " microseconds" << endl;
+//        }
+//
+//      }
+
+        // Apply normalization and float conversion
+        // assign given min/max values for histogram stretching
+        min.push_back(setting.min);
+        max.push_back(setting.max);
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Normalizing between [" << min[0] << ", " << max[0] <<
+                                "] and converting to float";
+            function_timer.start();
+        }
+        session->processor->normalize(raw_region, max, min);
+        if (session->loglevel >= 4) {
+            log << " in " << function_timer.getTime() << " microseconds" << endl;
+        }
+
+
+        // Apply hill shading if requested
+        if (session->view->shaded) {
             if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Applying contrast of " << contrast
-                                    << " and converting to 8 bit";
+                log << logging_prefix + "Applying hill-shading";
                 function_timer.start();
             }
-            session->processor->contrast(rawtile, contrast);
+            session->processor->shade(raw_region, session->view->shade[0], session->view->shade[1]);
             if (session->loglevel >= 4) {
-                *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+                log << " in " << function_timer.getTime() << " microseconds" << endl;
             }
         }
-        // end tile float processing
-        // start tile processing
 
-        // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image
-        if (rawtile.channels == 2 || rawtile.channels > 3) {
-            unsigned int bands = (rawtile.channels == 2) ? 1 : 3;
+
+        // Apply color twist if requested
+        if (session->view->ctw.size()) {
             if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Flattening channels to " << bands;
+                log << logging_prefix + "Applying color twist";
                 function_timer.start();
             }
-            session->processor->flatten(rawtile, bands);
+            session->processor->twist(raw_region, session->view->ctw);
             if (session->loglevel >= 4) {
-                *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+                log << " in " << function_timer.getTime() << " microseconds" << endl;
             }
         }
 
 
-        // Convert to greyscale if requested
-        if ((*session->image)->getColourSpace() == sRGB && session->view->colourspace == GREYSCALE) {
+        // Apply any gamma correction
+        if (session->view->gamma != 1.0) {
+            float gamma = session->view->gamma;
             if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Converting to greyscale";
+                log << logging_prefix + "Applying gamma of " << gamma;
                 function_timer.start();
             }
-            session->processor->greyscale(rawtile);
+            session->processor->gamma(raw_region, gamma);
             if (session->loglevel >= 4) {
-                *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+                log << " in " << function_timer.getTime() << " microseconds" << endl;
             }
         }
 
 
-        // Convert to binary (bi-level) if requested
-        if (session->view->colourspace == BINARY) {
+        // Apply inversion if requested
+        if (session->view->inverted) {
             if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Converting to binary with threshold ";
+                log << logging_prefix + "Applying inversion";
                 function_timer.start();
             }
-            unsigned int threshold = session->processor->threshold(image->histogram);
-            session->processor->binary(rawtile, threshold);
+            session->processor->inv(raw_region);
             if (session->loglevel >= 4) {
-                *(session->logfile) << threshold << " in " << function_timer.getTime() << " microseconds" << endl;
+                log << " in " << function_timer.getTime() << " microseconds" << endl;
             }
         }
 
 
-        // Apply histogram equalization
-        if (session->view->equalization) {
-            if (session->loglevel >= 4) function_timer.start();
-            // Perform histogram equalization
-            session->processor->equalize(rawtile, image->histogram);
+        // Apply color mapping if requested
+        if (session->view->cmapped) {
             if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Applying histogram equalization in "
-                                    << function_timer.getTime() << " microseconds" << endl;
+                log << logging_prefix + "Applying color map";
+                function_timer.start();
+            }
+            session->processor->cmap(raw_region, session->view->cmap);
+            if (session->loglevel >= 4) {
+                log << " in " << function_timer.getTime() << " microseconds" << endl;
             }
         }
 
-        // Apply flip
-        if (session->view->flip != 0) {
-            Timer flip_timer;
-            if (session->loglevel >= 5) {
-                flip_timer.start();
-            }
 
-            session->processor->flip(rawtile, session->view->flip);
+        // Apply any contrast adjustments and/or clip to 8bit from 16 or 32 bit
+        float contrast = session->view->contrast;
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Applying contrast of " << contrast
+                                << " and converting to 8 bit";
+            function_timer.start();
+        }
+        session->processor->contrast(raw_region, contrast);
+        if (session->loglevel >= 4) {
+            log << " in " << function_timer.getTime() << " microseconds" << endl;
+        }
+    }
+    // end tile float processing
+    // start tile processing
+
+    // Resize our region as requested. Use the interpolation method requested in the server configuration.
+    //  - Use bilinear interpolation by default
+    if ((session->view->getViewWidth() != resampled_width) ||
+        (session->view->getViewHeight() != resampled_height)) {
+        resizeRegion(session, raw_region, resampled_width, resampled_height, log, logging_prefix);
+    }
+
+    // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image
+    if (raw_region.channels == 2 || raw_region.channels > 3) {
+        unsigned int bands = (raw_region.channels == 2) ? 1 : 3;
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Flattening channels to " << bands;
+            function_timer.start();
+        }
+        session->processor->flatten(raw_region, bands);
+        if (session->loglevel >= 4) {
+            log << " in " << function_timer.getTime() << " microseconds" << endl;
+        }
+    }
+
 
-            if (session->loglevel >= 5) {
-                *(session->logfile) << logging_prefix + "Flipping tile ";
-                if (session->view->flip == 1) *(session->logfile) << "horizontally";
-                else *(session->logfile) << "vertically";
-                *(session->logfile) << " in " << flip_timer.getTime() << " microseconds" << endl;
-            }
+    // Convert to greyscale if requested
+    if ((*session->image)->getColourSpace() == sRGB && session->view->colourspace == GREYSCALE) {
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Converting to greyscale";
+            function_timer.start();
+        }
+        session->processor->greyscale(raw_region);
+        if (session->loglevel >= 4) {
+            log << " in " << function_timer.getTime() << " microseconds" << endl;
         }
+    }
 
-        // Apply rotation - can apply this safely after gamma and contrast adjustment
-        if (session->view->getRotation() != 0.0) {
-            float rotation = session->view->getRotation();
-            if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Rotating tile by " << rotation << " degrees";
-                function_timer.start();
-            }
-            session->processor->rotate(rawtile, rotation);
-            if (session->loglevel >= 4) {
-                *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-            }
+
+    // Convert to binary (bi-level) if requested
+    if (session->view->colourspace == BINARY) {
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Converting to binary with threshold ";
+            function_timer.start();
+        }
+        unsigned int threshold = session->processor->threshold(image->histogram);
+        session->processor->binary(raw_region, threshold);
+        if (session->loglevel >= 4) {
+            log << threshold << " in " << function_timer.getTime() << " microseconds" << endl;
+        }
+    }
+
+
+    // Apply histogram equalization
+    if (session->view->equalization) {
+        if (session->loglevel >= 4) function_timer.start();
+        // Perform histogram equalization
+        session->processor->equalize(raw_region, image->histogram);
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Applying histogram equalization in "
+                                << function_timer.getTime() << " microseconds" << endl;
+        }
+    }
+
+    // Apply flip
+    if (session->view->flip != 0) {
+        Timer flip_timer;
+        if (session->loglevel >= 5) {
+            flip_timer.start();
+        }
+
+        session->processor->flip(raw_region, session->view->flip);
+
+        if (session->loglevel >= 5) {
+            log << logging_prefix + "Flipping region ";
+            if (session->view->flip == 1) log << "horizontally";
+            else log << "vertically";
+            log << " in " << flip_timer.getTime() << " microseconds" << endl;
         }
+    }
+
+    // Apply rotation - can apply this safely after gamma and contrast adjustment
+    if (session->view->getRotation() != 0.0) {
+        float rotation = session->view->getRotation();
+        if (session->loglevel >= 4) {
+            log << logging_prefix + "Rotating region by " << rotation << " degrees";
+            function_timer.start();
+        }
+        session->processor->rotate(raw_region, rotation);
+        if (session->loglevel >= 4) {
+            log << " in " << function_timer.getTime() << " microseconds" << endl;
+        }
+    }
 
-        this->raw_tiles.push_back(
-                rawtile);  // rawtile added to raw_tiles vector, tiles that are all ready to be blended
-    } // end foreach image
+    return raw_region;
 }
 
 
 void TileBlender::getRawRegionsAndPreprocess(Session *session, const std::vector<BlendingSetting> &blending_settings) {
-    // timer for individual functions
-    Timer function_timer;
     const std::string logging_prefix("TileBlender :: Regions :: ");
 
     // DETERMINE REGiON PROPERTIES
@@ -476,62 +939,13 @@ void TileBlender::getRawRegionsAndPreprocess(Session *session, const std::vector
     }
 
 
-    // get raw regions and preprocess
+    // Keep the output size for resizing after blending
+    this->resampled_width = resampled_width;
+    this->resampled_height = resampled_height;
+
+    // Set up any ICC profile first as all channels share our JPEG compressor
     for (int i = 0; i < session->images.size(); ++i) {
         IIPImage *image = session->images[i];
-
-        if (image->getColourSpace() != GREYSCALE || image->channels != 1 || (image->bpc != 16 && image->bpc != 8)) {
-            throw string(logging_prefix + "only 16/8bit grayscale images supported");
-        }
-        // for each image:
-        // 1. get tiles (from cache)
-        TileManager tilemanager(session->tileCache, image, session->watermark, session->jpeg, session->logfile,
-                                session->loglevel);
-
-        // First calculate histogram if we have asked for either binarization,
-        //  histogram equalization or contrast stretching
-        if (session->view->requireHistogram() && image->histogram.size() == 0) {
-
-            if (session->loglevel >= 4) function_timer.start();
-
-            // Retrieve an uncompressed version of our smallest tile
-            // which should be sufficient for calculating the histogram
-            RawTile thumbnail = tilemanager.getTile(0, 0, 0, session->view->yangle, session->view->getLayers(),
-                                                    UNCOMPRESSED);
-
-            // Calculate histogram
-            image->histogram =
-                    session->processor->histogram(thumbnail, image->max, image->min);
-
-            if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Calculated histogram in "
-                                    << function_timer.getTime() << " microseconds" << endl;
-            }
-
-            // Insert the histogram into our image cache
-            const string key = image->getImagePath();
-            imageCacheMapType::iterator i = session->imageCache->find(key);
-            if (i != session->imageCache->end()) (i->second).histogram = image->histogram;
-        }
-
-        CompressionType ct;
-        // Request uncompressed tile if raw pixel data is required for processing
-        if (
-                image->getNumBitsPerPixel() >= 8 ||   // image->getNumBitsPerPixel() > 8
-                image->getColourSpace() == CIELAB ||
-                image->getNumChannels() == 2 ||
-                image->getNumChannels() > 3 ||
-                (session->view->colourspace == GREYSCALE && image->getNumChannels() == 3 &&
-                 image->getNumBitsPerPixel() == 8) ||
-                session->view->floatProcessing() ||
-                session->view->equalization ||
-                session->view->getRotation() != 0.0 ||
-                session->view->flip != 0)
-            ct = UNCOMPRESSED;
-        else ct = JPEG;
-
-
-        // Embed ICC profile
         if (session->view->embedICC() && (image->getMetadata("icc").size() > 0)) {
             if (session->loglevel >= 3) {
                 *(session->logfile) << logging_prefix + "Embedding ICC profile with size "
@@ -539,268 +953,40 @@ void TileBlender::getRawRegionsAndPreprocess(Session *session, const std::vector
             }
             session->jpeg->setICCProfile(image->getMetadata("icc"));
         }
+    }
 
+    // Fetch, decode and preprocess each channel concurrently. Every channel has its own
+    // TileManager and log buffer, and any error is rethrown once all channels have finished
+    int n = session->images.size();
+    unsigned int offset = this->raw_tiles.size();
+    this->raw_tiles.resize(offset + n);
+    std::vector<std::string> logs(n);
+    std::exception_ptr error;
 
-        RawTile raw_region = tilemanager.getRegion(requested_res,
-                                                   session->view->xangle, session->view->yangle,
-                                                   session->view->getLayers(),
-                                                   view_left, view_top, view_width, view_height);
-
-        if (raw_region.compressionType != UNCOMPRESSED) {
-            throw string(
-                    logging_prefix +
-                    "raw_region.compressionType -> retrieved image data already compressed, uncompressed data buffer required");
-        }
-
-        // 2. preprocess each tile (min/max contrast stretching)  TODO: check all preprocessing steps if they make sense for the blending case....
-        // Only use our float pipeline if necessary
-        if (raw_region.bpc >= 8 || session->view->floatProcessing()) {
-            if (session->loglevel >= 5) {
-                function_timer.start();
-            }
-
-            // Make a copy of our max and min as we may change these
-            vector<float> min;
-            vector<float> max;
-
-            // Change our image max and min if we have asked for a contrast stretch
-//      if (session->view->contrast == -1) {
-//
-//        // Find first non-zero bin in histogram
-//        unsigned int n0 = 0;
-//        while (image->histogram[n0] == 0) ++n0;
-//
-//        // Find highest bin
-//        unsigned int n1 = image->histogram.size() - 1;
-//        while (image->histogram[n1] == 0) --n1;
-//
-//        // Histogram has been calculated using 8 bits, so scale up to native bit depth
-//        if (raw_region.bpc > 8 && raw_region.sampleType == FIXEDPOINT) {
-//          n0 = n0 << (raw_region.bpc - 8);
-//          n1 = n1 << (raw_region.bpc - 8);
-//        }
-//
-//        min.assign(raw_region.bpc, (float) n0);
-//        max.assign(raw_region.bpc, (float) n1);
-//
-//        // Reset our contrast
-//        session->view->contrast = 1.0;
-//
-//        if (session->loglevel >= 5) {
-//          *(session->logfile) << "TileBlender :: Applying contrast stretch for image range of "
-//                              << n0 << " - " << n1 << " in "
-//                              << function_timer.getTime() << " microseconds" << endl;
-//        }
-//
-//      }
-
-            // Apply normalization and float conversion
-            // assign given min/max values for histogram stretching
-            min.push_back(blending_settings[i].min);
-            max.push_back(blending_settings[i].max);
-            if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Normalizing between [" << min[0] << ", " << max[0] <<
-                                    "] and converting to float";
-                function_timer.start();
-            }
-            session->processor->normalize(raw_region, max, min);
-            if (session->loglevel >= 4) {
-                *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-            }
-
-
-            // Apply hill shading if requested
-            if (session->view->shaded) {
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << logging_prefix + "Applying hill-shading";
-                    function_timer.start();
-                }
-                session->processor->shade(raw_region, session->view->shade[0], session->view->shade[1]);
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-                }
-            }
-
-
-            // Apply color twist if requested
-            if (session->view->ctw.size()) {
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << logging_prefix + "Applying color twist";
-                    function_timer.start();
-                }
-                session->processor->twist(raw_region, session->view->ctw);
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-                }
-            }
-
-
-            // Apply any gamma correction
-            if (session->view->gamma != 1.0) {
-                float gamma = session->view->gamma;
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << logging_prefix + "Applying gamma of " << gamma;
-                    function_timer.start();
-                }
-                session->processor->gamma(raw_region, gamma);
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-                }
-            }
-
-
-            // Apply inversion if requested
-            if (session->view->inverted) {
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << logging_prefix + "Applying inversion";
-                    function_timer.start();
-                }
-                session->processor->inv(raw_region);
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-                }
-            }
-
-
-            // Apply color mapping if requested
-            if (session->view->cmapped) {
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << logging_prefix + "Applying color map";
-                    function_timer.start();
-                }
-                session->processor->cmap(raw_region, session->view->cmap);
-                if (session->loglevel >= 4) {
-                    *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-                }
-            }
-
-
-            // Apply any contrast adjustments and/or clip to 8bit from 16 or 32 bit
-            float contrast = session->view->contrast;
-            if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Applying contrast of " << contrast
-                                    << " and converting to 8 bit";
-                function_timer.start();
-            }
-            session->processor->contrast(raw_region, contrast);
-            if (session->loglevel >= 4) {
-                *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-            }
-        }
-        // end tile float processing
-        // start tile processing
-
-        // Resize our region as requested. Use the interpolation method requested in the server configuration.
-        //  - Use bilinear interpolation by default
-        if ((session->view->getViewWidth() != resampled_width) ||
-            (session->view->getViewHeight() != resampled_height)) {
-
-            string interpolation_type;
-            if (session->loglevel >= 5) function_timer.start();
-
-            unsigned int interpolation = Environment::getInterpolation();
-            switch (interpolation) {
-                case 0:
-                    interpolation_type = "nearest neighbour";
-                    session->processor->interpolate_nearestneighbour(raw_region, resampled_width, resampled_height);
-                    break;
-                default:
-                    interpolation_type = "bilinear";
-                    session->processor->interpolate_bilinear(raw_region, resampled_width, resampled_height);
-                    break;
-            }
-
-            if (session->loglevel >= 5) {
-                *(session->logfile) << logging_prefix + "Resizing using " << interpolation_type << " interpolation in "
-                                    << function_timer.getTime() << " microseconds" << endl;
-            }
-        }
-
-        // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image
-        if (raw_region.channels == 2 || raw_region.channels > 3) {
-            unsigned int bands = (raw_region.channels == 2) ? 1 : 3;
-            if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Flattening channels to " << bands;
-                function_timer.start();
-            }
-            session->processor->flatten(raw_region, bands);
-            if (session->loglevel >= 4) {
-                *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-            }
-        }
-
-
-        // Convert to greyscale if requested
-        if ((*session->image)->getColourSpace() == sRGB && session->view->colourspace == GREYSCALE) {
-            if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Converting to greyscale";
-                function_timer.start();
-            }
-            session->processor->greyscale(raw_region);
-            if (session->loglevel >= 4) {
-                *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-            }
-        }
-
-
-        // Convert to binary (bi-level) if requested
-        if (session->view->colourspace == BINARY) {
-            if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Converting to binary with threshold ";
-                function_timer.start();
-            }
-            unsigned int threshold = session->processor->threshold(image->histogram);
-            session->processor->binary(raw_region, threshold);
-            if (session->loglevel >= 4) {
-                *(session->logfile) << threshold << " in " << function_timer.getTime() << " microseconds" << endl;
-            }
-        }
-
-
-        // Apply histogram equalization
-        if (session->view->equalization) {
-            if (session->loglevel >= 4) function_timer.start();
-            // Perform histogram equalization
-            session->processor->equalize(raw_region, image->histogram);
-            if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Applying histogram equalization in "
-                                    << function_timer.getTime() << " microseconds" << endl;
-            }
-        }
-
-        // Apply flip
-        if (session->view->flip != 0) {
-            Timer flip_timer;
-            if (session->loglevel >= 5) {
-                flip_timer.start();
-            }
-
-            session->processor->flip(raw_region, session->view->flip);
+    // Keep to this worker's share of the cores
+    int threads = std::max(1, std::min(n, (int) session->regionThreads));
 
-            if (session->loglevel >= 5) {
-                *(session->logfile) << logging_prefix + "Flipping region ";
-                if (session->view->flip == 1) *(session->logfile) << "horizontally";
-                else *(session->logfile) << "vertically";
-                *(session->logfile) << " in " << flip_timer.getTime() << " microseconds" << endl;
-            }
+#if defined(_OPENMP)
+#pragma omp parallel for schedule(dynamic, 1) num_threads(threads) if (threads > 1)
+#endif
+    for (int i = 0; i < n; ++i) {
+        std::ostringstream log;
+        try {
+            this->raw_tiles[offset + i] = preprocessRegion(session, session->images[i], requested_res,
+                                        view_left, view_top, view_width, view_height,
+                                        resampled_width, resampled_height, blending_settings[i], log);
         }
-
-        // Apply rotation - can apply this safely after gamma and contrast adjustment
-        if (session->view->getRotation() != 0.0) {
-            float rotation = session->view->getRotation();
-            if (session->loglevel >= 4) {
-                *(session->logfile) << logging_prefix + "Rotating region by " << rotation << " degrees";
-                function_timer.start();
-            }
-            session->processor->rotate(raw_region, rotation);
-            if (session->loglevel >= 4) {
-                *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-            }
+        catch (...) {
+#if defined(_OPENMP)
+#pragma omp critical
+#endif
+            if (!error) error = std::current_exception();
         }
+        logs[i] = log.str();
+    }
 
-        this->raw_tiles.push_back(
-                raw_region);  // raw_region added to raw_tiles vector, tiles that are all ready to be blended
-    } // end foreach image
+    for (int i = 0; i < n; ++i) *(session->logfile) << logs[i];
+    if (error) std::rethrow_exception(error);
 }
 
 
@@ -843,6 +1029,22 @@ void TileBlender::blendTiles(Session *session, int resolution, int tile,
         throw error.str();
     }
 
+    // Return the final JPEG directly if we have already blended this tile with the same settings
+    std::string blend_key;
+    if (session->blendCache) {
+        blend_key = this->blendKey(session, resolution, tile, blending_settings);
+        RawTile cached;
+        if (session->blendCache->getTile(blend_key, cached)) {
+            if (session->loglevel >= 2) {
+                *(session->logfile) << "TileBlender :: Blended tile cache hit. Number of elements: "
+                                    << session->blendCache->getNumElements() << endl;
+            }
+            this->sendJPEG(session, cached, cached.dataLength, "tile");
+            return;
+        }
+        if (session->loglevel >= 2) *(session->logfile) << "TileBlender :: Blended tile cache miss" << endl;
+    }
+
     // get raw tiles and preprocess (fill raw_tiles vector)
     this->getRawTilesAndPreprocess(session, resolution, tile, blending_settings);
 
@@ -852,11 +1054,12 @@ void TileBlender::blendTiles(Session *session, int resolution, int tile,
 
     RawTile blended_tile(0, tmp.resolution, tmp.hSequence, tmp.vSequence, tmp.width, tmp.height, 3, 8);
     blended_tile.dataLength = blended_tile.width * blended_tile.height * out_channels;
-    uint8_t *dst = new uint8_t[blended_tile.dataLength]();
+    uint8_t *dst = new uint8_t[blended_tile.dataLength];
     blended_tile.data = dst;  // this is cleaned up by raw tile
 
-    const unsigned int dst_stride = blended_tile.width * out_channels;
-    const unsigned int src_stride = blended_tile.width;
+    // Channels are windowed by the blend engine if they have not been preprocessed already
+    const bool raw_blending = rawBlending(session->view) && !session->channelCache;
+    std::vector<BlendChannel> channels;
 
     // now blend all tiles together:
     for (int tidx = 0; tidx < this->raw_tiles.size(); ++tidx) {
@@ -886,7 +1089,6 @@ void TileBlender::blendTiles(Session *session, int resolution, int tile,
           continue;
 
         const RawTile &cur_tile = this->raw_tiles[tidx];
-        const uint8_t *src = static_cast<const uint8_t *>(cur_tile.data);
 
         // try to parse color code
         BlendColor b_color;
@@ -907,37 +1109,24 @@ void TileBlender::blendTiles(Session *session, int resolution, int tile,
                     "TileBlender ERROR: invalid color code for TileBlender!");// + blending_settings[tidx].lut );
         }
 
-        for (int y = 0; y < blended_tile.height; ++y) {
-            uint8_t *dst_row_p = dst + y * dst_stride;
-
-            for (int x = 0; x < blended_tile.width; ++x) {
-                // get the gray value and check whether the tile is single valued and not zero or not.
-                // If it is, set this tile to maximum intensity:
-                auto gv = is_tile_single_valued ? 255 : src[y * src_stride + x];
-
-                // convert to color
-                auto r = b_color.r * (gv / 255.0);
-                auto g = b_color.g * (gv / 255.0);
-                auto b = b_color.b * (gv / 255.0);
-
-                // fill output array and clip value between 0...255
-                dst_row_p[x * out_channels] = static_cast<uint8_t>(std::min(255, std::max(0, static_cast<int>(r +
-                                                                                                              dst_row_p[
-                                                                                                                      x *
-                                                                                                                      out_channels]))));
-                dst_row_p[x * out_channels + 1] = static_cast<uint8_t>(std::min(255, std::max(0, static_cast<int>(g +
-                                                                                                                  dst_row_p[
-                                                                                                                          x *
-                                                                                                                          out_channels +
-                                                                                                                          1]))));
-                dst_row_p[x * out_channels + 2] = static_cast<uint8_t>(std::min(255, std::max(0, static_cast<int>(b +
-                                                                                                                  dst_row_p[
-                                                                                                                          x *
-                                                                                                                          out_channels +
-                                                                                                                          2]))));
+        BlendChannel channel;
+        channel.data = cur_tile.data;
+        channel.bpc = cur_tile.bpc;
+        channel.min = raw_blending ? blending_settings[tidx].min : 0;
+        channel.max = raw_blending ? blending_settings[tidx].max : 255;
+        channel.contrast = raw_blending ? session->view->contrast : 1.0;
+        channel.single_valued = is_tile_single_valued;
+        channel.r = b_color.r;
+        channel.g = b_color.g;
+        channel.b = b_color.b;
+        channels.push_back(channel);
+    }
 
-            }
-        }
+    if (session->loglevel >= 4) function_timer.start();
+    BlendEngine::blend(channels, blended_tile.width, blended_tile.height, dst);
+    if (session->loglevel >= 4) {
+        *(session->logfile) << "TileBlender :: Blended " << channels.size() << " channels in "
+                            << function_timer.getTime() << " microseconds" << endl;
     }
 
     unsigned int len = blended_tile.dataLength;
@@ -954,34 +1143,13 @@ void TileBlender::blendTiles(Session *session, int resolution, int tile,
         }
     }
 
-#ifndef DEBUG
-    char str[1024];
-
-    snprintf(str, 1024,
-             "Server: iipsrv/%s\r\n"
-             "X-Powered-By: IIPImage\r\n"
-             "Content-Type: image/jpeg\r\n"
-             "Content-Length: %d\r\n"
-             "Last-Modified: %s\r\n"
-             "%s\r\n"
-             "\r\n",
-             VERSION, len, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str());
-
-    session->out->printf(str);
-#endif
-
-    // 4. send final response
-    if (session->out->putStr(static_cast<const char *>(blended_tile.data), len) != len) {
-        if (session->loglevel >= 1) {
-            *(session->logfile) << "TileBlender :: Error writing jpeg tile" << endl;
-        }
+    // Keep the final tile for identical requests
+    if (session->blendCache && blended_tile.compressionType == JPEG) {
+        session->blendCache->insert(blend_key, blended_tile);
     }
 
-    if (session->out->flush() == -1) {
-        if (session->loglevel >= 1) {
-            *(session->logfile) << "TileBlender :: Error flushing jpeg tile" << endl;
-        }
-    }
+    // 4. send final response
+    this->sendJPEG(session, blended_tile, len, "tile");
 }
 
 
@@ -1011,11 +1179,12 @@ void TileBlender::blendRegions(Session *session, const std::vector<BlendingSetti
     RawTile blended_tile(0, tmp.resolution, tmp.hSequence, tmp.vSequence, tmp.width, tmp.height, 3,
                          8);  // 3 channels (RGB) and 8bit
     blended_tile.dataLength = blended_tile.width * blended_tile.height * out_channels;
-    uint8_t *dst = new uint8_t[blended_tile.dataLength]();
+    uint8_t *dst = new uint8_t[blended_tile.dataLength];
     blended_tile.data = dst;  // this is cleaned up by raw tile
 
-    const unsigned int dst_stride = blended_tile.width * out_channels;
-    const unsigned int src_stride = blended_tile.width;
+    // Channels are windowed by the blend engine if they have not been preprocessed already
+    const bool raw_blending = rawBlending(session->view);
+    std::vector<BlendChannel> channels;
 
     // now blend all tiles together:
     for (int tidx = 0; tidx < this->raw_tiles.size(); ++tidx) {
@@ -1045,7 +1214,6 @@ void TileBlender::blendRegions(Session *session, const std::vector<BlendingSetti
           continue;
 
         const RawTile &cur_tile = this->raw_tiles[tidx];
-        const uint8_t *src = static_cast<const uint8_t *>(cur_tile.data);
 
         // try to parse color code
         BlendColor b_color;
@@ -1066,37 +1234,31 @@ void TileBlender::blendRegions(Session *session, const std::vector<BlendingSetti
                     "TileBlender ERROR: invalid color code for TileBlender!");// + blending_settings[tidx].lut );
         }
 
-        for (int y = 0; y < blended_tile.height; ++y) {
-            uint8_t *dst_row_p = dst + y * dst_stride;
-
-            for (int x = 0; x < blended_tile.width; ++x) {
-              // get the gray value and check whether the tile is single valued and not zero or not.
-              // If it is, set this tile to maximum intensity:
-              auto gv = is_tile_single_valued ? 255 : src[y * src_stride + x];
-
-                // convert to color
-                auto r = b_color.r * (gv / 255.0);
-                auto g = b_color.g * (gv / 255.0);
-                auto b = b_color.b * (gv / 255.0);
-
-                // fill output array and clip value between 0...255
-                dst_row_p[x * out_channels] = static_cast<uint8_t>(std::min(255, std::max(0, static_cast<int>(r +
-                                                                                                              dst_row_p[
-                                                                                                                      x *
-                                                                                                                      out_channels]))));
-                dst_row_p[x * out_channels + 1] = static_cast<uint8_t>(std::min(255, std::max(0, static_cast<int>(g +
-                                                                                                                  dst_row_p[
-                                                                                                                          x *
-                                                                                                                          out_channels +
-                                                                                                                          1]))));
-                dst_row_p[x * out_channels + 2] = static_cast<uint8_t>(std::min(255, std::max(0, static_cast<int>(b +
-                                                                                                                  dst_row_p[
-                                                                                                                          x *
-                                                                                                                          out_channels +
-                                                                                                                          2]))));
+        BlendChannel channel;
+        channel.data = cur_tile.data;
+        channel.bpc = cur_tile.bpc;
+        channel.min = raw_blending ? blending_settings[tidx].min : 0;
+        channel.max = raw_blending ? blending_settings[tidx].max : 255;
+        channel.contrast = raw_blending ? session->view->contrast : 1.0;
+        channel.single_valued = is_tile_single_valued;
+        channel.r = b_color.r;
+        channel.g = b_color.g;
+        channel.b = b_color.b;
+        channels.push_back(channel);
+    }
 
-            }
-        }
+    if (session->loglevel >= 4) function_timer.start();
+    BlendEngine::blend(channels, blended_tile.width, blended_tile.height, dst);
+    if (session->loglevel >= 4) {
+        *(session->logfile) << "TileBlender :: Blended " << channels.size() << " channels in "
+                            << function_timer.getTime() << " microseconds" << endl;
+    }
+
+    // Raw channels are blended at the region's native size, so resize the blended result
+    if (raw_blending && ((session->view->getViewWidth() != this->resampled_width) ||
+                         (session->view->getViewHeight() != this->resampled_height))) {
+        resizeRegion(session, blended_tile, this->resampled_width, this->resampled_height, *(session->logfile),
+                     "TileBlender :: Regions :: ");
     }
 
     unsigned int len = blended_tile.dataLength;
@@ -1113,6 +1275,12 @@ void TileBlender::blendRegions(Session *session, const std::vector<BlendingSetti
         }
     }
 
+    // 4. send final response
+    this->sendJPEG(session, blended_tile, len, "region");
+}
+
+
+void TileBlender::sendJPEG(Session *session, const RawTile &blended_tile, unsigned int len, const std::string &type) {
 #ifndef DEBUG
     char str[1024];
 
@@ -1129,16 +1297,15 @@ void TileBlender::blendRegions(Session *session, const std::vector<BlendingSetti
     session->out->printf(str);
 #endif
 
-    // 4. send final response
     if (session->out->putStr(static_cast<const char *>(blended_tile.data), len) != len) {
         if (session->loglevel >= 1) {
-            *(session->logfile) << "TileBlender :: Error writing jpeg region" << endl;
+            *(session->logfile) << "TileBlender :: Error writing jpeg " << type << endl;
         }
     }
 
     if (session->out->flush() == -1) {
         if (session->loglevel >= 1) {
-            *(session->logfile) << "TileBlender :: Error flushing jpeg region" << endl;
+            *(session->logfile) << "TileBlender :: Error flushing jpeg " << type << endl;
         }
     }
-}
\ No newline at end of file
+}
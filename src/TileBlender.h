@@ -45,6 +45,54 @@ struct TileBlender {
 private:
     std::vector<RawTile> raw_tiles;
 
+    /// Requested output size of blended regions
+    unsigned int resampled_width, resampled_height;
+
+    /// Function to build the blended tile cache key from the images, blending settings and view
+    /** @param session : current session variable expected to have the images vector set up
+        @param resolution : image resolution or pyramid level
+        @param tile : tile index
+        @param blending_settings : BlendingSetting vector to be used
+        @return key, independent of the order of the channels
+    */
+    std::string blendKey(Session *session, int resolution, int tile, const std::vector<BlendingSetting> &blending_settings);
+
+    /// Function to write a blended JPEG with its HTTP header
+    /** @param session : current session variable
+        @param blended_tile : compressed tile or region
+        @param len : number of bytes to send
+        @param type : "tile" or "region" for logging
+    */
+    void sendJPEG(Session *session, const RawTile &blended_tile, unsigned int len, const std::string &type);
+
+    /// Function to load and preprocess a single channel tile
+    /** @param session : current session variable
+        @param image : channel image
+        @param resolution : image resolution or pyramid level
+        @param tile : tile index
+        @param setting : BlendingSetting of this channel
+        @param log : stream to log to
+        @return preprocessed 8 bit tile
+    */
+    RawTile preprocessTile(Session *session, IIPImage *image, int resolution, int tile,
+                           const BlendingSetting &setting, std::ostream &log);
+
+    /// Function to load and preprocess a single channel region
+    /** @param session : current session variable
+        @param image : channel image
+        @param requested_res : image resolution or pyramid level
+        @param view_left, view_top, view_width, view_height : region at the requested resolution
+        @param resampled_width, resampled_height : requested output size
+        @param setting : BlendingSetting of this channel
+        @param log : stream to log to
+        @return preprocessed and resized 8 bit region
+    */
+    RawTile preprocessRegion(Session *session, IIPImage *image, int requested_res,
+                             unsigned int view_left, unsigned int view_top,
+                             unsigned int view_width, unsigned int view_height,
+                             unsigned int resampled_width, unsigned int resampled_height,
+                             const BlendingSetting &setting, std::ostream &log);
+
 public:
 
     /// Function to parse a json string and to create a BlendingSetting vector
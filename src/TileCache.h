@@ -0,0 +1,207 @@
+// Generic Tile Cache Class
+
+/*  IIP Image Server
+
+    Copyright (C) 2020 KML Vision GmbH.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TILECACHE_H
+#define _TILECACHE_H
+
+
+// Fix missing snprintf in Windows
+#if defined _MSC_VER && _MSC_VER<1900
+#define snprintf _snprintf
+#endif
+
+
+#include <cstdio>
+#include <string>
+#include <list>
+#include <functional>
+#include <stdint.h>
+#include "RawTile.h"
+#include "CacheStatistics.h"
+
+
+
+/// Compact, fixed size index of a tile
+/** The image is identified by a number interned by the cache, and the remaining
+    tile parameters are packed alongside it. The hash is computed once on
+    construction, so that keys can be built, hashed and compared without any
+    allocation or formatting.
+ */
+struct TileKey {
+
+  uint32_t image;       ///< interned image number
+  uint32_t tile;        ///< tile number
+  int32_t hSequence;    ///< horizontal sequence number
+  int32_t vSequence;    ///< vertical sequence number
+  uint32_t packed;      ///< resolution (8 bits), compression type (8 bits) and quality (16 bits)
+  uint64_t hash;        ///< precomputed hash of the above
+
+  /// Default constructor
+  TileKey() : image( 0 ), tile( 0 ), hSequence( 0 ), vSequence( 0 ), packed( 0 ), hash( 0 ) {};
+
+  /// Constructor
+  /** @param i interned image number
+      @param r resolution number
+      @param t tile number
+      @param h horizontal sequence number
+      @param v vertical sequence number
+      @param c compression type
+      @param q compression quality
+   */
+  TileKey( uint32_t i, int r, int t, int h, int v, CompressionType c, int q ) :
+    image( i ), tile( t ), hSequence( h ), vSequence( v ),
+    packed( ( (uint32_t) r & 0xff ) | ( ( (uint32_t) c & 0xff ) << 8 ) | ( ( (uint32_t) q & 0xffff ) << 16 ) )
+  {
+    // Combine the fields and finish with the 64 bit MurmurHash3 mixer
+    uint64_t x = ( (uint64_t) image << 32 ) | tile;
+    x ^= ( ( (uint64_t)(uint32_t) hSequence << 32 ) | (uint32_t) vSequence ) * 0x9E3779B97F4A7C15ULL;
+    x ^= (uint64_t) packed * 0xC2B2AE3D27D4EB4FULL;
+    x ^= x >> 33; x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33; x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    hash = x;
+  };
+
+  bool operator==( const TileKey& k ) const {
+    return hash == k.hash && image == k.image && tile == k.tile && hSequence == k.hSequence &&
+      vSequence == k.vSequence && packed == k.packed;
+  };
+
+  bool operator<( const TileKey& k ) const {
+    if( image != k.image ) return image < k.image;
+    if( tile != k.tile ) return tile < k.tile;
+    if( hSequence != k.hSequence ) return hSequence < k.hSequence;
+    if( vSequence != k.vSequence ) return vSequence < k.vSequence;
+    return packed < k.packed;
+  };
+
+};
+
+
+namespace std {
+  /// Tile keys carry their own hash
+  template <>
+    struct hash<TileKey> {
+      size_t operator() ( const TileKey& k ) const { return (size_t) k.hash; }
+    };
+}
+
+
+
+/// Base class for tile caches - extended by the in-process Cache and the
+/// cross-process SharedMemoryCache. Implementations must be thread-safe.
+
+class TileCache {
+
+ public:
+
+  virtual ~TileCache() {};
+
+
+  /// Insert a tile
+  /** @param r Tile to be inserted
+      @param cost time taken to generate the tile in microseconds, which
+      cost-aware caches use to favour tiles that are expensive to regenerate
+      @param bulk whether the tile is part of a bulk read, such as a large region
+      export, and should not displace other tiles
+   */
+  virtual void insert( const RawTile& r, unsigned long cost = 0, bool bulk = false ) = 0;
+
+
+  /// Get a tile from the cache
+  /** The tile is copied out of cache storage or shares its data
+   *  @param f filename
+   *  @param r resolution number
+   *  @param t tile number
+   *  @param h horizontal sequence number
+   *  @param v vertical sequence number
+   *  @param c compression type
+   *  @param q compression quality
+   *  @param tile RawTile to copy the cached tile into
+   *  @return true if the tile was found
+   */
+  virtual bool getTile( const std::string& f, int r, int t, int h, int v, CompressionType c, int q, RawTile& tile ) = 0;
+
+
+  /// Return the number of tiles in the cache
+  virtual unsigned int getNumElements() = 0;
+
+
+  /// Return the number of MB stored
+  virtual float getMemorySize() = 0;
+
+
+  /// Return the number of tiles admitted into the cache
+  virtual unsigned long getAdmitted() { return 0; }
+
+
+  /// Return the number of tiles rejected by admission control
+  virtual unsigned long getRejected() { return 0; }
+
+
+  /// Return usage statistics
+  /** @return statistics or NULL if the cache does not keep any */
+  virtual CacheStatistics* getStatistics() { return NULL; }
+
+
+  /// Take the next raw tile that has been evicted and should be demoted to an encoded form
+  /** Caches that do not demote tiles return none
+      @param tile set to the tile to demote
+      @return whether a tile was taken
+   */
+  virtual bool getDemoted( RawTile& tile ) { return false; };
+
+
+  /// Insert a tile that has been demoted to an encoded form
+  /** Only the cache itself keeps the demoted tile: any second level cache already
+      received the raw tile and does not need a second copy
+      @param r encoded tile
+      @param cost time taken to encode the tile in microseconds
+   */
+  virtual void insertDemoted( const RawTile& r, unsigned long cost = 0 ) { this->insert( r, cost ); };
+
+
+  /// Return a description of the cache backend
+  virtual std::string getDescription() = 0;
+
+
+  /// Create a string index, as used by caches shared with other processes or across restarts
+  /**
+   *  @param f filename
+   *  @param r resolution number
+   *  @param t tile number
+   *  @param h horizontal sequence number
+   *  @param v vertical sequence number
+   *  @param c compression type
+   *  @param q compression quality
+   *  @return string
+   */
+  static std::string getIndex( const std::string& f, int r, int t, int h, int v, CompressionType c, int q ) {
+    char tmp[1024];
+    snprintf( tmp, 1024, "%s:%d:%d:%d:%d:%d:%d", f.c_str(), r, t, h, v, c, q );
+    return std::string( tmp );
+  }
+
+};
+
+
+#endif
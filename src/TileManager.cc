@@ -24,8 +24,16 @@
 
 
 #include <cmath>
+#include <algorithm>
+#include <exception>
+#include <sstream>
+#include <vector>
 #include "TileManager.h"
 
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
 
 using namespace std;
 
@@ -35,13 +43,33 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 
   if( loglevel >= 2 ) *logfile << "TileManager :: Cache Miss for resolution: " << resolution << ", tile: " << tile << endl
 			       << "TileManager :: Cache Size: " << tileCache->getNumElements()
-			       << " tiles, " << tileCache->getMemorySize() << " MB" << endl;
+			       << " tiles, " << tileCache->getMemorySize() << " MB" << endl
+			       << "TileManager :: Cache Admissions: " << tileCache->getAdmitted() << " admitted, "
+			       << tileCache->getRejected() << " rejected" << endl;
 
 
   RawTile ttt;
 
-  // Get our raw tile from the IIPImage image object
-  ttt = image->getTile( xangle, yangle, resolution, layers, tile );
+  // Time the generation of the tile, which the cache uses as the cost of regenerating it
+  generation_timer.start();
+
+  // Pass through a JPEG tile stored in the image as it is if we can. It is indexed as
+  // a tile of our quality, so that it is found by subsequent requests, but keeps the
+  // quality it was actually encoded at
+  if( c == JPEG && passthrough && !( watermark && watermark->isSet() ) &&
+      image->getJPEGTile( xangle, yangle, resolution, tile, ttt ) ){
+    if( loglevel >= 2 ) *logfile << "TileManager :: Passing through stored JPEG tile of quality "
+				 << ttt.quality << endl;
+    ttt.encodedQuality = ttt.quality;
+    ttt.quality = jpeg->getQuality();
+  }
+
+  // Otherwise get our raw tile from the IIPImage image object
+  else{
+    ttt = image->getTile( xangle, yangle, resolution, layers, tile );
+    if( loglevel >= 2 ) *logfile << "TileManager :: Tile decoding time: " << generation_timer.getTime()
+				 << " microseconds" << endl;
+  }
 
 
   // Apply the watermark if we have one.
@@ -67,9 +95,11 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 
   // Add our uncompressed tile directly into our cache
   if( c == UNCOMPRESSED ){
-    // Add to our tile cache
+    // Add to our tile cache, sharing our data with it
+    long cost = generation_timer.getTime();
     if( loglevel >= 2 ) insert_timer.start();
-    tileCache->insert( ttt );
+    ttt.share();
+    tileCache->insert( ttt, cost, bulk );
     if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 				 << " microseconds" << endl;
     return ttt;
@@ -80,8 +110,8 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 
   case JPEG:
 
-    // Do our JPEG compression iff we have an 8 bit per channel image
-    if( ttt.bpc == 8 && (ttt.channels==1 || ttt.channels==3) ){
+    // Do our JPEG compression iff we have an 8 bit per channel image which is not already compressed
+    if( ttt.compressionType == UNCOMPRESSED && ttt.bpc == 8 && (ttt.channels==1 || ttt.channels==3) ){
       if( loglevel >=2 ) compression_timer.start();
       jpeg->Compress( ttt );
       if( loglevel >= 2 ) *logfile << "TileManager :: JPEG Compression Time: "
@@ -104,9 +134,11 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
   }
 
 
-  // Add to our tile cache
+  // Add to our tile cache, sharing our data with it
+  long cost = generation_timer.getTime();
   if( loglevel >= 2 ) insert_timer.start();
-  tileCache->insert( ttt );
+  ttt.share();
+  tileCache->insert( ttt, cost, bulk );
   if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 			       << " microseconds" << endl;
 
@@ -128,23 +160,26 @@ void TileManager::crop( RawTile *ttt ){
 	     << endl;
   }
 
-  // Create a new buffer, fill it with the old data, then copy
-  // back the cropped part into the RawTile buffer
-  int len = tw * th * ttt->channels * (ttt->bpc/8);
-  unsigned char* buffer = (unsigned char*) malloc( len );
-  unsigned char* src_ptr = (unsigned char*) memcpy( buffer, ttt->data, len );
+  // Scanlines only ever move towards the start of the buffer, so we can crop
+  // in place. Shared data is instead cropped into a new buffer of our own,
+  // keeping a reference to the shared data until we are done
+  int len = ttt->width * ttt->channels * (ttt->bpc/8);
+  int stride = tw * ttt->channels * (ttt->bpc/8);
+  std::shared_ptr<void> shared = ttt->buffer;
+  unsigned char* src_ptr = (unsigned char*) ttt->data;
+  if( shared ){
+    ttt->deallocate();
+    ttt->data = RawTile::allocate( len * ttt->height, ttt->bpc, ttt->sampleType );
+  }
   unsigned char* dst_ptr = (unsigned char*) ttt->data;
 
   // Copy one scanline at a time
-  len =  ttt->width * ttt->channels * (ttt->bpc/8);
   for( unsigned int i=0; i<ttt->height; i++ ){
-    memcpy( dst_ptr, src_ptr, len );
+    memmove( dst_ptr, src_ptr, len );
     dst_ptr += len;
-    src_ptr += tw * ttt->channels * (ttt->bpc/8);
+    src_ptr += stride;
   }
 
-  free( buffer );
-
   // Reset the data length
   len = ttt->width * ttt->height * ttt->channels * (ttt->bpc/8);
   ttt->dataLength = len;
@@ -155,9 +190,37 @@ void TileManager::crop( RawTile *ttt ){
 
 
 
+void TileManager::demote(){
+
+  // Tiles are only cached as JPEG at the quality of our JPEG compressor. Use a
+  // compressor of our own so that no ICC profile or XMP metadata is embedded
+  JPEGCompressor* j = dynamic_cast<JPEGCompressor*>( jpeg );
+  if( !j ) return;
+
+  // Only demote a single tile per request to bound the extra work each request does
+  RawTile tile;
+  if( !tileCache->getDemoted( tile ) ) return;
+
+  try{
+    JPEGCompressor compressor( j->getQuality() );
+    compression_timer.start();
+    compressor.Compress( tile );
+    tileCache->insertDemoted( tile, compression_timer.getTime() );
+    if( loglevel >= 3 ) *logfile << "TileManager :: Demoted evicted raw tile " << tile.tileNum
+				 << " at resolution " << tile.resolution << " to JPEG" << endl;
+  }
+  // A tile that fails to compress is simply dropped
+  catch( const string& error ){
+    if( loglevel >= 3 ) *logfile << "TileManager :: Unable to demote tile: " << error << endl;
+  }
+}
+
+
+
 RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
 
-  RawTile* rawtile = NULL;
+  RawTile rawtile;
+  bool found = false;
   string tileCompression;
   string compName;
 
@@ -166,35 +229,36 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
   if( loglevel >= 2 ) tile_timer.start();
 
 
-  /* Try to get this tile from our cache first as a JPEG, then uncompressed
+  /* Try to get this tile from our cache first from the encoded tier as a JPEG,
+     then from the raw tier uncompressed, which requires compression.
      Otherwise decode one from the source image and add it to the cache
    */
   switch( c )
     {
 
     case JPEG:
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					  xangle, yangle, JPEG, jpeg->getQuality() )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, DEFLATE, 0 )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+				       xangle, yangle, JPEG, jpeg->getQuality(), rawtile )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+				       xangle, yangle, DEFLATE, 0, rawtile )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+				       xangle, yangle, UNCOMPRESSED, 0, rawtile )) ) break;
       break;
 
 
     case DEFLATE:
 
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, DEFLATE, 0 )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+				       xangle, yangle, DEFLATE, 0, rawtile )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+				       xangle, yangle, UNCOMPRESSED, 0, rawtile )) ) break;
       break;
 
 
     case UNCOMPRESSED:
 
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+				       xangle, yangle, UNCOMPRESSED, 0, rawtile )) ) break;
       break;
 
 
@@ -205,16 +269,19 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 
 
   // If we haven't been able to get a tile, get a raw one
-  if( !rawtile || (rawtile && (rawtile->timestamp < image->timestamp)) ){
+  if( !found || (rawtile.timestamp < image->timestamp) ){
 
-    if( rawtile && (rawtile->timestamp < image->timestamp) ){
+    if( found && (rawtile.timestamp < image->timestamp) ){
       if( loglevel >= 3 ) *logfile << "TileManager :: Tile has old timestamp "
-			           << rawtile->timestamp << " - " << image->timestamp
+			           << rawtile.timestamp << " - " << image->timestamp
                                    << " ... updating" << endl;
     }
 
     RawTile newtile = this->getNewTile( resolution, tile, xangle, yangle, layers, c );
 
+    // Inserting our new tile may have evicted raw tiles that can be kept in encoded form
+    this->demote();
+
     if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
 				 << tile_timer.getTime() << " microseconds" << endl;
     return newtile;
@@ -222,7 +289,7 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 
 
   // Define our compression names
-  switch( rawtile->compressionType ){
+  switch( rawtile.compressionType ){
     case JPEG: compName = "JPEG"; break;
     case DEFLATE: compName = "DEFLATE"; break;
     case UNCOMPRESSED: compName = "UNCOMPRESSED"; break;
@@ -240,45 +307,40 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
   // Check whether the compression used for out tile matches our requested compression type.
   // If not, we must convert
 
-  if( c == JPEG && rawtile->compressionType == UNCOMPRESSED ){
-
-    // Rawtile is a pointer to the cache data, so we need to create a copy of it in case we compress it
-    RawTile ttt( *rawtile );
+  if( c == JPEG && rawtile.compressionType == UNCOMPRESSED ){
 
     // Do our JPEG compression iff we have an 8 bit per channel image and either 1 or 3 bands
-    if( rawtile->bpc==8 && (rawtile->channels==1 || rawtile->channels==3) ){
+    if( rawtile.bpc==8 && (rawtile.channels==1 || rawtile.channels==3) ){
 
       // Crop if this is an edge tile
-      if( ( (ttt.width != image->getTileWidth()) || (ttt.height != image->getTileHeight()) ) && ttt.padded ){
+      if( ( (rawtile.width != image->getTileWidth()) || (rawtile.height != image->getTileHeight()) ) && rawtile.padded ){
 	if( loglevel >= 5 ) * logfile << "TileManager :: Cropping tile" << endl;
-	this->crop( &ttt );
+	this->crop( &rawtile );
       }
 
-      if( loglevel >=2 ) compression_timer.start();
-      unsigned int oldlen = rawtile->dataLength;
-      unsigned int newlen = jpeg->Compress( ttt );
+      compression_timer.start();
+      unsigned int oldlen = rawtile.dataLength;
+      unsigned int newlen = jpeg->Compress( rawtile );
+      long cost = compression_timer.getTime();
       if( loglevel >= 2 ) *logfile << "TileManager :: JPEG requested, but UNCOMPRESSED compression found in cache." << endl
 				   << "TileManager :: JPEG Compression Time: "
-				   << compression_timer.getTime() << " microseconds" << endl
+				   << cost << " microseconds" << endl
 				   << "TileManager :: Compression Ratio: " << newlen << "/" << oldlen << " = "
 				   << ( (float)newlen/(float)oldlen ) << endl;
 
-      // Add our compressed tile to the cache
+      // Add our compressed tile to the cache - regenerating it only requires compression
       if( loglevel >= 2 ) insert_timer.start();
-      tileCache->insert( ttt );
+      rawtile.share();
+      tileCache->insert( rawtile, cost, bulk );
       if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 				   << " microseconds" << endl;
-
-      if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
-				   << tile_timer.getTime() << " microseconds" << endl;
-      return RawTile( ttt );
     }
   }
 
   if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
 			       << tile_timer.getTime() << " microseconds" << endl;
 
-  return RawTile( *rawtile );
+  return rawtile;
 
 
 }
@@ -300,10 +362,6 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
   unsigned int src_tile_width = image->getTileWidth();
   unsigned int src_tile_height = image->getTileHeight();
 
-  // The tile size of the destination tile
-  unsigned int dst_tile_width = src_tile_width;
-  unsigned int dst_tile_height = src_tile_height;
-
   // The basic tile size ie. not the current tile
   unsigned int basic_tile_width = src_tile_width;
   unsigned int basic_tile_height = src_tile_height;
@@ -347,6 +405,13 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
   }
 
 
+  // Large regions are bulk reads, whose tiles must not flush the tiles of interactive requests
+  bulk = ( bulk_region_tiles > 0 && (endx-startx)*(endy-starty) > bulk_region_tiles );
+  if( bulk && loglevel >= 3 ){
+    *logfile << "TileManager getRegion :: Bulk read of " << (endx-startx)*(endy-starty)
+	     << " tiles: tiles will only be cached if they do not displace others" << endl;
+  }
+
   unsigned int channels = image->getNumChannels();
   unsigned int bpc = image->getNumBitsPerPixel();
   SampleType sampleType = image->getSampleType();
@@ -365,125 +430,136 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
   else if( bpc == 32 && sampleType == FIXEDPOINT ) region.data = new int[width*height*channels];
   else if( bpc == 32 && sampleType == FLOATINGPOINT ) region.data = new float[width*height*channels];
 
-  unsigned int current_height = 0;
+  unsigned int ncols = endx - startx;
+  unsigned int ntiles = ncols * (endy - starty);
+  unsigned int bytes = bpc / 8;
+
+
+  // Tiles are fetched and decoded in parallel by up to region_threads threads. Every additional
+  // thread has a TileManager, log buffer and decoder of its own, as a decoder holds the state of its open file
+  int threads = 1;
+#if defined(_OPENMP)
+  if( !omp_in_parallel() ) threads = std::min( (int) region_threads, omp_get_max_threads() );
+  if( threads > (int) ntiles ) threads = ntiles;
+#endif
+
+  vector<IIPImage*> decoders;
+  for( int t = 1; t < threads; t++ ){
+    IIPImage* decoder = pool ? pool->checkout( image->getImagePath(), image->timestamp ) : NULL;
+    if( !decoder && (decoder = image->clone()) ){
+      try{
+	decoder->openImage();
+      }
+      catch( const file_error& error ){
+	delete decoder;
+	decoder = NULL;
+      }
+    }
+    if( !decoder ) break;
+    decoders.push_back( decoder );
+  }
+  threads = decoders.size() + 1;
+
+  vector<std::ostringstream> logs( decoders.size() );
+  vector<TileManager> managers;
+  for( unsigned int t = 0; t < decoders.size(); t++ ){
+    managers.push_back( TileManager( tileCache, decoders[t], watermark, jpeg, &logs[t], loglevel ) );
+    managers.back().bulk = bulk;
+  }
+
+  if( threads > 1 && loglevel >= 3 ){
+    *logfile << "TileManager getRegion :: Decoding " << ntiles << " tiles with " << threads << " threads" << endl;
+  }
+
+  // Let the image read ahead the tiles of our region, in whatever order they are decoded
+  vector<unsigned int> tiles;
+  tiles.reserve( ntiles );
+  for( unsigned int i = starty; i < endy; i++ ){
+    for( unsigned int j = startx; j < endx; j++ ) tiles.push_back( (i*ntlx) + j );
+  }
+  image->prefetchTiles( seq, ang, res, tiles );
+
+  std::exception_ptr error;
 
-  // Decode the image strip by strip
-  for( unsigned int i=starty; i<endy; i++ ){
+#if defined(_OPENMP)
+#pragma omp parallel for schedule(dynamic, 1) num_threads(threads) if (threads > 1)
+#endif
+  for( int n = 0; n < (int) ntiles; n++ ){
 
-    unsigned int buffer_index = 0;
+#if defined(_OPENMP)
+    int t = omp_get_thread_num();
+#else
+    int t = 0;
+#endif
+    TileManager& manager = ( t == 0 ) ? *this : managers[t-1];
 
-    // Keep track of the current pixel boundary horizontally. ie. only up
-    //  to the beginning of the current tile boundary.
-    unsigned int current_width = 0;
+    try{
 
-    for( unsigned int j=startx; j<endx; j++ ){
+      unsigned int i = starty + n / ncols;
+      unsigned int j = startx + n % ncols;
 
       // Time the tile retrieval
-      if( loglevel >= 2 ) tile_timer.start();
+      if( loglevel >= 2 ) manager.tile_timer.start();
 
       // Get an uncompressed tile
-      RawTile rawtile = this->getTile( res, (i*ntlx) + j, seq, ang, layers, UNCOMPRESSED );
+      RawTile rawtile = manager.getTile( res, (i*ntlx) + j, seq, ang, layers, UNCOMPRESSED );
 
       if( loglevel >= 2 ){
-	*logfile << "TileManager getRegion :: Tile access time " << tile_timer.getTime() << " microseconds for tile "
-		 << (i*ntlx) + j << " at resolution " << res << endl;
+	*manager.logfile << "TileManager getRegion :: Tile access time " << manager.tile_timer.getTime()
+			 << " microseconds for tile " << (i*ntlx) + j << " at resolution " << res << endl;
       }
 
-
       // Only print this out once per image
-      if( (loglevel >= 4) && (i==starty) && (j==starty) ){
-	*logfile << "TileManager getRegion :: Tile data is " << rawtile.channels << " channels, "
-		 << rawtile.bpc << " bits per channel" << endl;
+      if( (loglevel >= 4) && (n == 0) ){
+	*manager.logfile << "TileManager getRegion :: Tile data is " << rawtile.channels << " channels, "
+			 << rawtile.bpc << " bits per channel" << endl;
       }
 
-      // Set the tile width and height to be that of the source tile - Use the rawtile data
-      // because if we take a tile from cache the image pointer will not necessarily be pointing
-      // to the the current tile
-      src_tile_width = rawtile.width;
-      src_tile_height = rawtile.height;
-      dst_tile_width = src_tile_width;
-      dst_tile_height = src_tile_height;
-
-      // Variables for the pixel offset within the current tile
-      unsigned int xf = 0;
-      unsigned int yf = 0;
-
-      // If our viewport has been set, we need to modify our start
-      // and end points on the source image
-      if( !( x==0 && y==0 && width==im_width && height==im_height ) ){
-
-	unsigned int remainder;  // Remaining pixels in the final row or column
-
-	if( j == startx ){
-	  // Calculate the width used in the current tile
-	  // If there is only 1 tile, the width is just the view width
-	  if( j < endx - 1 ) dst_tile_width = src_tile_width - xoffset;
-	  else dst_tile_width = width;
-	  xf = xoffset;
-	}
-	else if( j == endx-1 ){
-	  // If this is the final row, calculate the remaining number of pixels
-	  remainder = (width+x) % basic_tile_width;
-	  if( remainder != 0 ) dst_tile_width = remainder;
-	}
-
-	if( i == starty ){
-	  // Calculate the height used in the current row of tiles
-	  // If there is only 1 row the height is just the view height
-	  if( i < endy - 1 ) dst_tile_height = src_tile_height - yoffset;
-	  else dst_tile_height = height;
-	  yf = yoffset;
-	}
-	else if( i == endy-1 ){
-	  // If this is the final row, calculate the remaining number of pixels
-	  remainder = (height+y) % basic_tile_height;
-	  if( remainder != 0 ) dst_tile_height = remainder;
-	}
-
-	if( loglevel >= 4 ){
-	  *logfile << "TileManager getRegion :: destination tile width: " << dst_tile_width
-		   << ", tile height: " << dst_tile_height << endl;
-	}
+      // The part of this tile within our region. Each tile is written directly into its
+      // own rectangle of the region, so tiles can be copied in any order
+      unsigned int tx = j * basic_tile_width;
+      unsigned int ty = i * basic_tile_height;
+      unsigned int x0 = ( x > tx ) ? x : tx;
+      unsigned int y0 = ( y > ty ) ? y : ty;
+      unsigned int x1 = std::min( std::min( x + width, tx + basic_tile_width ), im_width );
+      unsigned int y1 = std::min( std::min( y + height, ty + basic_tile_height ), im_height );
+
+      if( loglevel >= 4 ){
+	*manager.logfile << "TileManager getRegion :: destination tile width: " << x1 - x0
+			 << ", tile height: " << y1 - y0 << endl;
       }
 
-
-      // Copy our tile data into the appropriate part of the strip memory
+      // Copy our tile data into the appropriate part of the region
       // one whole tile width at a time
-      for( unsigned int k=0; k<dst_tile_height; k++ ){
-
-	buffer_index = (current_width*channels) + (k*width*channels) + (current_height*width*channels);
-	unsigned int inx = ((k+yf)*rawtile.width*channels) + (xf*channels);
-
-	// Simply copy the line of data across
-	if( bpc == 8 ){
-	  unsigned char* ptr = (unsigned char*) rawtile.data;
-	  unsigned char* buf = (unsigned char*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels );
-	}
-	else if( bpc ==  16 ){
-	  unsigned short* ptr = (unsigned short*) rawtile.data;
-	  unsigned short* buf = (unsigned short*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*2 );
-	}
-	else if( bpc == 32 && sampleType == FIXEDPOINT ){
-	  unsigned int* ptr = (unsigned int*) rawtile.data;
-	  unsigned int* buf = (unsigned int*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
-	else if( bpc == 32 && sampleType == FLOATINGPOINT ){
-	  float* ptr = (float*) rawtile.data;
-	  float* buf = (float*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
+      const unsigned char* ptr = (const unsigned char*) rawtile.data;
+      unsigned char* buf = (unsigned char*) region.data;
+      for( unsigned int k = y0; k < y1; k++ ){
+	size_t buffer_index = ( (size_t)(k-y) * width + (x0-x) ) * channels * bytes;
+	size_t inx = ( (size_t)(k-ty) * rawtile.width + (x0-tx) ) * channels * bytes;
+	memcpy( &buf[buffer_index], &ptr[inx], (x1-x0) * channels * bytes );
       }
 
-      current_width += dst_tile_width;
     }
+    catch( ... ){
+#if defined(_OPENMP)
+#pragma omp critical
+#endif
+      if( !error ) error = std::current_exception();
+    }
+  }
 
-    current_height += dst_tile_height;
+  bulk = false;
 
+  // Return our additional decoders to the pool, which closes them if a tile failed,
+  // and append their logs to ours
+  for( unsigned int t = 0; t < decoders.size(); t++ ){
+    if( pool ) pool->checkin( decoders[t], !error );
+    else delete decoders[t];
+    *logfile << logs[t].str();
   }
 
+  if( error ) std::rethrow_exception( error );
+
   return region;
 
 }
@@ -28,8 +28,9 @@
 
 #include "RawTile.h"
 #include "IIPImage.h"
+#include "ImagePool.h"
 #include "JPEGCompressor.h"
-#include "Cache.h"
+#include "TileCache.h"
 #include "Timer.h"
 #include "Watermark.h"
 
@@ -42,13 +43,28 @@ class TileManager{
 
  private:
 
-  Cache* tileCache;
+  TileCache* tileCache;
   Compressor* jpeg;
   IIPImage* image;
   Watermark* watermark;
-  std::ofstream* logfile;
+  std::ostream* logfile;
   int loglevel;
-  Timer compression_timer, tile_timer, insert_timer;
+  Timer compression_timer, tile_timer, insert_timer, generation_timer;
+
+  /// Regions covering more than this number of tiles are bulk reads - 0 for none
+  unsigned int bulk_region_tiles;
+
+  /// Maximum number of threads decoding the tiles of a region
+  unsigned int region_threads;
+
+  /// Whether we are in the middle of a bulk read, whose tiles must not displace cached tiles
+  bool bulk;
+
+  /// Whether JPEG tiles stored in the image may be sent without re-encoding
+  bool passthrough;
+
+  /// Pool of open decoders used for decoding region tiles in parallel - may be NULL
+  ImagePool* pool;
 
   /// Get a new tile from the image file
   /**
@@ -72,6 +88,10 @@ class TileManager{
   void crop( RawTile* t );
 
 
+  /// Compress a raw tile evicted from the cache and re-insert it as a JPEG tile
+  void demote();
+
+
  public:
 
 
@@ -81,19 +101,55 @@ class TileManager{
    * @param im pointer to IIPImage object
    * @param w  pointer to watermark object
    * @param j  pointer to JPEGCompressor object
-   * @param s  pointer to output file stream
+   * @param s  pointer to output log stream
    * @param l  logging level
    */
-  TileManager( Cache* tc, IIPImage* im, Watermark* w, Compressor* j, std::ofstream* s, int l ){
+  TileManager( TileCache* tc, IIPImage* im, Watermark* w, Compressor* j, std::ostream* s, int l ){
     tileCache = tc; 
     image = im;
     watermark = w;
     jpeg = j;
     logfile = s ;
     loglevel = l;
+    bulk_region_tiles = 0;
+    region_threads = 1;
+    bulk = false;
+    passthrough = false;
+    pool = NULL;
   };
 
 
+  /// Set the size above which regions are treated as bulk reads
+  /** The tiles decoded for bulk reads are only cached if they do not displace other tiles
+      @param n number of tiles, or 0 to always cache region tiles normally
+   */
+  void setBulkRegionTiles( unsigned int n ){ bulk_region_tiles = n; };
+
+
+  /// Set the maximum number of threads decoding the tiles of a region
+  /** Requests are served by several workers at once, so this is kept to a share of the cores
+      @param n number of threads, including the calling thread
+   */
+  void setRegionThreads( unsigned int n ){ region_threads = ( n > 0 ) ? n : 1; };
+
+
+  /// Set whether JPEG tiles stored in the image may be sent as they are
+  /** Only enable this if nothing requires the tile's pixels or a particular
+      JPEG quality or ICC profile. Tiles are never passed through if we have a watermark
+      @param p whether to pass stored JPEG tiles through
+   */
+  void setJPEGPassthrough( bool p ){ passthrough = p; };
+
+
+  /// Set the pool from which additional decoders are taken when decoding regions
+  /** The tiles of regions are decoded in parallel, each thread with a decoder of its
+      own. Decoders are taken from and returned to this pool, or are otherwise opened
+      for each region
+      @param p image pool
+   */
+  void setImagePool( ImagePool* p ){ pool = p; };
+
+
 
   /// Get a tile from the cache
   /**
@@ -0,0 +1,155 @@
+// Member functions for TileWarmer.h
+
+/*  IIP Image Server
+
+    Copyright (C) 2020 KML Vision GmbH.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <sstream>
+#include "TileWarmer.h"
+#include "TileManager.h"
+#include "JPEGCompressor.h"
+
+
+using namespace std;
+
+
+
+TileWarmer::TileWarmer( TileCache* tc, ImagePool* ip, Watermark* w, unsigned int r, int q ) :
+  tileCache( tc ), imagePool( ip ), watermark( w ), resolutions( r ), quality( q ),
+  images( 0 ), tiles( 0 ), stopping( false )
+{
+  worker = std::thread( &TileWarmer::run, this );
+}
+
+
+
+TileWarmer::~TileWarmer(){
+  {
+    lock_guard<mutex> guard( lock );
+    stopping = true;
+  }
+  ready.notify_one();
+  if( worker.joinable() ) worker.join();
+  for( deque<IIPImage*>::iterator i = queue.begin(); i != queue.end(); ++i ) delete *i;
+}
+
+
+
+bool TileWarmer::schedule( IIPImage* image ){
+  {
+    lock_guard<mutex> guard( lock );
+    if( !stopping && queue.size() < maxQueued && pending.insert( image->getImagePath() ).second ){
+      queue.push_back( image );
+      image = NULL;
+    }
+  }
+  if( image ){
+    delete image;
+    return false;
+  }
+  ready.notify_one();
+  return true;
+}
+
+
+
+void TileWarmer::run(){
+
+  unique_lock<mutex> guard( lock );
+
+  while( true ){
+
+    ready.wait( guard, [this]{ return stopping || !queue.empty(); } );
+    if( stopping ) return;
+
+    IIPImage* image = queue.front();
+    queue.pop_front();
+    guard.unlock();
+
+    string path = image->getImagePath();
+    unsigned long n = 0;
+    bool opened = false;
+    try{
+      n = this->warm( image );
+      opened = true;
+    }
+    catch( ... ){
+      // Errors are reported when the image is requested
+    }
+
+    // Hand our opened decoder over to requests
+    if( opened ) imagePool->checkin( image );
+    else delete image;
+
+    guard.lock();
+    pending.erase( path );
+    if( opened ) images++;
+    tiles += n;
+  }
+}
+
+
+
+unsigned long TileWarmer::warm( IIPImage* image ){
+
+  image->openImage();
+
+  // Tiles are cached as JPEG where possible and uncompressed otherwise, as done by JTL
+  CompressionType ct = ( image->getNumBitsPerPixel() == 8 &&
+			 (image->getNumChannels() == 1 || image->getNumChannels() == 3) ) ? JPEG : UNCOMPRESSED;
+
+  // Use our own compressor without any ICC profile or XMP metadata and discard any logging
+  JPEGCompressor jpeg( quality );
+  ostringstream log;
+  TileManager tilemanager( tileCache, image, watermark, &jpeg, &log, 0 );
+
+  unsigned int num_res = image->getNumResolutions();
+  unsigned int tw = image->getTileWidth();
+  unsigned int th = image->getTileHeight();
+  unsigned long n = 0;
+
+  for( unsigned int res = 0; res < resolutions && res < num_res; res++ ){
+
+    unsigned int width = image->image_widths[num_res-res-1];
+    unsigned int height = image->image_heights[num_res-res-1];
+    unsigned int ntiles = ( (width + tw - 1) / tw ) * ( (height + th - 1) / th );
+
+    for( unsigned int tile = 0; tile < ntiles; tile++ ){
+      if( stopping ) return n;
+      tilemanager.getTile( res, tile, image->currentX, image->currentY, 0, ct );
+      n++;
+    }
+  }
+
+  return n;
+}
+
+
+
+unsigned long TileWarmer::getImages(){
+  lock_guard<mutex> guard( lock );
+  return images;
+}
+
+
+
+unsigned long TileWarmer::getTiles(){
+  lock_guard<mutex> guard( lock );
+  return tiles;
+}
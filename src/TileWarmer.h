@@ -0,0 +1,134 @@
+// Background Tile Cache Warmer
+
+/*  IIP Image Server
+
+    Copyright (C) 2020 KML Vision GmbH.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TILEWARMER_H
+#define _TILEWARMER_H
+
+
+#include <string>
+#include <deque>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include "IIPImage.h"
+#include "TileCache.h"
+#include "ImagePool.h"
+#include "Watermark.h"
+
+
+
+/// Decodes and compresses the tiles of the lowest resolutions of newly opened
+/// images in a background thread, so that the first views of an image are
+/// served from the tile cache.
+/**
+ *  Each scheduled image comes with its own, not yet opened, decoder. Once
+ *  warmed, the decoder is returned to the image pool for re-use by requests.
+ *  Images are dropped if too many are already waiting.
+ */
+
+class TileWarmer {
+
+ private:
+
+  /// Tile cache to fill
+  TileCache* tileCache;
+
+  /// Pool receiving our decoders once done
+  ImagePool* imagePool;
+
+  /// Watermark applied to tiles
+  Watermark* watermark;
+
+  /// Number of lowest resolutions to warm
+  unsigned int resolutions;
+
+  /// JPEG quality of warmed tiles
+  int quality;
+
+  /// Decoders of images waiting to be warmed
+  std::deque<IIPImage*> queue;
+
+  /// Paths of images waiting or being warmed
+  std::set<std::string> pending;
+
+  /// Number of images and tiles warmed
+  unsigned long images, tiles;
+
+  /// Whether our thread should exit - also checked between tiles
+  std::atomic<bool> stopping;
+
+  /// Lock and condition protecting our queue
+  std::mutex lock;
+  std::condition_variable ready;
+
+  /// Our background thread
+  std::thread worker;
+
+  /// Maximum number of images waiting
+  static const unsigned int maxQueued = 32;
+
+
+  /// Background thread: warm queued images until stopped
+  void run();
+
+  /// Warm the tiles of an image
+  /** @param image decoder, which is opened here
+      @return number of tiles warmed
+   */
+  unsigned long warm( IIPImage* image );
+
+
+ public:
+
+  /// Constructor
+  /** @param tc tile cache to fill
+      @param ip image pool receiving our decoders
+      @param w watermark applied to tiles
+      @param r number of lowest resolutions to warm
+      @param q JPEG quality of warmed tiles
+   */
+  TileWarmer( TileCache* tc, ImagePool* ip, Watermark* w, unsigned int r, int q );
+
+  /// Destructor - stops our thread and drops any images still waiting
+  ~TileWarmer();
+
+  /// Schedule an image for warming
+  /** @param image unopened decoder for the image - ownership passes to the warmer
+      @return whether the image was scheduled - otherwise the decoder has been deleted
+   */
+  bool schedule( IIPImage* image );
+
+  /// Return the number of lowest resolutions we warm
+  unsigned int getResolutions() { return resolutions; }
+
+  /// Return the number of images warmed
+  unsigned long getImages();
+
+  /// Return the number of tiles warmed
+  unsigned long getTiles();
+
+};
+
+
+#endif
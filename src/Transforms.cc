@@ -72,7 +72,9 @@ void Transform::normalize( RawTile& in, const vector<float>& max, const vector<f
   unsigned short* usptr;
   unsigned char* ucptr;
 
+  // Floating point data is normalized in place, other data into a new buffer
   if( in.bpc == 32 && in.sampleType == FLOATINGPOINT ) {
+    in.unshare();
     normdata = (float*)in.data;
   }
   else {
@@ -136,16 +138,8 @@ void Transform::normalize( RawTile& in, const vector<float>& max, const vector<f
     }
   }
 
-  // Delete our original buffers, unless we already had floats
-  if( in.bpc == 32 && in.sampleType == FIXEDPOINT ){
-    delete[] (unsigned int*) in.data;
-  }
-  else if( in.bpc == 16 ){
-    delete[] (unsigned short*) in.data;
-  }
-  else if( in.bpc == 8 ){
-    delete[] (unsigned char*) in.data;
-  }
+  // Release our original buffer, unless we already had floats
+  if( !( in.bpc == 32 && in.sampleType == FLOATINGPOINT ) ) in.deallocate();
 
   // Assign our new buffer and modify some info
   in.data = normdata;
@@ -217,8 +211,8 @@ void Transform::shade( RawTile& in, int h_angle, int v_angle ){
   }
 
 
-  // Delete old data buffer
-  delete[] (float*) in.data;
+  // Release old data buffer
+  in.deallocate();
 
   in.data = buffer;
   in.channels = 1;
@@ -318,6 +312,8 @@ void Transform::LAB2sRGB( unsigned char *in, unsigned char *out ){
 // Convert whole tile from CIELAB to sRGB
 void Transform::LAB2sRGB( RawTile& in ){
 
+  in.unshare();
+
   unsigned long np = in.width * in.height * in.channels;
 
   // Parallelize code using OpenMP
@@ -457,8 +453,8 @@ void Transform::cmap( RawTile& in, enum cmap_type cmap ){
 
   };
 
-  // Delete old data buffer
-  delete[] (float*) in.data;
+  // Release old data buffer
+  in.deallocate();
   in.data = outptr;
   in.channels = out_chan;
   in.dataLength = ndata * out_chan * (in.bpc/8);
@@ -469,6 +465,8 @@ void Transform::cmap( RawTile& in, enum cmap_type cmap ){
 // Inversion function
 void Transform::inv( RawTile& in ){
 
+  in.unshare();
+
   unsigned int np = in.dataLength * 8 / in.bpc;
   float *infptr = (float*) in.data;
 
@@ -490,7 +488,7 @@ void Transform::inv( RawTile& in ){
 void Transform::interpolate_nearestneighbour( RawTile& in, unsigned int resampled_width, unsigned int resampled_height ){
 
   // Pointer to input buffer
-  unsigned char *input = (unsigned char*) in.data;
+  unsigned char *input;
 
   int channels = in.channels;
   unsigned int width = in.width;
@@ -499,13 +497,18 @@ void Transform::interpolate_nearestneighbour( RawTile& in, unsigned int resample
   // Pointer to output buffer
   unsigned char *output;
 
-  // Create new buffer if size is larger than input size
+  // Create new buffer if size is larger than input size. Otherwise resample in place,
+  // which requires a copy of our data only if it is shared with cached tiles
   bool new_buffer = false;
   if( resampled_width*resampled_height > in.width*in.height ){
     new_buffer = true;
     output = new unsigned char[resampled_width*resampled_height*in.channels];
   }
-  else output = (unsigned char*) in.data;
+  else{
+    in.unshare();
+    output = (unsigned char*) in.data;
+  }
+  input = (unsigned char*) in.data;
 
   // Calculate our scale
   float xscale = (float)width / (float)resampled_width;
@@ -527,8 +530,8 @@ void Transform::interpolate_nearestneighbour( RawTile& in, unsigned int resample
     }
   }
 
-  // Delete original buffer
-  if( new_buffer ) delete[] (unsigned char*) input;
+  // Release original buffer
+  if( new_buffer ) in.deallocate();
 
   // Correctly set our Rawtile info
   in.width = resampled_width;
@@ -610,8 +613,8 @@ void Transform::interpolate_bilinear( RawTile& in, unsigned int resampled_width,
     }
   }
 
-  // Delete original buffer
-  delete[] (unsigned char*) input;
+  // Release original buffer
+  in.deallocate();
 
   // Correctly set our Rawtile info
   in.width = resampled_width;
@@ -640,7 +643,7 @@ void Transform::contrast( RawTile& in, float c ){
   }
 
   // Replace original buffer with new
-  delete[] (float*) in.data;
+  in.deallocate();
   in.data = buffer;
   in.bpc = 8;
   in.dataLength = np * (in.bpc/8);
@@ -653,6 +656,8 @@ void Transform::gamma( RawTile& in, float g ){
 
   if( g == 1.0 ) return;
 
+  in.unshare();
+
   unsigned int np = in.dataLength * 8 / in.bpc;
   float* infptr = (float*)in.data;
 
@@ -728,8 +733,8 @@ void Transform::rotate( RawTile& in, float angle=0.0 ){
       }
     }
 
-    // Delete old data buffer
-    delete[] (unsigned char*) in.data;
+    // Release old data buffer
+    in.deallocate();
 
     // Assign new data to Rawtile
     in.data = buffer;
@@ -770,8 +775,8 @@ void Transform::greyscale( RawTile& rawtile ){
     buffer[i] = (unsigned char)( ( 1254097*R + 2462056*G + 478151*B ) >> 22 );
   }
 
-  // Delete our old data buffer and instead point to our grayscale data
-  delete[] (unsigned char*) rawtile.data;
+  // Release our old data buffer and instead point to our grayscale data
+  rawtile.deallocate();
   rawtile.data = (void*) buffer;
 
   // Update our number of channels and data length
@@ -784,6 +789,8 @@ void Transform::greyscale( RawTile& rawtile ){
 // Apply twist or channel recombination to colour or multi-channel image
 void Transform::twist( RawTile& rawtile, const vector< vector<float> >& matrix ){
 
+  rawtile.unshare();
+
   unsigned long np = rawtile.width * rawtile.height;
 
   // Create temporary buffer for our calculated values
@@ -831,6 +838,8 @@ void Transform::twist( RawTile& rawtile, const vector< vector<float> >& matrix )
 // away extra bands
 void Transform::flatten( RawTile& in, int bands ){
 
+  in.unshare();
+
   // We cannot increase the number of channels
   if( bands >= in.channels ) return;
 
@@ -893,8 +902,8 @@ void Transform::flip( RawTile& rawtile, int orientation ){
     }
   }
 
-  // Delete our old data buffer and instead point to our grayscale data
-  delete[] (unsigned char*) rawtile.data;
+  // Release our old data buffer and instead point to our grayscale data
+  rawtile.deallocate();
   rawtile.data = (void*) buffer;
 }
 
@@ -979,6 +988,7 @@ void Transform::binary( RawTile &in, unsigned char threshold ){
 
   // First make sure our image is greyscale
   this->greyscale( in );
+  in.unshare();
 
   unsigned int np = in.width * in.height;
 
@@ -996,6 +1006,8 @@ void Transform::binary( RawTile &in, unsigned char threshold ){
 
 void Transform::equalize( RawTile& in, vector<unsigned int>& histogram ){
 
+  in.unshare();
+
   // Number of levels in our histogram
   const unsigned int bits = histogram.size();
 
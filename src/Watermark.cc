@@ -28,6 +28,10 @@
 #include "Watermark.h"
 #include <cstring>
 #include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <random>
+#include <thread>
 #include <tiff.h>
 #include <tiffio.h>
 
@@ -86,6 +90,16 @@ void Watermark::init()
 
 
 
+// Random number as a float between 0 and 1. Tiles are watermarked by several threads at once,
+// so each thread draws from a generator of its own rather than from rand()
+static float randomFraction()
+{
+  static thread_local std::minstd_rand generator( (unsigned int) time( NULL ) ^
+						  (unsigned int) std::hash<std::thread::id>()( std::this_thread::get_id() ) );
+  return (float)( generator() - generator.min() ) / ( generator.max() - generator.min() );
+}
+
+
 // Apply the watermark to a buffer of data
 void Watermark::apply( void* data, unsigned int width, unsigned int height, unsigned int channels, unsigned int bpc )
 {
@@ -94,7 +108,7 @@ void Watermark::apply( void* data, unsigned int width, unsigned int height, unsi
   if( !_isSet || (_probability==0) || (_opacity==0) ) return;
 
   // Get random number as a float between 0 and 1
-  float random = (float) rand() / RAND_MAX;
+  float random = randomFraction();
  
   // Only apply if our random number is less than our given probability
   if( random < _probability ){
@@ -102,13 +116,13 @@ void Watermark::apply( void* data, unsigned int width, unsigned int height, unsi
     // Vary watermark position randomly within the tile depending on available space
     unsigned int xoffset = 0;
     if( width > _width ){
-      random = (float) rand() / RAND_MAX;
+      random = randomFraction();
       xoffset = random * (width - _width);
     }
 
     unsigned int yoffset = 0;
     if( height > _height ){
-      random = (float) rand() / RAND_MAX;
+      random = randomFraction();
       yoffset = random * (height - _height);
     }
 
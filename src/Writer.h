@@ -25,6 +25,8 @@
 
 #include <fcgiapp.h>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 
 /// Virtual base class for various writers
@@ -56,6 +58,9 @@ class Writer {
 
 
 /// FCGI Writer Class
+/** Output is passed straight through to the FCGI stream. A copy of the response
+    is only kept if capturing has been enabled, so that it can be cached afterwards
+ */
 class FCGIWriter {
 
  private:
@@ -64,13 +69,32 @@ class FCGIWriter {
   FCGX_Stream *out;
   static const unsigned int bufsize = 65536;
 
+  /// Size of our allocated buffer
+  size_t capacity;
+
+  /// Whether we keep a copy of our output
+  bool capturing;
+
   /// Add the message to our buffer
   void cpy2buf( const char* msg, size_t len ){
-    if( sz+len > bufsize ) buffer = (char*) realloc( buffer, sz+len );
-    if( buffer ){
-      memcpy( &buffer[sz], msg, len );
-      sz += len;
+    if( !capturing ) return;
+    if( sz+len > capacity ){
+      size_t c = (capacity > 0) ? capacity : bufsize;
+      while( c < sz+len ) c *= 2;
+      char* b = (char*) realloc( buffer, c );
+      // Give up on an incomplete copy rather than cache a truncated response
+      if( !b ){
+	free( buffer );
+	buffer = NULL;
+	sz = capacity = 0;
+	capturing = false;
+	return;
+      }
+      buffer = b;
+      capacity = c;
     }
+    memcpy( &buffer[sz], msg, len );
+    sz += len;
   };
 
 
@@ -82,13 +106,26 @@ class FCGIWriter {
   /// Constructor
   FCGIWriter( FCGX_Stream* o ){
     out = o;
-    buffer = (char*) malloc(bufsize);
-    sz = 0;
+    buffer = NULL;
+    sz = capacity = 0;
+    capturing = false;
   };
 
   /// Destructor
   ~FCGIWriter(){ if(buffer) free(buffer); };
 
+  /// Enable or disable keeping a copy of subsequent output
+  void capture( bool c ){ capturing = c; };
+
+  /// Take ownership of the captured output, which must be released with free()
+  /** @return captured output of sz bytes or NULL if nothing was captured */
+  char* release(){
+    char* b = buffer;
+    buffer = NULL;
+    sz = capacity = 0;
+    return b;
+  };
+
   int putStr( const char* msg, int len ){
     cpy2buf( msg, len );
     return FCGX_PutStr( msg, len, out );
@@ -120,6 +157,9 @@ class FileWriter {
 
   FileWriter( FILE* o ){ out = o; };
 
+  /// Output is never kept for caching
+  void capture( bool c ){};
+
   int putStr( const char* msg, int len ){
     return fwrite( (void*) msg, sizeof(char), len, out );
   };